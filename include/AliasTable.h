@@ -0,0 +1,110 @@
+#ifndef ALIASTABLEH
+#define ALIASTABLEH
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ *
+ * Walker/Vose alias table over a discrete distribution. Built in O(n) from
+ * non-negative weights, after which sample() draws an index in O(1) from a
+ * single uniform random number.
+ *
+ */
+
+class AliasTable
+{
+public:
+    AliasTable() {}
+    AliasTable(const vector<float>& weights) { build(weights); }
+
+    void build(const vector<float>& weights);
+    int sample(float u) const;
+
+    // Probability of sample() returning index i.
+    float pmf(int i) const { return pmfs[i]; }
+    int size() const { return int(pmfs.size()); }
+
+    vector<float> probs;
+    vector<int> aliases;
+    vector<float> pmfs;
+};
+
+void AliasTable::build(const vector<float>& weights)
+{
+    const int n = int(weights.size());
+    probs.assign(n, 1.0);
+    aliases.resize(n);
+    pmfs.assign(n, 0.0);
+
+    double total = 0.0;
+    for (float w : weights)
+    {
+        total += w;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        aliases[i] = i;
+        pmfs[i] = total > 0.0 ? float(weights[i] / total) : 1.0f / n;
+    }
+
+    // Split the scaled probabilities into under- and overfull bins, then let
+    // every underfull bin borrow the rest of its mass from an overfull one.
+    vector<float> scaled(n);
+    vector<int> small;
+    vector<int> large;
+    for (int i = 0; i < n; i++)
+    {
+        scaled[i] = pmfs[i] * n;
+        if (scaled[i] < 1.0)
+        {
+            small.push_back(i);
+        }
+        else
+        {
+            large.push_back(i);
+        }
+    }
+
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+
+        probs[s] = scaled[s];
+        aliases[s] = l;
+
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+        if (scaled[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Whatever remains is full up to rounding error.
+    for (int i : small)
+    {
+        probs[i] = 1.0;
+    }
+    for (int i : large)
+    {
+        probs[i] = 1.0;
+    }
+}
+
+int AliasTable::sample(float u) const
+{
+    const int n = int(probs.size());
+    float scaled = u * n;
+    int i = min(int(scaled), n - 1);
+    float remainder = scaled - i;
+
+    return remainder < probs[i] ? i : aliases[i];
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef ANIMATIONH
+#define ANIMATIONH
+
+#include "vec3.h"
+#include "Camera.h"
+#include "Sphere.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+/**
+ *
+ * Keyframes of the camera and of objects of the scene, read from a text
+ * file with one keyframe per line:
+ *
+ *     camera <frame> <from x y z> <at x y z> <vertical fov>
+ *     object <index> <frame> <center x y z>
+ *
+ * where index is the object's place in the scene's list, counting from 0.
+ * Only spheres can be animated, by moving their center. Blank lines and
+ * lines starting with # are skipped. Between keyframes values are
+ * interpolated linearly; before the first and after the last they hold.
+ *
+ */
+
+struct CameraKey
+{
+    int frame;
+    vec3 from;
+    vec3 at;
+    float vfov;
+};
+
+struct ObjectKey
+{
+    int frame;
+    vec3 center;
+};
+
+struct ObjectTrack
+{
+    int index;
+    Sphere* pSphere;
+    vector<ObjectKey> keys;
+};
+
+class Animation
+{
+public:
+    // False with a message in error if the file cannot be read or parsed.
+    bool load(const string& path, string& error);
+    // Finds the spheres the object keyframes move among objects, false with
+    // a message in error if one is missing or not a sphere.
+    bool bind(const vector<Hitable*>& objects, string& error);
+
+    // Sets cam to where it is at frame, leaving it as it is if the camera
+    // has no keyframes.
+    void placeCamera(int frame, float aspect, Camera& cam) const;
+    // Moves the bound objects to where they are at frame.
+    void placeObjects(int frame) const;
+
+    // Frames from the first keyframe to the last
+    int firstFrame;
+    int lastFrame;
+    vector<CameraKey> cameraKeys;
+    vector<ObjectTrack> tracks;
+};
+
+// Index of the key before frame in keys sorted by frame, and how far frame
+// is from it to the next, in [0, 1]. Both keys are the same past the ends.
+template <typename Key>
+void bracket(const vector<Key>& keys, int frame, int& before, int& after, float& t)
+{
+    after = int(upper_bound(keys.begin(), keys.end(), frame, [](int f, const Key& key) { return f < key.frame; }) -
+                keys.begin());
+    before = max(after - 1, 0);
+    after = min(after, int(keys.size()) - 1);
+    t = after == before ? 0.0f : float(frame - keys[before].frame) / float(keys[after].frame - keys[before].frame);
+}
+
+bool Animation::load(const string& path, string& error)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        error = "Could not open " + path;
+        return false;
+    }
+
+    cameraKeys.clear();
+    tracks.clear();
+    string line;
+    for (int lineNumber = 1; getline(file, line); lineNumber++)
+    {
+        istringstream in(line);
+        string kind;
+        if (!(in >> kind) || kind[0] == '#')
+        {
+            continue;
+        }
+
+        bool parsed = false;
+        float x, y, z;
+        if (kind == "camera")
+        {
+            CameraKey key;
+            float ax, ay, az;
+            parsed = bool(in >> key.frame >> x >> y >> z >> ax >> ay >> az >> key.vfov);
+            key.from = vec3(x, y, z);
+            key.at = vec3(ax, ay, az);
+            if (parsed)
+            {
+                cameraKeys.push_back(key);
+            }
+        }
+        else if (kind == "object")
+        {
+            int index;
+            ObjectKey key;
+            parsed = bool(in >> index >> key.frame >> x >> y >> z) && index >= 0;
+            key.center = vec3(x, y, z);
+            if (parsed)
+            {
+                auto track = find_if(tracks.begin(), tracks.end(), [&](const ObjectTrack& t) { return t.index == index; });
+                if (track == tracks.end())
+                {
+                    tracks.push_back(ObjectTrack { index, nullptr, {} });
+                    track = tracks.end() - 1;
+                }
+                track->keys.push_back(key);
+            }
+        }
+        if (!parsed)
+        {
+            error = path + ":" + to_string(lineNumber) + ": cannot parse \"" + line + "\"";
+            return false;
+        }
+    }
+
+    auto byFrame = [](const auto& a, const auto& b) { return a.frame < b.frame; };
+    stable_sort(cameraKeys.begin(), cameraKeys.end(), byFrame);
+    firstFrame = cameraKeys.empty() ? INT_MAX : cameraKeys.front().frame;
+    lastFrame = cameraKeys.empty() ? INT_MIN : cameraKeys.back().frame;
+    for (ObjectTrack& track : tracks)
+    {
+        stable_sort(track.keys.begin(), track.keys.end(), byFrame);
+        firstFrame = min(firstFrame, track.keys.front().frame);
+        lastFrame = max(lastFrame, track.keys.back().frame);
+    }
+    if (firstFrame > lastFrame)
+    {
+        error = path + " has no keyframes";
+        return false;
+    }
+    return true;
+}
+
+bool Animation::bind(const vector<Hitable*>& objects, string& error)
+{
+    for (ObjectTrack& track : tracks)
+    {
+        track.pSphere = track.index < int(objects.size()) ? dynamic_cast<Sphere*>(objects[track.index]) : nullptr;
+        if (!track.pSphere)
+        {
+            error = "Object " + to_string(track.index) + " of the scene is not a sphere that can be animated";
+            return false;
+        }
+    }
+    return true;
+}
+
+void Animation::placeCamera(int frame, float aspect, Camera& cam) const
+{
+    if (cameraKeys.empty())
+    {
+        return;
+    }
+    int before, after;
+    float t;
+    bracket(cameraKeys, frame, before, after, t);
+    const CameraKey& a = cameraKeys[before];
+    const CameraKey& b = cameraKeys[after];
+    cam.lookAt((1.0f - t) * a.from + t * b.from, (1.0f - t) * a.at + t * b.at, vec3(0.0, 1.0, 0.0),
+               (1.0f - t) * a.vfov + t * b.vfov, aspect);
+}
+
+void Animation::placeObjects(int frame) const
+{
+    for (const ObjectTrack& track : tracks)
+    {
+        int before, after;
+        float t;
+        bracket(track.keys, frame, before, after, t);
+        track.pSphere->center = (1.0f - t) * track.keys[before].center + t * track.keys[after].center;
+    }
+}
+
+#endif
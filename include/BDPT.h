@@ -0,0 +1,630 @@
+#ifndef BDPTH
+#define BDPTH
+
+#include "Config.h"
+#include "Camera.h"
+#include "PathTracer.h"
+#include "AliasTable.h"
+#include "LightBounds.h"
+#include "Film.h"
+#include "Parallel.h"
+#include <vector>
+#include <unordered_map>
+#include <cfloat>
+
+using namespace std;
+
+/**
+ *
+ * Bidirectional path tracing (Veach 1997). Every sample traces a subpath
+ * from the camera and one from a light, connects each prefix of one to each
+ * prefix of the other, and weights the resulting paths with the power
+ * heuristic over all the ways they could have been sampled, using the
+ * recursive pdf ratios of pbrt's formulation. Connections straight to the
+ * camera land on other pixels and are splatted into a shared Film.
+ *
+ * Surfaces are modelled the way shadeHit() blends them: a diffuse lobe
+ * scaled by 1 - F, plus a specular reflection weighted by F, with F the
+ * Schlick term toward the camera side. Subpaths pick one of the two lobes
+ * at random. The reflection is treated as a delta lobe that connections
+ * never go through, even when rough. The environment and sky are only
+ * reached from the camera side, as in getColor().
+ *
+ */
+
+// Picks emitters in proportion to their power, to start light subpaths.
+struct EmitterDistribution
+{
+    void build(const vector<Hitable*>& lights);
+    const Hitable* sample(float u, float& pmf) const;
+    float pmf(const Hitable* pLight) const;
+
+    vector<Hitable*> lights;
+    unordered_map<const Hitable*, int> indices;
+    AliasTable table;
+};
+
+void EmitterDistribution::build(const vector<Hitable*>& sceneLights)
+{
+    lights = sceneLights;
+    vector<float> powers;
+    for (int i = 0; i < int(lights.size()); i++)
+    {
+        LightBounds bounds;
+        powers.push_back(lights[i]->lightBounds(bounds) ? bounds.power : 0.0);
+        indices[lights[i]] = i;
+    }
+    table.build(powers);
+}
+
+const Hitable* EmitterDistribution::sample(float u, float& pmf) const
+{
+    if (lights.empty())
+    {
+        return nullptr;
+    }
+
+    int i = table.sample(u);
+    pmf = table.pmf(i);
+    return lights[i];
+}
+
+float EmitterDistribution::pmf(const Hitable* pLight) const
+{
+    auto it = indices.find(pLight);
+    return it != indices.end() ? table.pmf(it->second) : 0.0;
+}
+
+enum VertexType
+{
+    CAMERA_VERTEX,
+    LIGHT_VERTEX,
+    SURFACE_VERTEX
+};
+
+// pdfFwd is the area density with which the subpath sampled this vertex, and
+// pdfRev the one with which the other direction would have.
+struct PathVertex
+{
+    VertexType type;
+    HitRecord rec; // Only p and normal for the camera, whose normal is its view axis
+    vec3 beta;
+    vec3 wPrev; // Unit direction toward the previous vertex on the subpath
+    float pdfFwd;
+    float pdfRev;
+    bool delta;
+};
+
+// Probability of following the specular lobe, given either of the two
+// directions at the surface; the Fresnel term is symmetric in them.
+float specularProbability(const HitRecord& rec, const vec3& w)
+{
+    float specular = luminance(fresnel(rec, w));
+    float diffuse = luminance((vec3(1, 1, 1) - fresnel(rec, w)) * diffuseAlbedo(rec));
+    return specular + diffuse > 0.0 ? specular / (specular + diffuse) : 0.0;
+}
+
+inline bool connectible(const PathVertex& v)
+{
+    return v.type != SURFACE_VERTEX || v.rec.pMat->scatterPdf(v.rec, v.rec.normal) > 0.0;
+}
+
+// Diffuse lobe between the direction toward the camera side and the one
+// toward the light side, without the cosine.
+vec3 diffuseBSDF(const PathVertex& v, const vec3& wEye, const vec3& wLight)
+{
+    if (dot(v.rec.normal, wEye) <= 0.0 || dot(v.rec.normal, wLight) <= 0.0)
+    {
+        return vec3(0, 0, 0);
+    }
+    return (vec3(1, 1, 1) - fresnel(v.rec, wEye)) * diffuseAlbedo(v.rec) / M_PI;
+}
+
+// Solid angle density of a subpath that arrived at v from wFrom continuing toward wTo.
+float diffusePdf(const PathVertex& v, const vec3& wFrom, const vec3& wTo)
+{
+    return (1.0 - specularProbability(v.rec, wFrom)) * cosinePdf(v.rec, wTo);
+}
+
+// Solid angle density of the camera shooting a ray along unit direction w.
+float cameraPdf(const Camera& cam, const vec3& w)
+{
+    float u;
+    float v;
+    float cosTheta = dot(w, cam.forward());
+    if (cosTheta <= 0.0 || !cam.project(cam.origin + w, u, v))
+    {
+        return 0.0;
+    }
+    return 1.0 / (cam.filmArea() * cosTheta * cosTheta * cosTheta);
+}
+
+float convertDensity(float pdf, const PathVertex& from, const PathVertex& to)
+{
+    vec3 d = to.rec.p - from.rec.p;
+    float distSquared = d.squared_length();
+    if (distSquared == 0.0)
+    {
+        return 0.0;
+    }
+    if (to.type != CAMERA_VERTEX)
+    {
+        pdf *= fabs(dot(to.rec.normal, d / sqrt(distSquared)));
+    }
+    return pdf / distSquared;
+}
+
+// Area density of v sampling next, where pPrev is the vertex before v.
+float vertexPdf(const Camera& cam, const PathVertex& v, const PathVertex* pPrev, const PathVertex& next)
+{
+    vec3 w = vec3::normalize(next.rec.p - v.rec.p);
+    float pdf;
+    if (v.type == CAMERA_VERTEX)
+    {
+        pdf = cameraPdf(cam, w);
+    }
+    else if (v.type == LIGHT_VERTEX)
+    {
+        pdf = cosinePdf(v.rec, w);
+    }
+    else
+    {
+        pdf = diffusePdf(v, vec3::normalize(pPrev->rec.p - v.rec.p), w);
+    }
+    return convertDensity(pdf, v, next);
+}
+
+// Area density of a light subpath starting on the emitter under v.
+inline float lightOriginPdf(const EmitterDistribution& emitters, const PathVertex& v)
+{
+    float area = v.rec.pObj->area();
+    return area > 0.0 ? emitters.pmf(v.rec.pObj) / area : 0.0;
+}
+
+// Continues a subpath from its last vertex along r, with throughput beta and
+// pdf the solid angle density of r, until it leaves the scene, is absorbed or
+// has maxVertices vertices. Camera subpaths pass pBackground, which gathers
+// the environment and sky light they pick up on the way.
+void randomWalk(const Scene& scene, ray r, vec3 beta, float pdf, bool lightPath, int maxVertices,
+                vector<PathVertex>& path, vec3* pBackground)
+{
+    float scatterPdf = 0.0;
+    while (int(path.size()) < maxVertices)
+    {
+        HitRecord rec;
+        if (!scene.world->hit(r, 0.001, FLT_MAX, rec))
+        {
+            if (pBackground)
+            {
+                *pBackground += beta * missColor(r, scene, scatterPdf);
+            }
+            return;
+        }
+
+        PathVertex vertex;
+        vertex.type = SURFACE_VERTEX;
+        vertex.rec = rec;
+        vertex.beta = beta;
+        vertex.wPrev = -vec3::normalize(r.direction());
+        vertex.pdfFwd = convertDensity(pdf, path.back(), vertex);
+        vertex.pdfRev = 0.0;
+        vertex.delta = false;
+        path.push_back(vertex);
+
+        PathVertex& v = path.back();
+        PathVertex& prev = path[path.size() - 2];
+
+        if (pBackground && connectible(v))
+        {
+            *pBackground += beta * (vec3(1, 1, 1) - fresnel(rec, v.wPrev)) * sampleEnvironment(scene, r, rec);
+        }
+
+        vec3 attenuation;
+        ray scattered;
+        float pdfRev;
+        float pSpecular = specularProbability(rec, v.wPrev);
+        if (getRand() < pSpecular)
+        {
+            if (!rec.pMat->reflect(r, rec, attenuation, scattered))
+            {
+                return;
+            }
+            beta *= SchlickApprox(rec.normal, vec3::normalize(scattered.direction()), attenuation) / pSpecular;
+
+            v.delta = true;
+            pdf = 0.0;
+            pdfRev = 0.0;
+            scatterPdf = 0.0;
+        }
+        else
+        {
+            if (!rec.pMat->scatter(r, rec, attenuation, scattered))
+            {
+                return;
+            }
+            vec3 w = vec3::normalize(scattered.direction());
+            pdf = diffusePdf(v, v.wPrev, w);
+            if (!(pdf > 0.0))
+            {
+                return;
+            }
+
+            vec3 f = lightPath ? diffuseBSDF(v, w, v.wPrev) : diffuseBSDF(v, v.wPrev, w);
+            beta *= f * (dot(rec.normal, w) / pdf);
+
+            pdfRev = diffusePdf(v, w, v.wPrev);
+            scatterPdf = scatteringPdf(scene, rec, w);
+            scattered = ray(rec.p, w);
+        }
+
+        prev.pdfRev = convertDensity(pdfRev, v, prev);
+        r = scattered;
+
+        if (beta.squared_length() == 0.0)
+        {
+            return;
+        }
+    }
+}
+
+void cameraSubpath(const Scene& scene, const Camera& cam, const ray& r, int maxVertices,
+                   vector<PathVertex>& path, vec3& background)
+{
+    PathVertex camera;
+    camera.type = CAMERA_VERTEX;
+    camera.rec.p = cam.origin;
+    camera.rec.normal = vec3(0, 0, -1);
+    camera.beta = vec3(1, 1, 1);
+    camera.pdfFwd = 1.0;
+    camera.pdfRev = 0.0;
+    camera.delta = false;
+
+    path.clear();
+    path.push_back(camera);
+
+    // A pinhole's importance over its ray density is one
+    randomWalk(scene, r, vec3(1, 1, 1), cameraPdf(cam, vec3::normalize(r.direction())), false, maxVertices, path, &background);
+}
+
+void lightSubpath(const Scene& scene, const EmitterDistribution& emitters, int maxVertices, vector<PathVertex>& path)
+{
+    path.clear();
+
+    float pmf;
+    const Hitable* pLight = emitters.sample(getRand(), pmf);
+    PathVertex light;
+    if (!pLight || pmf <= 0.0 || !pLight->randomPoint(light.rec) || maxVertices < 1)
+    {
+        return;
+    }
+
+    light.type = LIGHT_VERTEX;
+    light.pdfFwd = pmf / pLight->area();
+    light.pdfRev = 0.0;
+    light.beta = light.rec.pMat->emission() / light.pdfFwd;
+    light.delta = false;
+    path.push_back(light);
+
+    // Cosine-weighted emission, so the cosine cancels against the density
+    vec3 w = vec3::normalize(light.rec.normal + vec3::randomUnitVector());
+    float pdf = cosinePdf(light.rec, w);
+    if (pdf > 0.0)
+    {
+        randomWalk(scene, ray(light.rec.p, w), light.beta * M_PI, pdf, true, maxVertices, path, nullptr);
+    }
+}
+
+// Moves a surface point off its surface toward the side target is on.
+inline vec3 offsetPoint(const HitRecord& rec, const vec3& target)
+{
+    return rec.p + (dot(rec.normal, target - rec.p) > 0.0 ? 0.001 : -0.001) * rec.normal;
+}
+
+// Shadow rays between two stored hit points, unlike the ones getColor()
+// traces toward a light, cannot tell the surface they end on from a blocker.
+// Points on large spheres like the ground are off by more than a ray epsilon
+// at grazing angles, so both ends are moved off their surfaces first.
+bool visible(const Scene& scene, const PathVertex& a, const PathVertex& b)
+{
+    vec3 from = a.type == CAMERA_VERTEX ? a.rec.p : offsetPoint(a.rec, b.rec.p);
+    vec3 to = b.type == CAMERA_VERTEX ? b.rec.p : offsetPoint(b.rec, a.rec.p);
+    vec3 d = to - from;
+    float dist = d.length();
+    HitRecord rec;
+    return !scene.world->hit(ray(from, d / dist), 0.0, dist, rec);
+}
+
+inline float remap0(float f)
+{
+    return f != 0.0 ? f : 1.0;
+}
+
+// Power heuristic weight of the strategy with s light and t camera vertices,
+// where sampled is the vertex a strategy with s == 1 or t == 1 drew itself.
+// Strategies needing subpaths longer than maxVertices do not count.
+float misWeight(const Camera& cam, const EmitterDistribution& emitters, vector<PathVertex>& lightPath,
+                vector<PathVertex>& cameraPath, const PathVertex& sampled, int s, int t, int maxVertices)
+{
+    if (s + t == 2)
+    {
+        return 1.0;
+    }
+
+    PathVertex* qs = s > 0 ? &lightPath[s - 1] : nullptr;
+    PathVertex* pt = &cameraPath[t - 1];
+    PathVertex* qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+    PathVertex* ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+
+    // Temporarily turn the subpaths into the ones this strategy produced
+    PathVertex saved[4];
+    PathVertex* touched[4] = { qs, pt, qsMinus, ptMinus };
+    for (int k = 0; k < 4; k++)
+    {
+        if (touched[k])
+        {
+            saved[k] = *touched[k];
+        }
+    }
+
+    if (s == 1)
+    {
+        *qs = sampled;
+    }
+    else if (t == 1)
+    {
+        *pt = sampled;
+    }
+
+    pt->delta = false;
+    if (qs)
+    {
+        qs->delta = false;
+    }
+
+    pt->pdfRev = s > 0 ? vertexPdf(cam, *qs, qsMinus, *pt) : lightOriginPdf(emitters, *pt);
+    if (ptMinus)
+    {
+        ptMinus->pdfRev = s > 0 ? vertexPdf(cam, *pt, qs, *ptMinus)
+                                : convertDensity(cosinePdf(pt->rec, vec3::normalize(ptMinus->rec.p - pt->rec.p)), *pt, *ptMinus);
+    }
+    if (qs)
+    {
+        qs->pdfRev = vertexPdf(cam, *pt, ptMinus, *qs);
+    }
+    if (qsMinus)
+    {
+        qsMinus->pdfRev = vertexPdf(cam, *qs, pt, *qsMinus);
+    }
+
+    // Relative densities of the other strategies sampling the same path,
+    // walking away from the connection along either subpath
+    float sumRi = 0.0;
+    float ri = 1.0;
+    for (int i = t - 1; i > 0; i--)
+    {
+        float ratio = remap0(cameraPath[i].pdfRev) / remap0(cameraPath[i].pdfFwd);
+        ri *= ratio * ratio;
+        if (!cameraPath[i].delta && !cameraPath[i - 1].delta)
+        {
+            sumRi += ri;
+        }
+    }
+
+    ri = 1.0;
+    for (int i = s - 1; i >= 0; i--)
+    {
+        float ratio = remap0(lightPath[i].pdfRev) / remap0(lightPath[i].pdfFwd);
+        ri *= ratio * ratio;
+        if (!lightPath[i].delta && (i == 0 || !lightPath[i - 1].delta) && s + t - i <= maxVertices)
+        {
+            sumRi += ri;
+        }
+    }
+
+    for (int k = 0; k < 4; k++)
+    {
+        if (touched[k])
+        {
+            *touched[k] = saved[k];
+        }
+    }
+
+    return 1.0 / (1.0 + sumRi);
+}
+
+// Unweighted contribution of connecting the first s vertices of the light
+// subpath to the first t of the camera subpath. Connections to the camera
+// (t == 1) also return the film coordinates they land on.
+vec3 connect(const Scene& scene, const Camera& cam, const EmitterDistribution& emitters, vector<PathVertex>& lightPath,
+             vector<PathVertex>& cameraPath, int s, int t, int maxVertices, float& u, float& v, float& weight)
+{
+    PathVertex sampled;
+    vec3 L;
+    weight = 0.0;
+
+    if (s == 0)
+    {
+        // The camera subpath found a light on its own
+        const PathVertex& pt = cameraPath[t - 1];
+        if (pt.type != SURFACE_VERTEX)
+        {
+            return vec3(0, 0, 0);
+        }
+        L = pt.beta * pt.rec.pMat->emitted(ray(cameraPath[t - 2].rec.p, -pt.wPrev), pt.rec);
+    }
+    else if (t == 1)
+    {
+        // Light tracing: connect to the camera and splat
+        const PathVertex& qs = lightPath[s - 1];
+        if (!connectible(qs) || !cam.project(qs.rec.p, u, v))
+        {
+            return vec3(0, 0, 0);
+        }
+
+        vec3 toCamera = cam.origin - qs.rec.p;
+        float distSquared = toCamera.squared_length();
+        vec3 w = toCamera / sqrt(distSquared);
+        float cosCamera = -dot(w, cam.forward());
+        float importance = 1.0 / (cam.filmArea() * cosCamera * cosCamera * cosCamera * cosCamera);
+
+        sampled = cameraPath[0];
+        sampled.beta = vec3(1, 1, 1) * (importance * cosCamera / distSquared);
+
+        L = qs.beta * diffuseBSDF(qs, w, qs.wPrev) * dot(qs.rec.normal, w) * sampled.beta;
+        if (L.squared_length() == 0.0 || !visible(scene, qs, cameraPath[0]))
+        {
+            return vec3(0, 0, 0);
+        }
+    }
+    else if (s == 1)
+    {
+        // Next-event estimation toward a light picked by power
+        const PathVertex& pt = cameraPath[t - 1];
+        float pmf;
+        const Hitable* pLight = emitters.sample(getRand(), pmf);
+        if (!connectible(pt) || !pLight)
+        {
+            return vec3(0, 0, 0);
+        }
+
+        vec3 w = vec3::normalize(pLight->random(pt.rec.p));
+        float pdf = pmf * pLight->pdfValue(pt.rec.p, w);
+        vec3 f = diffuseBSDF(pt, pt.wPrev, w);
+        if (pdf <= 0.0 || f.squared_length() == 0.0)
+        {
+            return vec3(0, 0, 0);
+        }
+
+        HitRecord lightRec;
+        ray shadow(pt.rec.p, w);
+        if (!scene.world->hit(shadow, 0.001, FLT_MAX, lightRec) || lightRec.pObj != pLight)
+        {
+            return vec3(0, 0, 0);
+        }
+
+        sampled.type = LIGHT_VERTEX;
+        sampled.rec = lightRec;
+        sampled.beta = lightRec.pMat->emitted(shadow, lightRec) / pdf;
+        sampled.pdfFwd = lightOriginPdf(emitters, sampled);
+        sampled.pdfRev = 0.0;
+        sampled.delta = false;
+
+        L = pt.beta * f * dot(pt.rec.normal, w) * sampled.beta;
+    }
+    else
+    {
+        // Join the two subpaths with a shadow ray
+        const PathVertex& qs = lightPath[s - 1];
+        const PathVertex& pt = cameraPath[t - 1];
+        if (!connectible(qs) || !connectible(pt))
+        {
+            return vec3(0, 0, 0);
+        }
+
+        vec3 d = qs.rec.p - pt.rec.p;
+        float distSquared = d.squared_length();
+        vec3 w = d / sqrt(distSquared);
+
+        vec3 fCamera = diffuseBSDF(pt, pt.wPrev, w);
+        vec3 fLight = diffuseBSDF(qs, -w, qs.wPrev);
+        float G = dot(pt.rec.normal, w) * dot(qs.rec.normal, -w) / distSquared;
+        L = qs.beta * fLight * fCamera * pt.beta * G;
+        if (L.squared_length() == 0.0 || !visible(scene, pt, qs))
+        {
+            return vec3(0, 0, 0);
+        }
+    }
+
+    if (L.squared_length() == 0.0)
+    {
+        return L;
+    }
+
+    weight = misWeight(cam, emitters, lightPath, cameraPath, sampled, s, t, maxVertices);
+    return L;
+}
+
+// Renders N_S bidirectional samples per pixel and returns linear colors in
+// processPixels order.
+vector<vec3> renderBDPT(Camera* cam, const Scene* scene)
+{
+    const int numPixels = N_X * N_Y;
+    // As in getColor(), paths scatter at most N_BOUNCES times before reaching
+    // a light, so subpaths have up to N_BOUNCES + 1 vertices and joined paths
+    // one more
+    const int maxVertices = N_BOUNCES + 1;
+
+    EmitterDistribution emitters;
+    emitters.build(scene->lights);
+
+    Film film(N_X, N_Y);
+    vector<vec3> colors(numPixels);
+
+    parallelFor(numPixels, [&](int start, int end)
+    {
+        vector<PathVertex> cameraPath;
+        vector<PathVertex> lightPath;
+        cameraPath.reserve(maxVertices);
+        lightPath.reserve(maxVertices);
+
+        for (int iter = start; iter < end; iter++)
+        {
+            const int i = iter % N_X;
+            const int j = N_Y - iter / N_X - 1;
+
+            vec3 col;
+
+            for (int sample = 0; sample < N_S; sample++)
+            {
+                float u = float(i + getRand()) / float(N_X);
+                float v = float(j + getRand()) / float(N_Y);
+
+                vec3 background;
+                cameraSubpath(*scene, *cam, cam->getRay(u, v), maxVertices, cameraPath, background);
+                lightSubpath(*scene, emitters, maxVertices, lightPath);
+                col += background;
+
+                for (int t = 1; t <= int(cameraPath.size()); t++)
+                {
+                    for (int s = 0; s <= int(lightPath.size()); s++)
+                    {
+                        if ((s == 1 && t == 1) || (s == 0 && t == 1) || s + t > maxVertices + 1)
+                        {
+                            continue;
+                        }
+
+                        float splatU;
+                        float splatV;
+                        float weight;
+                        vec3 L = connect(*scene, *cam, emitters, lightPath, cameraPath, s, t, maxVertices, splatU, splatV, weight);
+                        if (weight <= 0.0)
+                        {
+                            continue;
+                        }
+
+                        if (t == 1)
+                        {
+                            film.splat(splatU, splatV, weight * L);
+                        }
+                        else
+                        {
+                            col += weight * L;
+                        }
+                    }
+                }
+            }
+
+            colors[iter] = col;
+        }
+    });
+
+    // Every light subpath splats across the whole film, so splats are
+    // normalized by the same sample count as the pixels' own estimates
+    for (int iter = 0; iter < numPixels; iter++)
+    {
+        colors[iter] = (colors[iter] + film.pixel(iter)) / float(N_S);
+    }
+    return colors;
+}
+
+#endif
@@ -0,0 +1,656 @@
+#ifndef BVHH
+#define BVHH
+
+#include "Hitable.h"
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+
+using namespace std;
+
+// Most primitives a leaf holds, and the SAH bins tried per axis
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 12
+// Past this depth splits halve their node, which bounds traversal stacks
+#define BVH_MAX_SAH_DEPTH 64
+#define BVH_STACK_SIZE 128
+// Most rays hitStream() keeps in flight at once
+#define BVH_MAX_INTERLEAVE 32
+
+/**
+ *
+ * Bounding volume hierarchy over the scene geometry, built with the binned
+ * surface area heuristic so that huge objects like the ground end up near
+ * the root instead of inflating the boxes of the small ones around them.
+ * Nodes are stored depth first in one array, a parent's first child right
+ * after it, and hit() visits the child on the side the ray comes from
+ * first so that later boxes can be skipped past the closest hit. Objects
+ * without a bounding box are tested by every ray.
+ *
+ * hitStream() interleaves the traversals of up to interleave rays. Each
+ * ray prefetches the node or primitives it needs next and then hands over
+ * to the next ray, so that by the time it comes around again they are in
+ * cache, rather than every ray in turn stalling on memory at each node of
+ * a tree too big for it.
+ *
+ * The BVH only points to the objects; they stay owned by their list.
+ *
+ */
+
+class BVH : public Hitable
+{
+public:
+    BVH() : interleave(1) {}
+    BVH(const vector<Hitable*>& objects) : interleave(1) { build(objects); }
+
+    void build(const vector<Hitable*>& objects);
+    // Recomputes every box after the objects have moved, keeping the tree
+    // as it is. Much faster than build(), and as good while the objects
+    // stay roughly where they were.
+    void refit();
+
+    virtual bool hit(const ray& r, float tMin, float tMax, HitRecord& rec) const;
+    virtual void hitStream(const ray* rays, int count, float tMin, float tMax, HitRecord* recs) const;
+    virtual void hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const;
+    virtual bool boundingBox(vec3& lo, vec3& hi) const;
+
+    struct Node
+    {
+        float lo[3];
+        float hi[3];
+        int offset; // First primitive of a leaf, or the second child
+        uint16_t count; // Primitives in a leaf, 0 for interior nodes
+        uint16_t axis; // Split axis of interior nodes
+    };
+
+    vector<Node> nodes;
+    vector<Hitable*> primitives;
+    vector<Hitable*> unbounded;
+    int interleave; // Rays hitStream() traverses at once, 1 for one after another
+
+private:
+    struct BuildItem
+    {
+        vec3 lo;
+        vec3 hi;
+        vec3 centroid;
+        Hitable* pObj;
+    };
+
+    // Where a ray of hitStream() is in its traversal
+    enum TraversalPhase
+    {
+        VISIT_NODE, // Test the box of node index
+        FETCH_OBJECTS, // Leaf reached, its primitive pointers are on their way
+        TEST_OBJECTS // The primitives themselves are on their way
+    };
+
+    struct Traversal
+    {
+        int ray; // Index into the stream, -1 once there are no rays left
+        int index;
+        TraversalPhase phase;
+        float origin[3];
+        float invDir[3];
+        float closest;
+        int stackSize;
+        int stack[BVH_STACK_SIZE];
+    };
+
+    int buildRecursive(vector<BuildItem>& items, int begin, int end, int depth);
+    bool startTraversal(Traversal& traversal, const ray* rays, int k, float tMin, float tMax, HitRecord* recs) const;
+};
+
+inline float surfaceArea(const vec3& lo, const vec3& hi)
+{
+    vec3 d = hi - lo;
+    return d.x() < 0.0 ? 0.0 : 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+void BVH::build(const vector<Hitable*>& objects)
+{
+    nodes.clear();
+    primitives.clear();
+    unbounded.clear();
+
+    vector<BuildItem> items;
+    for (Hitable* pObj : objects)
+    {
+        BuildItem item;
+        if (pObj->boundingBox(item.lo, item.hi))
+        {
+            item.centroid = 0.5 * (item.lo + item.hi);
+            item.pObj = pObj;
+            items.push_back(item);
+        }
+        else
+        {
+            unbounded.push_back(pObj);
+        }
+    }
+
+    if (!items.empty())
+    {
+        nodes.reserve(2 * items.size());
+        buildRecursive(items, 0, int(items.size()), 0);
+    }
+    for (const BuildItem& item : items)
+    {
+        primitives.push_back(item.pObj);
+    }
+}
+
+void BVH::refit()
+{
+    // Children come after their parent, so going backwards finds them done
+    for (int index = int(nodes.size()) - 1; index >= 0; index--)
+    {
+        Node& node = nodes[index];
+        vec3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+        vec3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        if (node.count > 0)
+        {
+            for (int i = node.offset; i < node.offset + node.count; i++)
+            {
+                vec3 objLo;
+                vec3 objHi;
+                primitives[i]->boundingBox(objLo, objHi);
+                for (int k = 0; k < 3; k++)
+                {
+                    lo[k] = min(lo[k], objLo[k]);
+                    hi[k] = max(hi[k], objHi[k]);
+                }
+            }
+        }
+        else
+        {
+            const Node& first = nodes[index + 1];
+            const Node& second = nodes[node.offset];
+            for (int k = 0; k < 3; k++)
+            {
+                lo[k] = min(first.lo[k], second.lo[k]);
+                hi[k] = max(first.hi[k], second.hi[k]);
+            }
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            node.lo[k] = lo[k];
+            node.hi[k] = hi[k];
+        }
+    }
+}
+
+int BVH::buildRecursive(vector<BuildItem>& items, int begin, int end, int depth)
+{
+    int index = int(nodes.size());
+    nodes.push_back(Node());
+
+    vec3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+    vec3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    vec3 centroidLo = lo;
+    vec3 centroidHi = hi;
+    for (int i = begin; i < end; i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = min(lo[k], items[i].lo[k]);
+            hi[k] = max(hi[k], items[i].hi[k]);
+            centroidLo[k] = min(centroidLo[k], items[i].centroid[k]);
+            centroidHi[k] = max(centroidHi[k], items[i].centroid[k]);
+        }
+    }
+    for (int k = 0; k < 3; k++)
+    {
+        nodes[index].lo[k] = lo[k];
+        nodes[index].hi[k] = hi[k];
+    }
+
+    auto makeLeaf = [&]()
+    {
+        nodes[index].offset = begin;
+        nodes[index].count = uint16_t(end - begin);
+        nodes[index].axis = 0;
+        return index;
+    };
+
+    const int count = end - begin;
+    if (count <= BVH_LEAF_SIZE)
+    {
+        return makeLeaf();
+    }
+
+    // Binned SAH: cost of each split between bins, on every axis
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = centroidHi[axis] - centroidLo[axis];
+        if (extent <= 0.0)
+        {
+            continue;
+        }
+
+        int binCounts[BVH_BINS] = {};
+        vec3 binLo[BVH_BINS];
+        vec3 binHi[BVH_BINS];
+        for (int b = 0; b < BVH_BINS; b++)
+        {
+            binLo[b] = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+            binHi[b] = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        }
+        for (int i = begin; i < end; i++)
+        {
+            int b = min(int(BVH_BINS * (items[i].centroid[axis] - centroidLo[axis]) / extent), BVH_BINS - 1);
+            binCounts[b]++;
+            for (int k = 0; k < 3; k++)
+            {
+                binLo[b][k] = min(binLo[b][k], items[i].lo[k]);
+                binHi[b][k] = max(binHi[b][k], items[i].hi[k]);
+            }
+        }
+
+        // Sweep from the right for the areas of every right-hand side
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        vec3 accLo(FLT_MAX, FLT_MAX, FLT_MAX);
+        vec3 accHi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        int accCount = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                accLo[k] = min(accLo[k], binLo[b][k]);
+                accHi[k] = max(accHi[k], binHi[b][k]);
+            }
+            accCount += binCounts[b];
+            rightArea[b] = surfaceArea(accLo, accHi);
+            rightCount[b] = accCount;
+        }
+
+        accLo = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+        accHi = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        accCount = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                accLo[k] = min(accLo[k], binLo[b][k]);
+                accHi[k] = max(accHi[k], binHi[b][k]);
+            }
+            accCount += binCounts[b];
+            if (accCount == 0 || rightCount[b + 1] == 0)
+            {
+                continue;
+            }
+
+            float cost = surfaceArea(accLo, accHi) * accCount + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b + 1;
+            }
+        }
+    }
+
+    int mid;
+    if (bestAxis < 0 || depth >= BVH_MAX_SAH_DEPTH)
+    {
+        // All centroids coincide, or the tree is getting too deep: split in
+        // the middle, unless they all fit in one leaf
+        if (bestAxis < 0 && count <= 0xFFFF)
+        {
+            return makeLeaf();
+        }
+        bestAxis = 0;
+        for (int k = 1; k < 3; k++)
+        {
+            if (centroidHi[k] - centroidLo[k] > centroidHi[bestAxis] - centroidLo[bestAxis])
+            {
+                bestAxis = k;
+            }
+        }
+        mid = (begin + end) / 2;
+        int axis = bestAxis;
+        nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                    [axis](const BuildItem& a, const BuildItem& b) { return a.centroid[axis] < b.centroid[axis]; });
+    }
+    else
+    {
+        // A split only pays if it beats testing every primitive here
+        if (bestCost >= surfaceArea(lo, hi) * count && count <= 0xFFFF)
+        {
+            return makeLeaf();
+        }
+
+        float extent = centroidHi[bestAxis] - centroidLo[bestAxis];
+        auto left = partition(items.begin() + begin, items.begin() + end, [&](const BuildItem& item)
+        {
+            int b = min(int(BVH_BINS * (item.centroid[bestAxis] - centroidLo[bestAxis]) / extent), BVH_BINS - 1);
+            return b < bestSplit;
+        });
+        mid = int(left - items.begin());
+    }
+
+    nodes[index].count = 0;
+    nodes[index].axis = uint16_t(bestAxis);
+    buildRecursive(items, begin, mid, depth + 1);
+    int child1 = buildRecursive(items, mid, end, depth + 1);
+    nodes[index].offset = child1;
+    return index;
+}
+
+// Slab test of a box against a ray given by its origin and inverse direction.
+inline bool hitBox(const BVH::Node& node, const float origin[3], const float invDir[3], float tMin, float tMax)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        float t0 = (node.lo[k] - origin[k]) * invDir[k];
+        float t1 = (node.hi[k] - origin[k]) * invDir[k];
+        tMin = max(tMin, min(t0, t1));
+        tMax = min(tMax, max(t0, t1));
+    }
+    return tMin <= tMax;
+}
+
+bool BVH::hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
+{
+    HitRecord tempRec;
+    bool hitAnything = false;
+    float closestSoFar = tMax;
+
+    for (Hitable* pObj : unbounded)
+    {
+        if (pObj->hit(r, tMin, closestSoFar, tempRec))
+        {
+            hitAnything = true;
+            closestSoFar = tempRec.t;
+            rec = tempRec;
+        }
+    }
+    if (nodes.empty())
+    {
+        return hitAnything;
+    }
+
+    const float origin[3] = { r.origin().x(), r.origin().y(), r.origin().z() };
+    const float invDir[3] = { 1.0f / r.direction().x(), 1.0f / r.direction().y(), 1.0f / r.direction().z() };
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    int index = 0;
+    while (true)
+    {
+        const Node& node = nodes[index];
+        if (hitBox(node, origin, invDir, tMin, closestSoFar))
+        {
+            if (node.count > 0)
+            {
+                for (int i = node.offset; i < node.offset + node.count; i++)
+                {
+                    if (primitives[i]->hit(r, tMin, closestSoFar, tempRec))
+                    {
+                        hitAnything = true;
+                        closestSoFar = tempRec.t;
+                        rec = tempRec;
+                    }
+                }
+            }
+            else if (invDir[node.axis] < 0.0)
+            {
+                stack[stackSize++] = index + 1;
+                index = node.offset;
+                continue;
+            }
+            else
+            {
+                stack[stackSize++] = node.offset;
+                index = index + 1;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+        {
+            break;
+        }
+        index = stack[--stackSize];
+    }
+
+    return hitAnything;
+}
+
+// Each block goes down the tree together, into every node one of its lanes
+// enters, and leaves test all its lanes at once.
+void BVH::hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const
+{
+    for (Hitable* pObj : unbounded)
+    {
+        pObj->hitBatch(rays, hits, count, tMin);
+    }
+    if (nodes.empty())
+    {
+        return;
+    }
+
+    for (int block = 0; block < count; block++)
+    {
+        const RaySoA& batch = rays[block];
+        HitSoA& batchHits = hits[block];
+        float invX[PACKET_SIZE];
+        float invY[PACKET_SIZE];
+        float invZ[PACKET_SIZE];
+        for (int lane = 0; lane < batch.count; lane++)
+        {
+            invX[lane] = 1.0f / batch.dx[lane];
+            invY[lane] = 1.0f / batch.dy[lane];
+            invZ[lane] = 1.0f / batch.dz[lane];
+        }
+        const float* invFirst[3] = { invX, invY, invZ };
+
+        int stack[BVH_STACK_SIZE];
+        int stackSize = 0;
+        int index = 0;
+        while (true)
+        {
+            const Node& node = nodes[index];
+
+            bool any = false;
+            for (int lane = 0; lane < batch.count; lane++)
+            {
+                float t0x = (node.lo[0] - batch.ox[lane]) * invX[lane];
+                float t1x = (node.hi[0] - batch.ox[lane]) * invX[lane];
+                float t0y = (node.lo[1] - batch.oy[lane]) * invY[lane];
+                float t1y = (node.hi[1] - batch.oy[lane]) * invY[lane];
+                float t0z = (node.lo[2] - batch.oz[lane]) * invZ[lane];
+                float t1z = (node.hi[2] - batch.oz[lane]) * invZ[lane];
+                float tEnter = max(max(tMin, min(t0x, t1x)), max(min(t0y, t1y), min(t0z, t1z)));
+                float tExit = min(min(batchHits.t[lane], max(t0x, t1x)), min(max(t0y, t1y), max(t0z, t1z)));
+                any |= tEnter <= tExit;
+            }
+
+            if (any)
+            {
+                if (node.count > 0)
+                {
+                    for (int i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        primitives[i]->hitBatch(&batch, &batchHits, 1, tMin);
+                    }
+                }
+                else if (invFirst[node.axis][0] < 0.0)
+                {
+                    stack[stackSize++] = index + 1;
+                    index = node.offset;
+                    continue;
+                }
+                else
+                {
+                    stack[stackSize++] = node.offset;
+                    index = index + 1;
+                    continue;
+                }
+            }
+
+            if (stackSize == 0)
+            {
+                break;
+            }
+            index = stack[--stackSize];
+        }
+    }
+}
+
+// Starts traversal on rays[k] after testing it against the unbounded
+// objects, or returns false if there is no such ray.
+bool BVH::startTraversal(Traversal& traversal, const ray* rays, int k, float tMin, float tMax, HitRecord* recs) const
+{
+    traversal.ray = -1;
+    if (k < 0)
+    {
+        return false;
+    }
+
+    const ray& r = rays[k];
+    HitRecord& rec = recs[k];
+    HitRecord tempRec;
+    rec.pObj = nullptr;
+    traversal.closest = tMax;
+    for (Hitable* pObj : unbounded)
+    {
+        if (pObj->hit(r, tMin, traversal.closest, tempRec))
+        {
+            traversal.closest = tempRec.t;
+            rec = tempRec;
+        }
+    }
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        traversal.origin[axis] = r.origin()[axis];
+        traversal.invDir[axis] = 1.0f / r.direction()[axis];
+    }
+    traversal.ray = k;
+    traversal.index = 0;
+    traversal.phase = VISIT_NODE;
+    traversal.stackSize = 0;
+    return true;
+}
+
+void BVH::hitStream(const ray* rays, int count, float tMin, float tMax, HitRecord* recs) const
+{
+    if (interleave <= 1 || nodes.empty())
+    {
+        Hitable::hitStream(rays, count, tMin, tMax, recs);
+        return;
+    }
+
+    Traversal traversals[BVH_MAX_INTERLEAVE];
+    const int width = min(interleave, BVH_MAX_INTERLEAVE);
+    int nextRay = 0;
+    int inFlight = 0;
+    for (int slot = 0; slot < width; slot++)
+    {
+        inFlight += startTraversal(traversals[slot], rays, nextRay < count ? nextRay++ : -1, tMin, tMax, recs);
+    }
+
+    // Round robin over the traversals. Each one runs until it has to wait
+    // for memory: a child right after its parent usually shares its cache
+    // line, so only jumps elsewhere in the tree and leaves hand over.
+    while (inFlight > 0)
+    {
+        for (int slot = 0; slot < width; slot++)
+        {
+            Traversal& traversal = traversals[slot];
+            bool waiting = false;
+            while (traversal.ray >= 0 && !waiting)
+            {
+                const Node& node = nodes[traversal.index];
+                bool done = false;
+                if (traversal.phase == VISIT_NODE)
+                {
+                    if (!hitBox(node, traversal.origin, traversal.invDir, tMin, traversal.closest))
+                    {
+                        done = true;
+                    }
+                    else if (node.count > 0)
+                    {
+                        __builtin_prefetch(&primitives[node.offset]);
+                        traversal.phase = FETCH_OBJECTS;
+                        waiting = true;
+                    }
+                    else
+                    {
+                        int nearChild = traversal.index + 1;
+                        int farChild = node.offset;
+                        if (traversal.invDir[node.axis] < 0.0)
+                        {
+                            swap(nearChild, farChild);
+                        }
+                        traversal.stack[traversal.stackSize++] = farChild;
+                        if (nearChild != traversal.index + 1)
+                        {
+                            __builtin_prefetch(&nodes[nearChild]);
+                            waiting = true;
+                        }
+                        traversal.index = nearChild;
+                    }
+                }
+                else if (traversal.phase == FETCH_OBJECTS)
+                {
+                    for (int i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        __builtin_prefetch(primitives[i]);
+                    }
+                    traversal.phase = TEST_OBJECTS;
+                    waiting = true;
+                }
+                else
+                {
+                    const ray& r = rays[traversal.ray];
+                    HitRecord tempRec;
+                    for (int i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        if (primitives[i]->hit(r, tMin, traversal.closest, tempRec))
+                        {
+                            traversal.closest = tempRec.t;
+                            recs[traversal.ray] = tempRec;
+                        }
+                    }
+                    done = true;
+                }
+
+                if (!done)
+                {
+                    continue;
+                }
+                if (traversal.stackSize > 0)
+                {
+                    traversal.index = traversal.stack[--traversal.stackSize];
+                    traversal.phase = VISIT_NODE;
+                    __builtin_prefetch(&nodes[traversal.index]);
+                    waiting = true;
+                }
+                else if (!startTraversal(traversal, rays, nextRay < count ? nextRay++ : -1, tMin, tMax, recs))
+                {
+                    inFlight--;
+                }
+            }
+        }
+    }
+}
+
+bool BVH::boundingBox(vec3& lo, vec3& hi) const
+{
+    if (nodes.empty() || !unbounded.empty())
+    {
+        return false;
+    }
+    lo = vec3(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]);
+    hi = vec3(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]);
+    return true;
+}
+
+#endif
@@ -16,15 +16,26 @@ public:
     {}
 
     Camera(float vfov, float aspect)
+    {
+        lookAt(vec3(0.0, 0.0, 0.75), vec3(0.0, 0.0, -1.0), vec3(0.0, 1.0, 0.0), vfov, aspect);
+    }
+
+    // Puts the camera at from, looking towards at with up pointing up the
+    // film, and a vertical field of view of vfov degrees.
+    void lookAt(const vec3& from, const vec3& at, const vec3& up, float vfov, float aspect)
     {
         float theta = vfov * M_PI / 180.0;
         float halfHeight = tan(theta / 2.0);
         float halfWidth = aspect * halfHeight;
 
-        origin = vec3(0.0, 0.0, 0.75);
-        lowLeftCorner = vec3(-halfWidth, -halfHeight, -1.0);
-        horizontal = vec3(halfWidth * 2.0, 0.0, 0.0);
-        vertical = vec3(0.0, halfHeight * 2.0, 0.0);
+        vec3 w = vec3::normalize(from - at);
+        vec3 u = vec3::normalize(cross(up, w));
+        vec3 v = cross(w, u);
+
+        origin = from;
+        lowLeftCorner = -halfWidth * u - halfHeight * v - w;
+        horizontal = halfWidth * 2.0 * u;
+        vertical = halfHeight * 2.0 * v;
     }
 
     ray getRay(float u, float v)
@@ -32,6 +43,43 @@ public:
         return ray(origin, lowLeftCorner + u * horizontal + v * vertical);
     }
 
+    // Film coordinates of the ray from the camera through p, the inverse of
+    // getRay(). False if p is behind the camera or off the film.
+    bool project(const vec3& p, float& u, float& v) const
+    {
+        return filmCoordinates(p, u, v) && u >= 0.0 && u < 1.0 && v >= 0.0 && v < 1.0;
+    }
+
+    // Like project(), but also for points outside the film, whose u or v
+    // are then outside [0, 1). False only if p is not in front of the camera.
+    bool filmCoordinates(const vec3& p, float& u, float& v) const
+    {
+        vec3 d = p - origin;
+        float depth = dot(d, forward());
+        if (depth <= 0.0)
+        {
+            return false;
+        }
+
+        // getRay() directions all end on the film plane at unit distance
+        d = d / depth - lowLeftCorner;
+        u = dot(d, horizontal) / horizontal.squared_length();
+        v = dot(d, vertical) / vertical.squared_length();
+        return true;
+    }
+
+    // Unit direction the camera looks in, through the middle of the film.
+    vec3 forward() const
+    {
+        return vec3::normalize(cross(vertical, horizontal));
+    }
+
+    // Area of the film at unit distance from the origin.
+    float filmArea() const
+    {
+        return horizontal.length() * vertical.length();
+    }
+
     vec3 origin;
     vec3 lowLeftCorner;
     vec3 horizontal;
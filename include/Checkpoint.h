@@ -0,0 +1,125 @@
+#ifndef CHECKPOINTH
+#define CHECKPOINTH
+
+#include "Framebuffer.h"
+#include "ImageWriter.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+#define CHECKPOINT_VERSION 1
+
+enum CheckpointStatus
+{
+    CHECKPOINT_LOADED,
+    CHECKPOINT_MISSING, // No checkpoint yet: start from the first pass
+    CHECKPOINT_INVALID  // Unreadable, damaged, or of another render
+};
+
+// 64-bit FNV-1a hash of the settings a render's samples depend on, to tell
+// a checkpoint of this render from one of another.
+uint64_t hashSettings(const string& settings)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : settings)
+    {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ *
+ * Checkpoints of a progressive render: everything needed to carry on after
+ * passesDone of its passes, which is the sums in every framebuffer tile.
+ * Random numbers are seeded from the pass and tile being rendered, so the
+ * pass count also fixes the state of every generator and the render
+ * carries on exactly as if it had never stopped. The file is
+ *
+ *     "RTCK", then as little endian integers the 32-bit version, 64-bit
+ *     settings hash, and 32-bit width, height, passes and passes done,
+ *     then the tiles' floats in host order, and a CRC-32 of all of it.
+ *
+ * It is written to a temporary file, flushed to disk and renamed over the
+ * last one, so being killed at any point leaves one whole checkpoint.
+ *
+ */
+
+bool writeCheckpoint(const string& path, uint64_t settings, int passes, int passesDone, const Framebuffer& film)
+{
+    vector<unsigned char> header = { 'R', 'T', 'C', 'K' };
+    putLittleEndian(header, uint32_t(CHECKPOINT_VERSION));
+    putLittleEndian(header, settings);
+    putLittleEndian(header, uint32_t(film.width));
+    putLittleEndian(header, uint32_t(film.height));
+    putLittleEndian(header, uint32_t(passes));
+    putLittleEndian(header, uint32_t(passesDone));
+
+    const unsigned char* pTiles = reinterpret_cast<const unsigned char*>(film.tiles.data());
+    const size_t tileBytes = film.tiles.size() * sizeof(FramebufferTile);
+    vector<unsigned char> trailer;
+    putLittleEndian(trailer, updateCRC32(updateCRC32(0, header.data(), header.size()), pTiles, tileBytes));
+
+    const string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool written = fwrite(header.data(), 1, header.size(), file) == header.size() &&
+                   fwrite(pTiles, 1, tileBytes, file) == tileBytes &&
+                   fwrite(trailer.data(), 1, trailer.size(), file) == trailer.size() &&
+                   fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+    return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// Loads the checkpoint at path into film and passesDone if it is one of
+// this render, film being the size it was written at.
+CheckpointStatus readCheckpoint(const string& path, uint64_t settings, int passes, Framebuffer& film, int& passesDone)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return CHECKPOINT_MISSING;
+    }
+    vector<unsigned char> expected = { 'R', 'T', 'C', 'K' };
+    putLittleEndian(expected, uint32_t(CHECKPOINT_VERSION));
+    putLittleEndian(expected, settings);
+    putLittleEndian(expected, uint32_t(film.width));
+    putLittleEndian(expected, uint32_t(film.height));
+    putLittleEndian(expected, uint32_t(passes));
+
+    vector<unsigned char> header(expected.size() + 4);
+    vector<FramebufferTile> tiles(film.tiles.size());
+    unsigned char* pTiles = reinterpret_cast<unsigned char*>(tiles.data());
+    const size_t tileBytes = tiles.size() * sizeof(FramebufferTile);
+    unsigned char trailer[4];
+    const bool read = fread(header.data(), 1, header.size(), file) == header.size() &&
+                      fread(pTiles, 1, tileBytes, file) == tileBytes &&
+                      fread(trailer, 1, 4, file) == 4 && fgetc(file) == EOF;
+    fclose(file);
+    if (!read || memcmp(header.data(), expected.data(), expected.size()) != 0)
+    {
+        return CHECKPOINT_INVALID;
+    }
+
+    const uint32_t crc = updateCRC32(updateCRC32(0, header.data(), header.size()), pTiles, tileBytes);
+    const uint32_t stored = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint32_t(trailer[3]) << 24);
+    const uint32_t done = header[expected.size()] | (header[expected.size() + 1] << 8) |
+                          (header[expected.size() + 2] << 16) | (uint32_t(header[expected.size() + 3]) << 24);
+    if (crc != stored || done > uint32_t(passes))
+    {
+        return CHECKPOINT_INVALID;
+    }
+    film.tiles = move(tiles);
+    passesDone = int(done);
+    return CHECKPOINT_LOADED;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CONFIGH
+#define CONFIGH
+
+// Constants that define properties of this ray tracer. Each can be overridden
+// at build time, e.g. -DN_S=64.
+#ifndef N_X
+#define N_X 1280
+#endif
+#ifndef N_Y
+#define N_Y 720
+#endif
+#ifndef N_CHANNELS
+#define N_CHANNELS 4
+#endif
+#ifndef N_S
+#define N_S 1024
+#endif
+#ifndef N_BOUNCES
+#define N_BOUNCES 50
+#endif
+
+#endif
@@ -0,0 +1,334 @@
+#ifndef DENOISERH
+#define DENOISERH
+
+#include "Config.h"
+#include "Camera.h"
+#include "PathTracer.h"
+#include "Parallel.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+using namespace std;
+
+// Edge-stopping strengths of the denoiser's luminance, normal and depth tests
+#define DENOISE_SIGMA_LUMINANCE 4.0
+#define DENOISE_SIGMA_NORMAL 128.0
+#define DENOISE_SIGMA_DEPTH 1.0
+
+/**
+ *
+ * Auxiliary output variables (AOVs) of the first surface seen through each
+ * pixel, averaged over its samples: the albedo, shading normal and distance
+ * to the camera. Pixels whose samples all left the scene have zero depth
+ * and normal. Renderers that average their own samples per pixel can also
+ * add the sample radiances, from which the variance of the pixel follows.
+ *
+ * Every pixel is only ever written by the thread rendering it.
+ *
+ */
+
+class AOVBuffers
+{
+public:
+    AOVBuffers(int numPixels);
+
+    // Adds the surface camera ray r hits first to pixel iter, with pRec
+    // null if it hits nothing.
+    void addFirstHit(int iter, const ray& r, const HitRecord* pRec);
+    // Adds the radiance of one of pixel iter's samples.
+    void addRadiance(int iter, const vec3& L);
+    // Turns the sums of pixel iter's samples into averages.
+    void resolve(int iter, int samples);
+
+    vector<vec3> albedo;
+    vector<vec3> normal;
+    vector<float> depth;
+    vector<float> variance; // Of the pixel's mean luminance
+    bool hasVariance;
+
+private:
+    vector<int> hits;
+    vector<float> sumLuminance;
+    vector<float> sumSquares;
+};
+
+AOVBuffers::AOVBuffers(int numPixels)
+    : albedo(numPixels), normal(numPixels), depth(numPixels, 0.0), variance(numPixels, 0.0), hasVariance(false),
+      hits(numPixels, 0), sumLuminance(numPixels, 0.0), sumSquares(numPixels, 0.0)
+{}
+
+void AOVBuffers::addFirstHit(int iter, const ray& r, const HitRecord* pRec)
+{
+    if (!pRec)
+    {
+        // Let the sky keep its own colors through demodulation
+        albedo[iter] += vec3(1, 1, 1);
+        return;
+    }
+
+    const HitRecord& rec = *pRec;
+    vec3 unitNormal = vec3::normalize(rec.normal);
+    if (rec.pMat->emission().squared_length() > 0.0)
+    {
+        albedo[iter] += vec3(1, 1, 1);
+    }
+    else
+    {
+        // What the surface reflects in all, as getColor() blends its lobes
+        vec3 F = fresnel(rec, -vec3::normalize(r.direction()));
+        albedo[iter] += F + (vec3(1, 1, 1) - F) * diffuseAlbedo(rec);
+    }
+    normal[iter] += unitNormal;
+    depth[iter] += rec.t * r.direction().length();
+    hits[iter]++;
+}
+
+void AOVBuffers::addRadiance(int iter, const vec3& L)
+{
+    float lum = luminance(L);
+    sumLuminance[iter] += lum;
+    sumSquares[iter] += lum * lum;
+    hasVariance = true;
+}
+
+void AOVBuffers::resolve(int iter, int samples)
+{
+    albedo[iter] /= float(samples);
+    if (hits[iter] > 0)
+    {
+        normal[iter] = vec3::normalize(normal[iter]);
+    }
+    depth[iter] = hits[iter] > 0 ? depth[iter] / hits[iter] : 0.0;
+
+    if (samples > 1)
+    {
+        float mean = sumLuminance[iter] / samples;
+        variance[iter] = max(0.0f, sumSquares[iter] / samples - mean * mean) / (samples - 1);
+    }
+}
+
+// Fills aovs with samples first hits per pixel, for renderers that do not
+// add them while rendering.
+void renderAOVs(Camera* cam, const Scene* scene, AOVBuffers& aovs, int samples)
+{
+    parallelFor(N_X * N_Y, [&](int start, int end)
+    {
+        for (int iter = start; iter < end; iter++)
+        {
+            const int i = iter % N_X;
+            const int j = N_Y - iter / N_X - 1;
+
+            for (int s = 0; s < samples; s++)
+            {
+                float u = float(i + getRand()) / float(N_X);
+                float v = float(j + getRand()) / float(N_Y);
+                ray r = cam->getRay(u, v);
+                HitRecord rec;
+                bool hit = scene->world->hit(r, 0.001, FLT_MAX, rec);
+                aovs.addFirstHit(iter, r, hit ? &rec : nullptr);
+            }
+            aovs.resolve(iter, samples);
+        }
+    });
+}
+
+// Variance of each pixel's luminance over its 3x3 neighborhood, for images
+// that come without per-pixel variance.
+vector<float> neighborhoodVariance(const vector<vec3>& colors, int width, int height)
+{
+    vector<float> variance(colors.size());
+    parallelFor(height, [&](int rowStart, int rowEnd)
+    {
+        for (int y = rowStart; y < rowEnd; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                float sum = 0.0;
+                float sumSquares = 0.0;
+                int count = 0;
+                for (int dy = -1; dy <= 1; dy++)
+                {
+                    for (int dx = -1; dx <= 1; dx++)
+                    {
+                        int qx = x + dx;
+                        int qy = y + dy;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                        {
+                            continue;
+                        }
+                        float lum = luminance(colors[qy * width + qx]);
+                        sum += lum;
+                        sumSquares += lum * lum;
+                        count++;
+                    }
+                }
+                float mean = sum / count;
+                variance[y * width + x] = max(0.0f, sumSquares / count - mean * mean);
+            }
+        }
+    });
+    return variance;
+}
+
+/**
+ *
+ * Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010), with the
+ * variance-guided luminance test of SVGF (Schied et al. 2017). Each pass
+ * blurs with a 5x5 B3-spline kernel whose taps are spread twice as far as
+ * in the pass before, so a few passes cover a wide footprint at 25 taps per
+ * pixel each. Taps are down-weighted where normals or depths differ, or
+ * where luminance differs by more than the noise of the pixel explains.
+ * The variance is filtered along with the colors, so later passes trust
+ * luminance differences more as the image gets smoother.
+ *
+ * Filtering happens on the colors divided by albedo, so that surface color
+ * edges stay sharp however much the lighting is blurred.
+ *
+ */
+
+vector<vec3> denoise(const vector<vec3>& colors, const AOVBuffers& aovs, int width, int height, int iterations)
+{
+    const int numPixels = width * height;
+    const float kernel[5] = { 1.0 / 16.0, 1.0 / 4.0, 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+
+    vector<vec3> demodulated(numPixels);
+    vector<float> variance(numPixels);
+    vector<float> sourceVariance = aovs.hasVariance ? aovs.variance : neighborhoodVariance(colors, width, height);
+    for (int iter = 0; iter < numPixels; iter++)
+    {
+        vec3 a = aovs.albedo[iter];
+        a = vec3(max(a[0], 0.01f), max(a[1], 0.01f), max(a[2], 0.01f));
+        demodulated[iter] = colors[iter] / a;
+        float lum = max(luminance(a), 0.01f);
+        variance[iter] = sourceVariance[iter] / (lum * lum);
+    }
+
+    // Depth change per pixel, so slanted surfaces are not taken for edges
+    vector<float> depthGradient(numPixels, 0.0);
+    auto depthAt = [&](int x, int y)
+    {
+        return x >= 0 && x < width && y >= 0 && y < height ? aovs.depth[y * width + x] : 0.0f;
+    };
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const float z = depthAt(x, y);
+            float gradient = 0.0;
+            for (int axis = 0; axis < 2; axis++)
+            {
+                // The smaller one-sided difference, so the surface a pixel
+                // continues counts rather than the one across a silhouette.
+                // Sky and the image border give no depth to compare with.
+                float axisGradient = FLT_MAX;
+                for (int side = -1; side <= 1; side += 2)
+                {
+                    float zq = axis == 0 ? depthAt(x + side, y) : depthAt(x, y + side);
+                    if (zq > 0.0)
+                    {
+                        axisGradient = min(axisGradient, fabs(zq - z));
+                    }
+                }
+                if (axisGradient < FLT_MAX)
+                {
+                    gradient = max(gradient, axisGradient);
+                }
+            }
+            depthGradient[y * width + x] = z > 0.0 ? gradient : 0.0;
+        }
+    }
+
+    vector<vec3> filtered(numPixels);
+    vector<float> filteredVariance(numPixels);
+    for (int pass = 0; pass < iterations; pass++)
+    {
+        const int step = 1 << pass;
+
+        parallelFor(height, [&](int rowStart, int rowEnd)
+        {
+            for (int y = rowStart; y < rowEnd; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    const int p = y * width + x;
+                    const float zp = aovs.depth[p];
+                    const float lp = luminance(demodulated[p]);
+
+                    // Prefilter the variance over 3x3 pixels, as one pixel's is noisy itself
+                    float localVariance = 0.0;
+                    float localWeight = 0.0;
+                    for (int dy = -1; dy <= 1; dy++)
+                    {
+                        for (int dx = -1; dx <= 1; dx++)
+                        {
+                            int qx = x + dx;
+                            int qy = y + dy;
+                            if (qx >= 0 && qx < width && qy >= 0 && qy < height)
+                            {
+                                float h = kernel[dx + 2] * kernel[dy + 2];
+                                localVariance += h * variance[qy * width + qx];
+                                localWeight += h;
+                            }
+                        }
+                    }
+                    const float luminanceScale = DENOISE_SIGMA_LUMINANCE * sqrt(localVariance / localWeight) + 1e-6;
+
+                    vec3 sum;
+                    float sumVariance = 0.0;
+                    float sumWeight = 0.0;
+                    for (int dy = -2; dy <= 2; dy++)
+                    {
+                        for (int dx = -2; dx <= 2; dx++)
+                        {
+                            int qx = x + dx * step;
+                            int qy = y + dy * step;
+                            if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                            {
+                                continue;
+                            }
+                            const int q = qy * width + qx;
+                            const float zq = aovs.depth[q];
+
+                            // Sky only blends with sky
+                            float weight = kernel[dx + 2] * kernel[dy + 2];
+                            if ((zp > 0.0) != (zq > 0.0))
+                            {
+                                continue;
+                            }
+                            if (zp > 0.0)
+                            {
+                                float distance = step * sqrt(float(dx * dx + dy * dy));
+                                weight *= exp(-fabs(zp - zq) / (DENOISE_SIGMA_DEPTH * depthGradient[p] * distance + 1e-4f));
+                                weight *= pow(max(0.0f, dot(aovs.normal[p], aovs.normal[q])), DENOISE_SIGMA_NORMAL);
+                            }
+                            weight *= exp(-fabs(lp - luminance(demodulated[q])) / luminanceScale);
+
+                            sum += weight * demodulated[q];
+                            sumVariance += weight * weight * variance[q];
+                            sumWeight += weight;
+                        }
+                    }
+
+                    // The center tap always counts, so sumWeight is positive
+                    filtered[p] = sum / sumWeight;
+                    filteredVariance[p] = sumVariance / (sumWeight * sumWeight);
+                }
+            }
+        });
+
+        demodulated.swap(filtered);
+        variance.swap(filteredVariance);
+    }
+
+    vector<vec3> result(numPixels);
+    for (int iter = 0; iter < numPixels; iter++)
+    {
+        vec3 a = aovs.albedo[iter];
+        a = vec3(max(a[0], 0.01f), max(a[1], 0.01f), max(a[2], 0.01f));
+        result[iter] = demodulated[iter] * a;
+    }
+    return result;
+}
+
+#endif
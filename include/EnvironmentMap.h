@@ -0,0 +1,293 @@
+#ifndef ENVIRONMENTMAPH
+#define ENVIRONMENTMAPH
+
+#include "vec3.h"
+#include "AliasTable.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ *
+ * HDR environment light stored as a latitude-longitude image, with +y up.
+ * Loads Radiance .hdr (RGBE, flat or run-length encoded) and .pfm files.
+ * Directions are importance sampled from a single alias table over all texels,
+ * weighted by luminance times sin(theta) to account for the area distortion
+ * of the mapping near the poles.
+ *
+ */
+
+class EnvironmentMap
+{
+public:
+    EnvironmentMap() : width(0), height(0), scale(1.0) {}
+
+    bool load(const string& path);
+
+    vec3 radiance(const vec3& direction) const;
+    vec3 sample(float& pdf) const;
+    float pdf(const vec3& direction) const;
+
+    int width;
+    int height;
+    float scale;
+    vector<vec3> texels;
+    AliasTable distribution;
+
+private:
+    bool loadHDR(FILE* f);
+    bool loadPFM(FILE* f);
+    void buildDistribution();
+    int texelIndex(const vec3& direction, float& sinTheta) const;
+};
+
+bool EnvironmentMap::load(const string& path)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        return false;
+    }
+
+    char magic[2] = { 0, 0 };
+    bool ok = fread(magic, 1, 2, f) == 2;
+    rewind(f);
+
+    if (ok && magic[0] == 'P' && (magic[1] == 'F' || magic[1] == 'f'))
+    {
+        ok = loadPFM(f);
+    }
+    else
+    {
+        ok = ok && loadHDR(f);
+    }
+    fclose(f);
+
+    if (ok)
+    {
+        buildDistribution();
+    }
+    return ok;
+}
+
+bool EnvironmentMap::loadHDR(FILE* f)
+{
+    char line[256];
+    if (!fgets(line, sizeof(line), f) || (strncmp(line, "#?RADIANCE", 10) != 0 && strncmp(line, "#?RGBE", 6) != 0))
+    {
+        return false;
+    }
+
+    // Header variables end at the first empty line; only 32-bit_rle_rgbe is supported.
+    while (fgets(line, sizeof(line), f) && line[0] != '\n')
+    {
+        if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0)
+        {
+            return false;
+        }
+    }
+
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+
+    texels.resize(width * height);
+    vector<unsigned char> scanline(width * 4);
+
+    for (int j = 0; j < height; j++)
+    {
+        unsigned char head[4];
+        if (fread(head, 1, 4, f) != 4)
+        {
+            return false;
+        }
+
+        if (width >= 8 && width < 32768 && head[0] == 2 && head[1] == 2 && ((head[2] << 8) | head[3]) == width)
+        {
+            // New-style RLE: each of the four components is stored as its own run-length encoded plane.
+            for (int c = 0; c < 4; c++)
+            {
+                int i = 0;
+                while (i < width)
+                {
+                    int count = fgetc(f);
+                    if (count == EOF)
+                    {
+                        return false;
+                    }
+
+                    if (count > 128)
+                    {
+                        count -= 128;
+                        int value = fgetc(f);
+                        if (value == EOF || i + count > width)
+                        {
+                            return false;
+                        }
+                        for (int k = 0; k < count; k++)
+                        {
+                            scanline[(i++) * 4 + c] = (unsigned char)value;
+                        }
+                    }
+                    else
+                    {
+                        if (count == 0 || i + count > width)
+                        {
+                            return false;
+                        }
+                        for (int k = 0; k < count; k++)
+                        {
+                            int value = fgetc(f);
+                            if (value == EOF)
+                            {
+                                return false;
+                            }
+                            scanline[(i++) * 4 + c] = (unsigned char)value;
+                        }
+                    }
+                }
+            }
+        }
+        else
+        {
+            // Flat scanline, the first pixel of which was already read.
+            memcpy(scanline.data(), head, 4);
+            if (fread(scanline.data() + 4, 4, width - 1, f) != size_t(width - 1))
+            {
+                return false;
+            }
+        }
+
+        for (int i = 0; i < width; i++)
+        {
+            const unsigned char* rgbe = &scanline[i * 4];
+            vec3 color;
+            if (rgbe[3] != 0)
+            {
+                float f = ldexp(1.0, int(rgbe[3]) - (128 + 8));
+                color = vec3(rgbe[0] * f, rgbe[1] * f, rgbe[2] * f);
+            }
+            texels[j * width + i] = color;
+        }
+    }
+
+    return true;
+}
+
+bool EnvironmentMap::loadPFM(FILE* f)
+{
+    char type[3] = { 0, 0, 0 };
+    float byteOrder;
+    if (fscanf(f, "%2s %d %d %f", type, &width, &height, &byteOrder) != 4 || width <= 0 || height <= 0)
+    {
+        return false;
+    }
+    fgetc(f); // Single whitespace character before the raster
+
+    const int channels = type[1] == 'F' ? 3 : 1;
+    const bool littleEndian = byteOrder < 0.0;
+    vector<float> raster(width * height * channels);
+    if (fread(raster.data(), sizeof(float), raster.size(), f) != raster.size())
+    {
+        return false;
+    }
+
+    const uint16_t probe = 1;
+    if (littleEndian != (*(const unsigned char*)&probe == 1))
+    {
+        for (float& v : raster)
+        {
+            unsigned char* b = (unsigned char*)&v;
+            swap(b[0], b[3]);
+            swap(b[1], b[2]);
+        }
+    }
+
+    // PFM rows run bottom to top.
+    texels.resize(width * height);
+    for (int j = 0; j < height; j++)
+    {
+        const float* row = &raster[(height - 1 - j) * width * channels];
+        for (int i = 0; i < width; i++)
+        {
+            const float* p = &row[i * channels];
+            texels[j * width + i] = channels == 3 ? vec3(p[0], p[1], p[2]) : vec3(p[0], p[0], p[0]);
+        }
+    }
+
+    return true;
+}
+
+void EnvironmentMap::buildDistribution()
+{
+    vector<float> weights(width * height);
+    for (int j = 0; j < height; j++)
+    {
+        float sinTheta = sin(M_PI * (j + 0.5) / height);
+        for (int i = 0; i < width; i++)
+        {
+            weights[j * width + i] = luminance(texels[j * width + i]) * sinTheta;
+        }
+    }
+
+    distribution.build(weights);
+}
+
+int EnvironmentMap::texelIndex(const vec3& direction, float& sinTheta) const
+{
+    vec3 d = vec3::normalize(direction);
+    float theta = acos(clamp(d.y(), -1.0f, 1.0f));
+    float phi = atan2(d.x(), -d.z());
+    sinTheta = sin(theta);
+
+    float u = 0.5 + phi / (2.0 * M_PI);
+    float v = theta / M_PI;
+    int i = clamp(int(u * width), 0, width - 1);
+    int j = clamp(int(v * height), 0, height - 1);
+
+    return j * width + i;
+}
+
+vec3 EnvironmentMap::radiance(const vec3& direction) const
+{
+    float sinTheta;
+    return scale * texels[texelIndex(direction, sinTheta)];
+}
+
+vec3 EnvironmentMap::sample(float& pdf) const
+{
+    int index = distribution.sample(getRand());
+    int i = index % width;
+    int j = index / width;
+
+    // Uniform position within the chosen texel
+    float u = (i + getRand()) / width;
+    float v = (j + getRand()) / height;
+
+    float theta = v * M_PI;
+    float phi = (u - 0.5) * 2.0 * M_PI;
+    float sinTheta = sin(theta);
+
+    // Change of variables from the (u, v) image domain to solid angle
+    pdf = sinTheta > 0.0 ? distribution.pmf(index) * width * height / (2.0 * M_PI * M_PI * sinTheta) : 0.0;
+
+    return vec3(sinTheta * sin(phi), cos(theta), -sinTheta * cos(phi));
+}
+
+float EnvironmentMap::pdf(const vec3& direction) const
+{
+    float sinTheta;
+    int index = texelIndex(direction, sinTheta);
+    if (sinTheta <= 0.0)
+    {
+        return 0.0;
+    }
+
+    return distribution.pmf(index) * width * height / (2.0 * M_PI * M_PI * sinTheta);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef FILMH
+#define FILMH
+
+#include "vec3.h"
+#include "Parallel.h"
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+/**
+ *
+ * Float framebuffer that any thread can add radiance to at any pixel, for
+ * integrators whose samples land away from the pixel being rendered, like
+ * light paths connected to the camera. Adds are lock-free compare-and-swap
+ * loops on the individual channels. Splats scatter over the whole image, so
+ * two threads rarely meet on the same pixel and there is no lock or shared
+ * counter for them to queue on. Pixels are stored in processPixels order,
+ * top row first.
+ *
+ */
+
+class Film
+{
+public:
+    Film(int width, int height);
+
+    // Adds value to the pixel under film coordinates (u, v), as passed to Camera::getRay().
+    void splat(float u, float v, const vec3& value);
+    vec3 pixel(int index) const;
+
+    int width;
+    int height;
+
+private:
+    vector<atomic<float>> channels;
+};
+
+Film::Film(int width, int height) : width(width), height(height), channels(width * height * 3)
+{
+    for (atomic<float>& channel : channels)
+    {
+        channel = 0.0;
+    }
+}
+
+void Film::splat(float u, float v, const vec3& value)
+{
+    int i = min(int(u * width), width - 1);
+    int j = min(int(v * height), height - 1);
+    if (i < 0 || j < 0)
+    {
+        return;
+    }
+
+    int index = (height - 1 - j) * width + i;
+    for (int c = 0; c < 3; c++)
+    {
+        atomicAdd(channels[index * 3 + c], value[c]);
+    }
+}
+
+vec3 Film::pixel(int index) const
+{
+    return vec3(channels[index * 3 + 0], channels[index * 3 + 1], channels[index * 3 + 2]);
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef FRAMESTREAMH
+#define FRAMESTREAMH
+
+#include "ImageWriter.h"
+#include "Parallel.h"
+#include <string>
+#include <cstdio>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ *
+ * Writes frames one after another to a file, a named pipe or, for the path
+ * "-", stdout, for an encoder downstream to read as they come. Every frame
+ * is a 24 byte header followed by its raw samples, interleaved, rows from
+ * the top:
+ *
+ *     "RTFR", then as little endian 32-bit integers the width, height,
+ *     channels, bits per sample and frame number, counting from 0.
+ *
+ * 8 and 16-bit samples are stored as in Image, so 16-bit ones most
+ * significant byte first; 32-bit ones are linear floats in host order.
+ *
+ * A BackgroundThread does the writing, so the next frame renders while
+ * this one is written. The output is opened by that thread as well, since
+ * opening a named pipe blocks until it has a reader.
+ *
+ */
+
+class FrameStream
+{
+public:
+    FrameStream(const string& path) : path(path), pFile(nullptr), failed(false), frameNumber(0) {}
+    ~FrameStream() { finish(); }
+
+    // Hands frame to the writing thread, waiting only while another frame
+    // is already waiting behind the one being written.
+    void submit(Image&& frame);
+    // Waits for every frame to be written and closes the output. False if
+    // anything could not be written.
+    bool finish();
+
+private:
+    void write(const Image& frame);
+
+    string path;
+    FILE* pFile;
+    bool failed;
+    int frameNumber;
+    BackgroundThread writer;
+};
+
+void FrameStream::submit(Image&& frame)
+{
+    writer.submit([this, frame = move(frame)]() { write(frame); });
+}
+
+bool FrameStream::finish()
+{
+    writer.finish();
+    if (pFile && pFile != stdout && fclose(pFile) != 0)
+    {
+        failed = true;
+    }
+    pFile = nullptr;
+    return !failed;
+}
+
+void FrameStream::write(const Image& frame)
+{
+    if (!pFile && !failed)
+    {
+        pFile = path == "-" ? stdout : fopen(path.c_str(), "wb");
+        failed = !pFile;
+    }
+    if (failed)
+    {
+        return;
+    }
+
+    vector<unsigned char> header = { 'R', 'T', 'F', 'R' };
+    putLittleEndian(header, uint32_t(frame.width));
+    putLittleEndian(header, uint32_t(frame.height));
+    putLittleEndian(header, uint32_t(frame.channels));
+    putLittleEndian(header, uint32_t(frame.bitDepth));
+    putLittleEndian(header, uint32_t(frameNumber++));
+    failed = fwrite(header.data(), 1, header.size(), pFile) != header.size() ||
+             fwrite(frame.data.data(), 1, frame.data.size(), pFile) != frame.data.size() ||
+             fflush(pFile) != 0;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef FRAMEBUFFERH
+#define FRAMEBUFFERH
+
+#include "vec3.h"
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Edge length in pixels of the framebuffer's tiles, and the size of the
+// cache lines they are aligned to
+#define FRAMEBUFFER_TILE_SIZE 16
+#define CACHE_LINE_SIZE 64
+
+/**
+ *
+ * RGBA floats of one square tile of the image, row by row. RGB is the sum
+ * of the radiance samples a pixel got and A is their total weight, so that
+ * samples can keep being added and the average is only taken on resolve.
+ *
+ */
+
+struct alignas(CACHE_LINE_SIZE) FramebufferTile
+{
+    void clear() { fill(rgba, rgba + 4 * FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE, 0.0f); }
+    // Adds weight samples summing to color to pixel (x, y) of the tile.
+    void add(int x, int y, const vec3& color, float weight);
+    // Average color of pixel (x, y), black if it has no samples.
+    vec3 average(int x, int y) const;
+
+    float rgba[4 * FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE];
+};
+
+void FramebufferTile::add(int x, int y, const vec3& color, float weight)
+{
+    float* pixel = rgba + 4 * (y * FRAMEBUFFER_TILE_SIZE + x);
+    pixel[0] += color.x();
+    pixel[1] += color.y();
+    pixel[2] += color.z();
+    pixel[3] += weight;
+}
+
+vec3 FramebufferTile::average(int x, int y) const
+{
+    const float* pixel = rgba + 4 * (y * FRAMEBUFFER_TILE_SIZE + x);
+    return pixel[3] > 0.0 ? vec3(pixel[0], pixel[1], pixel[2]) / pixel[3] : vec3();
+}
+
+/**
+ *
+ * HDR accumulation buffer of the whole image, stored tile by tile. Every
+ * tile starts on its own cache line, so threads rendering different tiles
+ * never write to the same line. A worker renders a tile into a local
+ * FramebufferTile and commits it once it is done. Rows count from the top,
+ * like the pixel order of processPixels.
+ *
+ */
+
+class Framebuffer
+{
+public:
+    Framebuffer(int width, int height);
+
+    int numTiles() const { return tilesX * tilesY; }
+    // Pixels [x0, x1) x [y0, y1) of the image that tile covers.
+    void tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const;
+    // Adds a worker's finished local copy of tile.
+    void commit(int tile, const FramebufferTile& local);
+    // Adds weight samples summing to color to pixel (x, y) of the image, for
+    // samples taken a pixel at a time.
+    void add(int x, int y, const vec3& color, float weight);
+    // RGBA sums of pixel (x, y) of the image.
+    const float* pixel(int x, int y) const;
+    // Average color of every pixel, row by row from the top. Pixels without
+    // samples are black.
+    vector<vec3> resolve() const;
+    // Writes the average colors of the pixels of tile to colors, which
+    // holds the whole image like resolve() returns it.
+    void resolveTile(int tile, vector<vec3>& colors) const;
+
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    vector<FramebufferTile> tiles;
+};
+
+Framebuffer::Framebuffer(int width, int height)
+    : width(width), height(height),
+      tilesX((width + FRAMEBUFFER_TILE_SIZE - 1) / FRAMEBUFFER_TILE_SIZE),
+      tilesY((height + FRAMEBUFFER_TILE_SIZE - 1) / FRAMEBUFFER_TILE_SIZE),
+      tiles(tilesX * tilesY)
+{
+    for (FramebufferTile& tile : tiles)
+    {
+        tile.clear();
+    }
+}
+
+void Framebuffer::tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const
+{
+    x0 = (tile % tilesX) * FRAMEBUFFER_TILE_SIZE;
+    y0 = (tile / tilesX) * FRAMEBUFFER_TILE_SIZE;
+    x1 = min(width, x0 + FRAMEBUFFER_TILE_SIZE);
+    y1 = min(height, y0 + FRAMEBUFFER_TILE_SIZE);
+}
+
+void Framebuffer::commit(int tile, const FramebufferTile& local)
+{
+    float* dst = tiles[tile].rgba;
+    for (int k = 0; k < 4 * FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE; k++)
+    {
+        dst[k] += local.rgba[k];
+    }
+}
+
+void Framebuffer::add(int x, int y, const vec3& color, float weight)
+{
+    const int tile = (y / FRAMEBUFFER_TILE_SIZE) * tilesX + x / FRAMEBUFFER_TILE_SIZE;
+    tiles[tile].add(x % FRAMEBUFFER_TILE_SIZE, y % FRAMEBUFFER_TILE_SIZE, color, weight);
+}
+
+const float* Framebuffer::pixel(int x, int y) const
+{
+    const int tile = (y / FRAMEBUFFER_TILE_SIZE) * tilesX + x / FRAMEBUFFER_TILE_SIZE;
+    return tiles[tile].rgba + 4 * ((y % FRAMEBUFFER_TILE_SIZE) * FRAMEBUFFER_TILE_SIZE + x % FRAMEBUFFER_TILE_SIZE);
+}
+
+vector<vec3> Framebuffer::resolve() const
+{
+    vector<vec3> colors(width * height);
+    for (int tile = 0; tile < numTiles(); tile++)
+    {
+        resolveTile(tile, colors);
+    }
+    return colors;
+}
+
+void Framebuffer::resolveTile(int tile, vector<vec3>& colors) const
+{
+    int x0, y0, x1, y1;
+    tileBounds(tile, x0, y0, x1, y1);
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            colors[y * width + x] = tiles[tile].average(x - x0, y - y0);
+        }
+    }
+}
+
+#endif
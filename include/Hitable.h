@@ -2,8 +2,12 @@
 #define HITABLEH
 
 #include "ray.h"
+#include "RaySoA.h"
+#include <cfloat>
 
 class Material;
+class Hitable;
+struct LightBounds;
 
 struct HitRecord
 {
@@ -11,6 +15,24 @@ struct HitRecord
     vec3 p;
     vec3 normal;
     Material* pMat;
+    const Hitable* pObj;
+};
+
+// Closest hits so far of the lanes of a RaySoA block. t starts at the
+// farthest distance to search, and lanes that hit something have pObj set.
+struct HitSoA
+{
+    HitSoA()
+    {
+        for (int lane = 0; lane < PACKET_SIZE; lane++)
+        {
+            t[lane] = FLT_MAX;
+            recs[lane].pObj = nullptr;
+        }
+    }
+
+    float t[PACKET_SIZE];
+    HitRecord recs[PACKET_SIZE];
 };
 
 class Hitable
@@ -19,6 +41,59 @@ public:
     virtual ~Hitable() {}
 
     virtual bool hit(const ray& r, float tMin, float tMax, HitRecord& rec) const = 0;
+
+    // Intersects count unrelated rays, leaving the closest hit of rays[k] in
+    // recs[k], whose pObj is null if it hits nothing. The default traces the
+    // rays one by one.
+    virtual void hitStream(const ray* rays, int count, float tMin, float tMax, HitRecord* recs) const;
+
+    // Intersects count finished blocks of rays, updating the lanes of
+    // hits[k] this object is closer for. Tracing a whole batch per call
+    // saves a virtual call per ray and lets the lanes of a block be tested
+    // together. The default traces the lanes one by one.
+    virtual void hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const;
+
+    // Axis-aligned box enclosing the object, if it is bounded.
+    virtual bool boundingBox(vec3& lo, vec3& hi) const { return false; }
+
+    // Light sampling interface, used for objects with emissive materials.
+    // pdfValue() is the solid angle density of random() picking direction v
+    // when looking at this object from point o.
+    virtual float pdfValue(const vec3& o, const vec3& v) const { return 0.0; }
+    virtual vec3 random(const vec3& o) const { return vec3(1, 0, 0); }
+
+    // Uniformly distributed point on the surface, with its normal and
+    // material, for starting paths on lights.
+    virtual float area() const { return 0.0; }
+    virtual bool randomPoint(HitRecord& rec) const { return false; }
+
+    // Spatial extent, emission directions and power, for building a LightBVH.
+    virtual bool lightBounds(LightBounds& bounds) const { return false; }
 };
 
+void Hitable::hitStream(const ray* rays, int count, float tMin, float tMax, HitRecord* recs) const
+{
+    for (int k = 0; k < count; k++)
+    {
+        if (!hit(rays[k], tMin, tMax, recs[k]))
+        {
+            recs[k].pObj = nullptr;
+        }
+    }
+}
+
+void Hitable::hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const
+{
+    for (int block = 0; block < count; block++)
+    {
+        for (int lane = 0; lane < rays[block].count; lane++)
+        {
+            if (hit(rays[block].getRay(lane), tMin, hits[block].t[lane], hits[block].recs[lane]))
+            {
+                hits[block].t[lane] = hits[block].recs[lane].t;
+            }
+        }
+    }
+}
+
 #endif
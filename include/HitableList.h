@@ -3,6 +3,7 @@
 
 #include "Hitable.h"
 #include <vector>
+#include <cfloat>
 
 using namespace std;
 
@@ -21,6 +22,8 @@ public:
     }
 
     bool hit(const ray& r, float tMin, float tMax, HitRecord& rec) const;
+    void hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const;
+    bool boundingBox(vec3& lo, vec3& hi) const;
 
     vector<Hitable*> list;
 };
@@ -45,4 +48,38 @@ bool HitableList::hit(const ray& r, float tMin, float tMax, HitRecord& rec) cons
     return hitAnything;
 }
 
+// Each object takes the whole batch, so there is one virtual call per object
+// rather than one per object and ray.
+void HitableList::hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const
+{
+    for (Hitable* pHitable : list)
+    {
+        pHitable->hitBatch(rays, hits, count, tMin);
+    }
+}
+
+bool HitableList::boundingBox(vec3& lo, vec3& hi) const
+{
+    lo = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    hi = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+    for (Hitable* pHitable : list)
+    {
+        vec3 childLo;
+        vec3 childHi;
+        if (!pHitable->boundingBox(childLo, childHi))
+        {
+            return false;
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = min(lo[k], childLo[k]);
+            hi[k] = max(hi[k], childHi[k]);
+        }
+    }
+
+    return !list.empty();
+}
+
 #endif
@@ -0,0 +1,975 @@
+#ifndef IMAGEWRITERH
+#define IMAGEWRITERH
+
+#include "vec3.h"
+#include "Parallel.h"
+#include "stb_image_write.h"
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+// Rows of a PNG that are filtered and compressed together, independently of
+// the other bands
+#define PNG_BAND_ROWS 32
+// Farthest back a deflate match may reach, and the size of the match
+// finder's hash table
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+
+enum ImageFormat
+{
+    IMAGE_PNG,
+    IMAGE_QOI,
+    IMAGE_PPM,
+    // Linear float radiance, written without tonemapping or quantizing
+    IMAGE_PFM,
+    IMAGE_HDR,
+    IMAGE_EXR
+};
+
+// The float writers read colors straight from vectors of vec3
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 must be three packed floats");
+
+/**
+ *
+ * Interleaved samples of an image, row by row from the top. 16-bit samples
+ * are stored most significant byte first, which is what PNG and PPM both
+ * want in the file.
+ *
+ */
+
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int bitDepth = 8;
+    vector<unsigned char> data;
+
+    int bytesPerPixel() const { return channels * bitDepth / 8; }
+    int rowBytes() const { return width * bytesPerPixel(); }
+};
+
+// Parses an output format as given on the command line, false if unknown.
+bool parseImageFormat(const string& name, ImageFormat& format)
+{
+    if (name == "png")
+    {
+        format = IMAGE_PNG;
+    }
+    else if (name == "qoi")
+    {
+        format = IMAGE_QOI;
+    }
+    else if (name == "ppm")
+    {
+        format = IMAGE_PPM;
+    }
+    else if (name == "pfm")
+    {
+        format = IMAGE_PFM;
+    }
+    else if (name == "hdr")
+    {
+        format = IMAGE_HDR;
+    }
+    else if (name == "exr")
+    {
+        format = IMAGE_EXR;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+const char* imageExtension(ImageFormat format)
+{
+    switch (format)
+    {
+    case IMAGE_QOI:
+        return "qoi";
+    case IMAGE_PPM:
+        return "ppm";
+    case IMAGE_PFM:
+        return "pfm";
+    case IMAGE_HDR:
+        return "hdr";
+    case IMAGE_EXR:
+        return "exr";
+    default:
+        return "png";
+    }
+}
+
+bool isFloatFormat(ImageFormat format)
+{
+    return format == IMAGE_PFM || format == IMAGE_HDR || format == IMAGE_EXR;
+}
+
+// Wraps 8 or 16-bit samples, such as those of postProcess(), in an Image.
+template <typename T>
+Image makeImage(const vector<T>& samples, int width, int height, int channels)
+{
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    image.bitDepth = 8 * sizeof(T);
+    image.data.resize(samples.size() * sizeof(T));
+    for (size_t k = 0; k < samples.size(); k++)
+    {
+        for (size_t b = 0; b < sizeof(T); b++)
+        {
+            image.data[k * sizeof(T) + b] = (unsigned char)(samples[k] >> (8 * (sizeof(T) - 1 - b)));
+        }
+    }
+    return image;
+}
+
+// Wraps linear colors in a 3-channel Image of 32-bit floats in host order.
+Image makeFloatImage(const vector<vec3>& colors, int width, int height)
+{
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.channels = 3;
+    image.bitDepth = 32;
+    image.data.resize(colors.size() * sizeof(vec3));
+    memcpy(image.data.data(), colors.data(), image.data.size());
+    return image;
+}
+
+// Drops the alpha channel if every pixel is opaque, since it then only
+// takes up space.
+void dropOpaqueAlpha(Image& image)
+{
+    if (image.channels != 4)
+    {
+        return;
+    }
+    const int sampleBytes = image.bitDepth / 8;
+    const size_t numPixels = size_t(image.width) * image.height;
+    for (size_t p = 0; p < numPixels; p++)
+    {
+        for (int b = 0; b < sampleBytes; b++)
+        {
+            if (image.data[(4 * p + 3) * sampleBytes + b] != 0xFF)
+            {
+                return;
+            }
+        }
+    }
+
+    for (size_t p = 0; p < numPixels; p++)
+    {
+        memmove(&image.data[3 * p * sampleBytes], &image.data[4 * p * sampleBytes], 3 * sampleBytes);
+    }
+    image.data.resize(3 * numPixels * sampleBytes);
+    image.channels = 3;
+}
+
+// Continues a CRC-32 (as in PNG and zlib), starting from 0, over data.
+uint32_t updateCRC32(uint32_t crc, const unsigned char* data, size_t length)
+{
+    static const vector<uint32_t> table = []()
+    {
+        vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t k = 0; k < length; k++)
+    {
+        crc = table[(crc ^ data[k]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t adler32(const unsigned char* data, size_t length)
+{
+    uint32_t s1 = 1;
+    uint32_t s2 = 0;
+    while (length > 0)
+    {
+        // The most bytes that cannot overflow s2 before taking the modulus
+        size_t n = min(length, size_t(5552));
+        for (size_t k = 0; k < n; k++)
+        {
+            s1 += data[k];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        data += n;
+        length -= n;
+    }
+    return (s2 << 16) | s1;
+}
+
+// Adler-32 of two pieces of data back to back, from the checksum of each
+// and the length of the second.
+uint32_t combineAdler32(uint32_t first, uint32_t second, size_t secondLength)
+{
+    const uint64_t BASE = 65521;
+    const uint64_t rem = secondLength % BASE;
+    uint64_t s1 = ((first & 0xFFFF) + (second & 0xFFFF) + BASE - 1) % BASE;
+    uint64_t s2 = (rem * (first & 0xFFFF) + (first >> 16) + (second >> 16) + BASE - rem) % BASE;
+    return uint32_t((s2 << 16) | s1);
+}
+
+// Writes bits to a byte vector, least significant first, as deflate packs them
+struct BitWriter
+{
+    BitWriter(vector<unsigned char>* pOut) : pOut(pOut), buffer(0), count(0) {}
+
+    void add(uint32_t bits, int n)
+    {
+        buffer |= bits << count;
+        count += n;
+        while (count >= 8)
+        {
+            pOut->push_back((unsigned char)buffer);
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+    void alignToByte()
+    {
+        if (count > 0)
+        {
+            add(0, 8 - count);
+        }
+    }
+
+    vector<unsigned char>* pOut;
+    uint32_t buffer;
+    int count;
+};
+
+/**
+ *
+ * Codes of deflate's fixed Huffman block type. Literal and length symbols
+ * are stored bit reversed, ready for BitWriter, and lengths and distances
+ * index straight into their symbols.
+ *
+ */
+
+struct DeflateCodes
+{
+    DeflateCodes();
+
+    uint16_t codes[288];
+    unsigned char codeLengths[288];
+    uint16_t lengthSymbols[259]; // For match lengths 3 to 258
+    unsigned char distanceSymbols[DEFLATE_WINDOW + 1];
+};
+
+static const uint16_t DEFLATE_LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char DEFLATE_LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DEFLATE_DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char DEFLATE_DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+DeflateCodes::DeflateCodes()
+{
+    for (int symbol = 0; symbol < 288; symbol++)
+    {
+        int code;
+        int length;
+        if (symbol < 144)
+        {
+            code = 0x30 + symbol;
+            length = 8;
+        }
+        else if (symbol < 256)
+        {
+            code = 0x190 + symbol - 144;
+            length = 9;
+        }
+        else if (symbol < 280)
+        {
+            code = symbol - 256;
+            length = 7;
+        }
+        else
+        {
+            code = 0xC0 + symbol - 280;
+            length = 8;
+        }
+
+        int reversed = 0;
+        for (int b = 0; b < length; b++)
+        {
+            reversed |= ((code >> b) & 1) << (length - 1 - b);
+        }
+        codes[symbol] = uint16_t(reversed);
+        codeLengths[symbol] = (unsigned char)length;
+    }
+
+    for (int s = 0; s < 29; s++)
+    {
+        const int end = s < 28 ? DEFLATE_LENGTH_BASE[s + 1] : 259;
+        for (int length = DEFLATE_LENGTH_BASE[s]; length < end; length++)
+        {
+            lengthSymbols[length] = uint16_t(257 + s);
+        }
+    }
+
+    for (int s = 0; s < 30; s++)
+    {
+        const int end = s < 29 ? DEFLATE_DISTANCE_BASE[s + 1] : DEFLATE_WINDOW + 1;
+        for (int distance = DEFLATE_DISTANCE_BASE[s]; distance < end; distance++)
+        {
+            distanceSymbols[distance] = (unsigned char)s;
+        }
+    }
+}
+
+/**
+ *
+ * Compresses data into deflate blocks that do not end the stream, followed
+ * by an empty stored block so the output ends on a byte boundary (a sync
+ * flush). Runs compressed like this can simply be concatenated, which is
+ * what lets the bands of a PNG be compressed on different threads.
+ *
+ * Level 0 stores the data uncompressed. Higher levels find matches with
+ * hash chains in one fixed Huffman block, following chains further the
+ * higher the level, and from level 4 on also try deferring a match by one
+ * byte in case the next one is longer.
+ *
+ */
+
+void deflateBand(const unsigned char* data, int length, int level, vector<unsigned char>& out)
+{
+    BitWriter bits(&out);
+    if (level <= 0)
+    {
+        for (int start = 0; start < length || start == 0; start += 65535)
+        {
+            const int n = min(length - start, 65535);
+            bits.add(0, 3); // Not final, stored
+            bits.alignToByte();
+            const unsigned char header[4] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)~n, (unsigned char)(~n >> 8) };
+            out.insert(out.end(), header, header + 4);
+            out.insert(out.end(), data + start, data + start + n);
+        }
+        return;
+    }
+
+    static const DeflateCodes table;
+    static const int CHAIN_LIMITS[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+    const int chainLimit = CHAIN_LIMITS[min(level, 9)];
+    const bool lazy = level >= 4;
+
+    const int hashMask = (1 << DEFLATE_HASH_BITS) - 1;
+    vector<int> head(1 << DEFLATE_HASH_BITS, -1);
+    vector<int> prev(length);
+    auto hashAt = [&](int i) { return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & hashMask; };
+    auto insert = [&](int i)
+    {
+        if (i + 2 < length)
+        {
+            const int h = hashAt(i);
+            prev[i] = head[h];
+            head[h] = i;
+        }
+    };
+    // Longest earlier match of the bytes at i, or 0 if shorter than 3
+    auto longestMatch = [&](int i, int& distance)
+    {
+        const int limit = min(258, length - i);
+        if (limit < 3)
+        {
+            return 0;
+        }
+        int best = 0;
+        int chain = chainLimit;
+        for (int j = head[hashAt(i)]; j >= 0 && i - j <= DEFLATE_WINDOW && chain-- > 0; j = prev[j])
+        {
+            if (data[j + best] != data[i + best])
+            {
+                continue;
+            }
+            // Eight bytes at a time, then the first that differs
+            int n = 0;
+            while (n + 8 <= limit)
+            {
+                uint64_t a;
+                uint64_t b;
+                memcpy(&a, data + j + n, 8);
+                memcpy(&b, data + i + n, 8);
+                if (a != b)
+                {
+                    break;
+                }
+                n += 8;
+            }
+            while (n < limit && data[j + n] == data[i + n])
+            {
+                n++;
+            }
+            if (n > best)
+            {
+                best = n;
+                distance = i - j;
+                if (n == limit)
+                {
+                    break;
+                }
+            }
+        }
+        return best >= 3 ? best : 0;
+    };
+    auto putSymbol = [&](int symbol) { bits.add(table.codes[symbol], table.codeLengths[symbol]); };
+
+    bits.add(0, 1); // Not final
+    bits.add(1, 2); // Fixed Huffman codes
+    int i = 0;
+    while (i < length)
+    {
+        int distance = 0;
+        const int matchLength = longestMatch(i, distance);
+        insert(i);
+        if (matchLength > 0 && lazy)
+        {
+            int nextDistance;
+            if (longestMatch(i + 1, nextDistance) > matchLength)
+            {
+                putSymbol(data[i]);
+                i++;
+                continue;
+            }
+        }
+        if (matchLength == 0)
+        {
+            putSymbol(data[i]);
+            i++;
+            continue;
+        }
+
+        const int symbol = table.lengthSymbols[matchLength];
+        putSymbol(symbol);
+        if (DEFLATE_LENGTH_EXTRA[symbol - 257] > 0)
+        {
+            bits.add(matchLength - DEFLATE_LENGTH_BASE[symbol - 257], DEFLATE_LENGTH_EXTRA[symbol - 257]);
+        }
+        const int distanceSymbol = table.distanceSymbols[distance];
+        int reversed = 0;
+        for (int b = 0; b < 5; b++)
+        {
+            reversed |= ((distanceSymbol >> b) & 1) << (4 - b);
+        }
+        bits.add(reversed, 5);
+        if (DEFLATE_DISTANCE_EXTRA[distanceSymbol] > 0)
+        {
+            bits.add(distance - DEFLATE_DISTANCE_BASE[distanceSymbol], DEFLATE_DISTANCE_EXTRA[distanceSymbol]);
+        }
+        for (int k = 1; k < matchLength; k++)
+        {
+            insert(i + k);
+        }
+        i += matchLength;
+    }
+    putSymbol(256); // End of block
+
+    // Sync flush
+    bits.add(0, 3);
+    bits.alignToByte();
+    const unsigned char empty[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    out.insert(out.end(), empty, empty + 4);
+}
+
+// Filters one row of n bytes, where up is the row above (zeros for the
+// first) and bpp the bytes per pixel, with PNG filter type filter.
+void applyPNGFilter(int filter, const unsigned char* row, const unsigned char* up, int n, int bpp, unsigned char* out)
+{
+    auto paeth = [](int a, int b, int c)
+    {
+        const int p = a + b - c;
+        const int pa = abs(p - a);
+        const int pb = abs(p - b);
+        const int pc = abs(p - c);
+        return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+    };
+
+    // The first pixel has nothing to its left, which counts as zeros
+    const int first = min(bpp, n);
+    switch (filter)
+    {
+    case 1: // Sub
+        memcpy(out, row, first);
+        for (int i = bpp; i < n; i++)
+        {
+            out[i] = (unsigned char)(row[i] - row[i - bpp]);
+        }
+        break;
+    case 2: // Up
+        for (int i = 0; i < n; i++)
+        {
+            out[i] = (unsigned char)(row[i] - up[i]);
+        }
+        break;
+    case 3: // Average
+        for (int i = 0; i < first; i++)
+        {
+            out[i] = (unsigned char)(row[i] - (up[i] >> 1));
+        }
+        for (int i = bpp; i < n; i++)
+        {
+            out[i] = (unsigned char)(row[i] - ((row[i - bpp] + up[i]) >> 1));
+        }
+        break;
+    case 4: // Paeth
+        for (int i = 0; i < first; i++)
+        {
+            out[i] = (unsigned char)(row[i] - up[i]);
+        }
+        for (int i = bpp; i < n; i++)
+        {
+            out[i] = (unsigned char)(row[i] - paeth(row[i - bpp], up[i], up[i - bpp]));
+        }
+        break;
+    default:
+        memcpy(out, row, n);
+        break;
+    }
+}
+
+// Writes the four byte big endian value to out.
+void putBigEndian32(unsigned char* out, uint32_t value)
+{
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+// Sets the length and CRC of a PNG chunk whose bytes after its length field
+// are in chunk, starting with the tag, and appends the CRC.
+void finishPNGChunk(vector<unsigned char>& chunk)
+{
+    putBigEndian32(chunk.data(), uint32_t(chunk.size() - 8));
+    const uint32_t crc = updateCRC32(0, chunk.data() + 4, chunk.size() - 4);
+    chunk.resize(chunk.size() + 4);
+    putBigEndian32(&chunk[chunk.size() - 4], crc);
+}
+
+/**
+ *
+ * Writes image as a PNG, compressed with deflate level 0 to 9. Bands of
+ * PNG_BAND_ROWS rows are filtered, compressed and checksummed in parallel,
+ * each into an IDAT chunk of its own; their deflate runs are independent
+ * and byte aligned, so together they still form the one zlib stream PNG
+ * requires. A last small IDAT ends the stream with the Adler-32 combined
+ * from the bands'. Rows take whichever filter gives the smallest sum of
+ * absolute values, except uncompressed at level 0.
+ *
+ */
+
+bool writePNG(const string& path, const Image& image, int level)
+{
+    const int rowBytes = image.rowBytes();
+    const int bpp = image.bytesPerPixel();
+    const int numBands = (image.height + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+    vector<vector<unsigned char>> chunks(numBands);
+    vector<uint32_t> adlers(numBands);
+    vector<size_t> bandLengths(numBands);
+
+    parallelFor(numBands, [&](int start, int end)
+    {
+        const vector<unsigned char> zeros(rowBytes, 0);
+        vector<unsigned char> candidate(rowBytes);
+        vector<unsigned char> filtered;
+        for (int band = start; band < end; band++)
+        {
+            const int y0 = band * PNG_BAND_ROWS;
+            const int y1 = min(image.height, y0 + PNG_BAND_ROWS);
+            filtered.resize(size_t(y1 - y0) * (rowBytes + 1));
+            for (int y = y0; y < y1; y++)
+            {
+                const unsigned char* row = &image.data[size_t(y) * rowBytes];
+                const unsigned char* up = y > 0 ? row - rowBytes : zeros.data();
+                unsigned char* out = &filtered[size_t(y - y0) * (rowBytes + 1)];
+                int bestFilter = 0;
+                if (level > 0)
+                {
+                    long long bestScore = -1;
+                    for (int filter = 0; filter < 5; filter++)
+                    {
+                        applyPNGFilter(filter, row, up, rowBytes, bpp, candidate.data());
+                        long long score = 0;
+                        for (int i = 0; i < rowBytes; i++)
+                        {
+                            score += abs((signed char)candidate[i]);
+                        }
+                        if (bestScore < 0 || score < bestScore)
+                        {
+                            bestScore = score;
+                            bestFilter = filter;
+                        }
+                    }
+                }
+                out[0] = (unsigned char)bestFilter;
+                applyPNGFilter(bestFilter, row, up, rowBytes, bpp, out + 1);
+            }
+            adlers[band] = adler32(filtered.data(), filtered.size());
+            bandLengths[band] = filtered.size();
+
+            vector<unsigned char>& chunk = chunks[band];
+            chunk = { 0, 0, 0, 0, 'I', 'D', 'A', 'T' };
+            if (band == 0)
+            {
+                // zlib header: 32K window, and the level in FLEVEL
+                chunk.push_back(0x78);
+                chunk.push_back(level <= 1 ? 0x01 : (level <= 5 ? 0x5E : (level == 6 ? 0x9C : 0xDA)));
+            }
+            deflateBand(filtered.data(), int(filtered.size()), level, chunk);
+            finishPNGChunk(chunk);
+        }
+    });
+
+    uint32_t adler = 1;
+    for (int band = 0; band < numBands; band++)
+    {
+        adler = combineAdler32(adler, adlers[band], bandLengths[band]);
+    }
+
+    vector<unsigned char> header = { 0, 0, 0, 0, 'I', 'H', 'D', 'R', 0, 0, 0, 0, 0, 0, 0, 0 };
+    putBigEndian32(&header[8], image.width);
+    putBigEndian32(&header[12], image.height);
+    const unsigned char colorType = image.channels == 4 ? 6 : (image.channels == 3 ? 2 : 0);
+    header.insert(header.end(), { (unsigned char)image.bitDepth, colorType, 0, 0, 0 });
+    finishPNGChunk(header);
+
+    // An empty final stored block, then the checksum
+    vector<unsigned char> trailer = { 0, 0, 0, 0, 'I', 'D', 'A', 'T', 0x01, 0x00, 0x00, 0xFF, 0xFF, 0, 0, 0, 0 };
+    putBigEndian32(&trailer[13], adler);
+    finishPNGChunk(trailer);
+
+    vector<unsigned char> footer = { 0, 0, 0, 0, 'I', 'E', 'N', 'D' };
+    finishPNGChunk(footer);
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    bool written = fwrite(signature, 1, 8, file) == 8;
+    written = written && fwrite(header.data(), 1, header.size(), file) == header.size();
+    for (const vector<unsigned char>& chunk : chunks)
+    {
+        written = written && fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+    }
+    written = written && fwrite(trailer.data(), 1, trailer.size(), file) == trailer.size();
+    written = written && fwrite(footer.data(), 1, footer.size(), file) == footer.size();
+    return fclose(file) == 0 && written;
+}
+
+/**
+ *
+ * Writes an 8-bit image in the Quite OK Image format: one pass that codes
+ * each pixel as a run of the previous one, an index into the 64 most
+ * recently seen colors, a small difference from the previous pixel, or
+ * literally. Several times faster than deflate, at a somewhat larger size.
+ *
+ */
+
+bool writeQOI(const string& path, const Image& image)
+{
+    if (image.bitDepth != 8)
+    {
+        return false;
+    }
+    vector<unsigned char> out = { 'q', 'o', 'i', 'f', 0, 0, 0, 0, 0, 0, 0, 0, (unsigned char)image.channels, 0 };
+    putBigEndian32(&out[4], image.width);
+    putBigEndian32(&out[8], image.height);
+    out.reserve(out.size() + image.data.size() + image.data.size() / 4 + 8);
+
+    unsigned char seen[64][4] = {};
+    unsigned char prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    const size_t numPixels = size_t(image.width) * image.height;
+    for (size_t p = 0; p < numPixels; p++)
+    {
+        const unsigned char* sample = &image.data[p * image.channels];
+        const unsigned char px[4] = { sample[0], sample[1], sample[2], image.channels == 4 ? sample[3] : (unsigned char)255 };
+        if (memcmp(px, prev, 4) == 0)
+        {
+            run++;
+            if (run == 62 || p + 1 == numPixels)
+            {
+                out.push_back((unsigned char)(0xC0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0)
+        {
+            out.push_back((unsigned char)(0xC0 | (run - 1)));
+            run = 0;
+        }
+
+        const int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (memcmp(seen[hash], px, 4) == 0)
+        {
+            out.push_back((unsigned char)hash);
+        }
+        else
+        {
+            memcpy(seen[hash], px, 4);
+            const int dr = (signed char)(px[0] - prev[0]);
+            const int dg = (signed char)(px[1] - prev[1]);
+            const int db = (signed char)(px[2] - prev[2]);
+            if (px[3] != prev[3])
+            {
+                out.insert(out.end(), { 0xFF, px[0], px[1], px[2], px[3] });
+            }
+            else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            }
+            else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7)
+            {
+                out.push_back((unsigned char)(0x80 | (dg + 32)));
+                out.push_back((unsigned char)((dr - dg + 8) << 4 | (db - dg + 8)));
+            }
+            else
+            {
+                out.insert(out.end(), { 0xFE, px[0], px[1], px[2] });
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    return fclose(file) == 0 && written;
+}
+
+// Writes the color channels of image, uncompressed, as a binary PPM.
+bool writePPM(const string& path, const Image& image)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n%d\n", image.width, image.height, image.bitDepth == 16 ? 65535 : 255);
+
+    bool written = true;
+    const int sampleBytes = image.bitDepth / 8;
+    if (image.channels == 3)
+    {
+        written = fwrite(image.data.data(), 1, image.data.size(), file) == image.data.size();
+    }
+    else
+    {
+        vector<unsigned char> row(size_t(image.width) * 3 * sampleBytes);
+        for (int y = 0; y < image.height && written; y++)
+        {
+            const unsigned char* src = &image.data[size_t(y) * image.rowBytes()];
+            for (int x = 0; x < image.width; x++)
+            {
+                memcpy(&row[size_t(x) * 3 * sampleBytes], src + size_t(x) * image.bytesPerPixel(), 3 * sampleBytes);
+            }
+            written = fwrite(row.data(), 1, row.size(), file) == row.size();
+        }
+    }
+    return fclose(file) == 0 && written;
+}
+
+// Writes linear colors, row by row from the top, as a little endian PFM.
+// PFM stores rows from the bottom, so the rows are written in reverse,
+// straight from colors.
+bool writePFM(const string& path, const vector<vec3>& colors, int width, int height)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    // A negative scale marks the floats as little endian
+    const uint32_t one = 1;
+    unsigned char firstByte;
+    memcpy(&firstByte, &one, 1);
+    fprintf(file, "PF\n%d %d\n%s\n", width, height, firstByte == 1 ? "-1.0" : "1.0");
+
+    bool written = true;
+    for (int y = height - 1; y >= 0 && written; y--)
+    {
+        written = fwrite(&colors[size_t(y) * width], sizeof(vec3), width, file) == size_t(width);
+    }
+    return fclose(file) == 0 && written;
+}
+
+// Writes linear colors, row by row from the top, as a Radiance RGBE file.
+bool writeHDR(const string& path, const vector<vec3>& colors, int width, int height)
+{
+    return stbi_write_hdr(path.c_str(), width, height, 3, reinterpret_cast<const float*>(colors.data())) != 0;
+}
+
+// Nearest half precision float, ties to even, infinite beyond its range.
+uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t magnitude = bits & 0x7FFFFFFF;
+    if (magnitude >= 0x7F800000)
+    {
+        // Infinity stays infinite, NaN stays NaN
+        return uint16_t(sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0));
+    }
+    if (magnitude >= 0x477FF000)
+    {
+        // Rounds to more than 65504, the largest half
+        return uint16_t(sign | 0x7C00);
+    }
+    if (magnitude < 0x38800000)
+    {
+        // Below the smallest normal half: the result is denormal, with the
+        // implicit one shifted down into the mantissa, or zero
+        if (magnitude < 0x33000000)
+        {
+            return uint16_t(sign);
+        }
+        const uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        const int shift = 126 - int(magnitude >> 23);
+        uint32_t half = mantissa >> shift;
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+        {
+            half++;
+        }
+        return uint16_t(sign | half);
+    }
+    // Rebias the exponent and round the mantissa to 10 bits. Rounding up
+    // may carry into the exponent, which is still the right result.
+    uint32_t half = (magnitude - 0x38000000) >> 13;
+    const uint32_t rest = magnitude & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    {
+        half++;
+    }
+    return uint16_t(sign | half);
+}
+
+// Appends value to out in little endian byte order.
+template <typename T>
+void putLittleEndian(vector<unsigned char>& out, T value)
+{
+    for (size_t b = 0; b < sizeof(T); b++)
+    {
+        out.push_back((unsigned char)(uint64_t(value) >> (8 * b)));
+    }
+}
+
+/**
+ *
+ * Writes linear colors, row by row from the top, as an uncompressed
+ * scanline OpenEXR file of half floats. The header has only the required
+ * attributes, and every row is its own block, converted to half floats
+ * one row at a time as the file is written.
+ *
+ */
+
+bool writeEXR(const string& path, const vector<vec3>& colors, int width, int height)
+{
+    vector<unsigned char> header = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+    auto attribute = [&](const char* name, const char* type, uint32_t size)
+    {
+        header.insert(header.end(), name, name + strlen(name) + 1);
+        header.insert(header.end(), type, type + strlen(type) + 1);
+        putLittleEndian(header, size);
+    };
+    auto box = [&](const char* name)
+    {
+        attribute(name, "box2i", 16);
+        putLittleEndian(header, int32_t(0));
+        putLittleEndian(header, int32_t(0));
+        putLittleEndian(header, int32_t(width - 1));
+        putLittleEndian(header, int32_t(height - 1));
+    };
+
+    // Channels are listed, and stored in every row, in alphabetical order
+    attribute("channels", "chlist", 3 * 18 + 1);
+    for (const char* channel : { "B", "G", "R" })
+    {
+        header.insert(header.end(), channel, channel + 2);
+        putLittleEndian(header, int32_t(1)); // Half
+        putLittleEndian(header, uint32_t(0)); // Not perceptually linear, and reserved
+        putLittleEndian(header, int32_t(1)); // x and y sampling
+        putLittleEndian(header, int32_t(1));
+    }
+    header.push_back(0);
+    attribute("compression", "compression", 1);
+    header.push_back(0); // None
+    box("dataWindow");
+    box("displayWindow");
+    attribute("lineOrder", "lineOrder", 1);
+    header.push_back(0); // Increasing y
+    attribute("pixelAspectRatio", "float", 4);
+    putLittleEndian(header, uint32_t(0x3F800000)); // 1.0
+    attribute("screenWindowCenter", "v2f", 8);
+    putLittleEndian(header, uint64_t(0));
+    attribute("screenWindowWidth", "float", 4);
+    putLittleEndian(header, uint32_t(0x3F800000));
+    header.push_back(0);
+
+    // Offset of every row's block from the start of the file
+    const uint64_t rowSize = uint64_t(width) * 3 * 2;
+    const uint64_t firstRow = header.size() + uint64_t(height) * 8;
+    for (int y = 0; y < height; y++)
+    {
+        putLittleEndian(header, firstRow + uint64_t(y) * (8 + rowSize));
+    }
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+    bool written = fwrite(header.data(), 1, header.size(), file) == header.size();
+    vector<unsigned char> block;
+    for (int y = 0; y < height && written; y++)
+    {
+        block.clear();
+        putLittleEndian(block, int32_t(y));
+        putLittleEndian(block, uint32_t(rowSize));
+        const vec3* row = &colors[size_t(y) * width];
+        for (int c = 2; c >= 0; c--)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                putLittleEndian(block, floatToHalf(row[x][c]));
+            }
+        }
+        written = fwrite(block.data(), 1, block.size(), file) == block.size();
+    }
+    return fclose(file) == 0 && written;
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef LIGHTBVHH
+#define LIGHTBVHH
+
+#include "Hitable.h"
+#include "LightBounds.h"
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ *
+ * Bounding volume hierarchy over the scene's light sources. Each node holds
+ * the LightBounds of its subtree, and sample() walks down from the root,
+ * stochastically choosing each child in proportion to its estimated
+ * importance at the shading point. pmf() replays the same walk for a given
+ * light using the bit trail recorded for it during the build.
+ *
+ */
+
+class LightBVH
+{
+public:
+    LightBVH() {}
+    LightBVH(const vector<Hitable*>& lights) { build(lights); }
+
+    void build(const vector<Hitable*>& lights);
+
+    const Hitable* sample(const vec3& p, const vec3& n, float u, float& pmf) const;
+    float pmf(const Hitable* pLight, const vec3& p, const vec3& n) const;
+
+    struct Node
+    {
+        LightBounds bounds;
+        int child1;     // Second child; the first immediately follows its parent
+        int lightIndex; // -1 for interior nodes
+    };
+
+    vector<Node> nodes;
+    vector<Hitable*> lights;
+    unordered_map<const Hitable*, uint64_t> trails;
+
+private:
+    int buildRecursive(vector<pair<int, LightBounds>>& items, int begin, int end, uint64_t trail, int depth);
+};
+
+void LightBVH::build(const vector<Hitable*>& sceneLights)
+{
+    nodes.clear();
+    trails.clear();
+    lights.clear();
+
+    vector<pair<int, LightBounds>> items;
+    for (Hitable* pLight : sceneLights)
+    {
+        LightBounds bounds;
+        if (pLight->lightBounds(bounds) && bounds.power > 0.0)
+        {
+            items.push_back(make_pair(int(lights.size()), bounds));
+            lights.push_back(pLight);
+        }
+    }
+
+    if (!items.empty())
+    {
+        buildRecursive(items, 0, int(items.size()), 0, 0);
+    }
+}
+
+int LightBVH::buildRecursive(vector<pair<int, LightBounds>>& items, int begin, int end, uint64_t trail, int depth)
+{
+    int index = int(nodes.size());
+    nodes.push_back(Node());
+
+    if (end - begin == 1)
+    {
+        nodes[index].bounds = items[begin].second;
+        nodes[index].child1 = -1;
+        nodes[index].lightIndex = items[begin].first;
+        trails[lights[items[begin].first]] = trail;
+        return index;
+    }
+
+    LightBounds bounds;
+    LightBounds centroids;
+    for (int i = begin; i < end; i++)
+    {
+        bounds = unionBounds(bounds, items[i].second);
+        vec3 c = items[i].second.centroid();
+        for (int k = 0; k < 3; k++)
+        {
+            centroids.lo[k] = min(centroids.lo[k], c[k]);
+            centroids.hi[k] = max(centroids.hi[k], c[k]);
+        }
+    }
+
+    // Median split along the longest axis of the centroids keeps the tree
+    // balanced, so trails of any realistic light count fit in 64 bits.
+    vec3 extent = centroids.hi - centroids.lo;
+    int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+    auto less = [axis](const pair<int, LightBounds>& a, const pair<int, LightBounds>& b)
+    {
+        return a.second.centroid()[axis] < b.second.centroid()[axis];
+    };
+    int mid = (begin + end) / 2;
+    nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, less);
+
+    nodes[index].bounds = bounds;
+    nodes[index].lightIndex = -1;
+    buildRecursive(items, begin, mid, trail, depth + 1);
+    int child1 = buildRecursive(items, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+    nodes[index].child1 = child1;
+
+    return index;
+}
+
+const Hitable* LightBVH::sample(const vec3& p, const vec3& n, float u, float& pmf) const
+{
+    pmf = 1.0;
+    if (nodes.empty())
+    {
+        return nullptr;
+    }
+
+    int index = 0;
+    while (nodes[index].lightIndex < 0)
+    {
+        float importance0 = nodes[index + 1].bounds.importance(p, n);
+        float importance1 = nodes[nodes[index].child1].bounds.importance(p, n);
+        if (importance0 == 0.0 && importance1 == 0.0)
+        {
+            return nullptr;
+        }
+
+        // Pick a child and remap u so it can be reused further down
+        float p0 = importance0 / (importance0 + importance1);
+        if (u < p0)
+        {
+            index = index + 1;
+            u = min(u / p0, 0.99999994f);
+            pmf *= p0;
+        }
+        else
+        {
+            index = nodes[index].child1;
+            u = min((u - p0) / (1.0f - p0), 0.99999994f);
+            pmf *= 1.0 - p0;
+        }
+    }
+
+    return nodes[index].bounds.importance(p, n) > 0.0 ? lights[nodes[index].lightIndex] : nullptr;
+}
+
+float LightBVH::pmf(const Hitable* pLight, const vec3& p, const vec3& n) const
+{
+    auto it = trails.find(pLight);
+    if (it == trails.end())
+    {
+        return 0.0;
+    }
+
+    uint64_t trail = it->second;
+    float pmf = 1.0;
+    int index = 0;
+    while (nodes[index].lightIndex < 0)
+    {
+        float importance0 = nodes[index + 1].bounds.importance(p, n);
+        float importance1 = nodes[nodes[index].child1].bounds.importance(p, n);
+        if (importance0 == 0.0 && importance1 == 0.0)
+        {
+            return 0.0;
+        }
+
+        float p0 = importance0 / (importance0 + importance1);
+        if (trail & 1)
+        {
+            index = nodes[index].child1;
+            pmf *= 1.0 - p0;
+        }
+        else
+        {
+            index = index + 1;
+            pmf *= p0;
+        }
+        trail >>= 1;
+    }
+
+    return nodes[index].bounds.importance(p, n) > 0.0 ? pmf : 0.0;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef LIGHTBOUNDSH
+#define LIGHTBOUNDSH
+
+#include "vec3.h"
+#include <algorithm>
+#include <cfloat>
+
+using namespace std;
+
+/**
+ *
+ * Spatial and directional bounds of a set of emitters: an axis-aligned box,
+ * a cone of emission normals (axis, thetaO) plus the extra spread thetaE
+ * over which each normal emits, and the total emitted power.
+ *
+ */
+
+struct LightBounds
+{
+    LightBounds() :
+        lo(FLT_MAX, FLT_MAX, FLT_MAX),
+        hi(-FLT_MAX, -FLT_MAX, -FLT_MAX),
+        axis(0, 1, 0),
+        cosThetaO(1.0),
+        cosThetaE(1.0),
+        power(0.0)
+    {}
+
+    vec3 centroid() const { return 0.5 * (lo + hi); }
+
+    // Conservative estimate of the contribution to point p with normal n.
+    float importance(const vec3& p, const vec3& n) const;
+
+    vec3 lo;
+    vec3 hi;
+    vec3 axis;
+    float cosThetaO;
+    float cosThetaE;
+    float power;
+};
+
+// Cone of all normals of both inputs (Conty and Kulla 2018).
+inline void mergeCones(const vec3& axisA, float thetaA, const vec3& axisB, float thetaB, vec3& axis, float& theta)
+{
+    if (thetaB > thetaA)
+    {
+        mergeCones(axisB, thetaB, axisA, thetaA, axis, theta);
+        return;
+    }
+
+    float thetaD = acos(clamp(dot(axisA, axisB), -1.0f, 1.0f));
+    if (min(thetaD + thetaB, float(M_PI)) <= thetaA)
+    {
+        axis = axisA;
+        theta = thetaA;
+        return;
+    }
+
+    theta = (thetaA + thetaD + thetaB) / 2.0;
+    if (theta >= M_PI)
+    {
+        axis = axisA;
+        theta = M_PI;
+        return;
+    }
+
+    // Rotate axisA toward axisB until the new cone covers both
+    float rotation = theta - thetaA;
+    vec3 w = cross(axisA, axisB);
+    if (w.squared_length() < 1e-12)
+    {
+        axis = axisA;
+        theta = M_PI;
+        return;
+    }
+    w.normalize();
+    vec3 perpendicular = cross(w, axisA);
+    axis = vec3::normalize(cos(rotation) * axisA + sin(rotation) * perpendicular);
+}
+
+inline LightBounds unionBounds(const LightBounds& a, const LightBounds& b)
+{
+    if (a.power == 0.0)
+    {
+        return b;
+    }
+    if (b.power == 0.0)
+    {
+        return a;
+    }
+
+    LightBounds result;
+    for (int k = 0; k < 3; k++)
+    {
+        result.lo[k] = min(a.lo[k], b.lo[k]);
+        result.hi[k] = max(a.hi[k], b.hi[k]);
+    }
+
+    float thetaO;
+    mergeCones(a.axis, acos(a.cosThetaO), b.axis, acos(b.cosThetaO), result.axis, thetaO);
+    result.cosThetaO = cos(thetaO);
+    result.cosThetaE = min(a.cosThetaE, b.cosThetaE);
+    result.power = a.power + b.power;
+
+    return result;
+}
+
+float LightBounds::importance(const vec3& p, const vec3& n) const
+{
+    vec3 pc = centroid();
+    vec3 toPoint = p - pc;
+    float radiusSquared = 0.25 * (hi - lo).squared_length();
+    float distSquared = max(toPoint.squared_length(), 0.5f * (hi - lo).length());
+
+    // Angle subtended by the bounds (through its bounding sphere)
+    float cosThetaB = toPoint.squared_length() <= radiusSquared ? -1.0 : sqrt(1.0 - radiusSquared / toPoint.squared_length());
+    float thetaB = acos(cosThetaB);
+
+    vec3 wi = toPoint.squared_length() > 0.0 ? vec3::normalize(toPoint) : n;
+
+    // Smallest possible angle between an emitter normal and the direction to p
+    float thetaW = acos(clamp(dot(axis, wi), -1.0f, 1.0f));
+    float thetaPrime = max(0.0f, thetaW - acos(cosThetaO) - thetaB);
+    if (cos(thetaPrime) <= cosThetaE)
+    {
+        return 0.0;
+    }
+
+    // Smallest possible incident angle at p
+    float thetaI = acos(clamp(dot(n, -wi), -1.0f, 1.0f));
+    float cosThetaIPrime = cos(max(0.0f, thetaI - thetaB));
+    if (cosThetaIPrime <= 0.0)
+    {
+        return 0.0;
+    }
+
+    return power * cos(thetaPrime) * cosThetaIPrime / distSquared;
+}
+
+#endif
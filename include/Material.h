@@ -2,6 +2,7 @@
 #define MATERIALH
 
 #include "vec3.h"
+#include "Hitable.h"
 #include <algorithm>
 
 /**
@@ -15,15 +16,36 @@ class Material
 public:
     virtual bool scatter(const ray& rayIn, const HitRecord& rec, vec3& attenuation, ray& scattered) const = 0;
     virtual bool reflect(const ray& rayIn, const HitRecord& rec, vec3& attenuation, ray& reflected) const = 0;
+
+    // Radiance emitted from the surface back along rayIn.
+    virtual vec3 emitted(const ray& rayIn, const HitRecord& rec) const { return vec3(0, 0, 0); }
+
+    // Radiance emitted uniformly over the surface, used to estimate light power.
+    virtual vec3 emission() const { return vec3(0, 0, 0); }
+
+    // Diffuse lobe evaluated for an arbitrary direction, for light sampling:
+    // scatterEval() is the BRDF times the cosine term, and scatterPdf() the
+    // solid angle density with which scatter() would have picked direction.
+    virtual vec3 scatterEval(const ray& rayIn, const HitRecord& rec, const vec3& direction) const { return vec3(0, 0, 0); }
+    virtual float scatterPdf(const HitRecord& rec, const vec3& direction) const { return 0.0; }
+
+    // Specular color at normal incidence (F0) of materials that reflect().
+    virtual bool reflectance(vec3& F0) const { return false; }
 };
 
+// Cosine-weighted density of the diffuse scattering used by the materials below.
+inline float cosinePdf(const HitRecord& rec, const vec3& direction)
+{
+    float cosine = dot(rec.normal, vec3::normalize(direction));
+    return cosine > 0.0 ? cosine / M_PI : 0.0;
+}
+
 
 
 /**
  *
  * Material class for Lambertian materials, or materials with only a diffuse
- * component. Uses globally illuminated scattering to light objects at the
- * moment.
+ * component. Scatters with a cosine-weighted distribution around the normal.
  *
  */
 
@@ -36,7 +58,7 @@ public:
     {
         attenuation = albedo;
 
-        vec3 target = rec.normal + vec3::randomInUnitSphere();
+        vec3 target = rec.normal + vec3::randomUnitVector();
         scattered = ray(rec.p, target);
 
         // vec3 target = randomInUnitHemisphere(rec.normal);
@@ -52,6 +74,13 @@ public:
 
     virtual bool reflect(const ray& rayIn, const HitRecord& rec, vec3& attenuation, ray& reflected) const { return false; }
 
+    virtual vec3 scatterEval(const ray& rayIn, const HitRecord& rec, const vec3& direction) const
+    {
+        return albedo * cosinePdf(rec, direction);
+    }
+
+    virtual float scatterPdf(const HitRecord& rec, const vec3& direction) const { return cosinePdf(rec, direction); }
+
     vec3 albedo;
 };
 
@@ -82,6 +111,12 @@ public:
         return dot(reflected.direction(), rec.normal) >= 0;
     }
 
+    virtual bool reflectance(vec3& F0) const
+    {
+        F0 = albedo;
+        return true;
+    }
+
     vec3 albedo;
     float roughness;
 };
@@ -115,7 +150,7 @@ public:
 
         attenuation = albedo * (1.0 - metallic);
 
-        vec3 target = rec.normal + vec3::randomInUnitSphere();
+        vec3 target = rec.normal + vec3::randomUnitVector();
         scattered = ray(rec.p, target);
 
         // vec3 target = randomInUnitHemisphere(rec.normal);
@@ -138,9 +173,55 @@ public:
         return dot(reflected.direction(), rec.normal) >= 0;
     }
 
+    virtual vec3 scatterEval(const ray& rayIn, const HitRecord& rec, const vec3& direction) const
+    {
+        return albedo * (1.0 - metallic) * cosinePdf(rec, direction);
+    }
+
+    virtual float scatterPdf(const HitRecord& rec, const vec3& direction) const
+    {
+        return metallic == 1.0 ? 0.0 : cosinePdf(rec, direction);
+    }
+
+    virtual bool reflectance(vec3& F0) const
+    {
+        F0 = lerp(vec3(0.04, 0.04, 0.04), albedo, metallic);
+        return true;
+    }
+
     vec3 albedo;
     float roughness;
     float metallic;
 };
 
+
+
+/**
+ *
+ * Material class for area lights. Emissive materials neither scatter nor
+ * reflect; they only emit their radiance from the front side of the surface.
+ * Objects using this material should also be registered as scene lights so
+ * they get sampled explicitly.
+ *
+ */
+
+class Emissive : public Material
+{
+public:
+    Emissive(const vec3& e = vec3(1, 1, 1)) : radiance(e) {}
+
+    virtual bool scatter(const ray& rayIn, const HitRecord& rec, vec3& attenuation, ray& scattered) const { return false; }
+
+    virtual bool reflect(const ray& rayIn, const HitRecord& rec, vec3& attenuation, ray& reflected) const { return false; }
+
+    virtual vec3 emitted(const ray& rayIn, const HitRecord& rec) const
+    {
+        return dot(rayIn.direction(), rec.normal) < 0 ? radiance : vec3(0, 0, 0);
+    }
+
+    virtual vec3 emission() const { return radiance; }
+
+    vec3 radiance;
+};
+
 #endif
@@ -0,0 +1,242 @@
+#ifndef OPTIONSH
+#define OPTIONSH
+
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+
+using namespace std;
+
+/**
+ *
+ * Run-time settings taken from the command line. Anything not given keeps
+ * the defaults below.
+ *
+ */
+
+struct Options
+{
+    string envPath;
+    float envScale = 1.0;
+    string scene = "default";
+    string integrator = "path";
+    int numLights = 10000;
+    int numSpheres = 1000000;
+    string accel = "bvh";
+    bool sortRays = false;
+    int interleave = 1;
+    string lightSampler = "bvh";
+    int restirFrames = 0;
+    int guideIterations = 0;
+    int cacheDepth = 0;
+    float cacheCellSize = 0.05;
+    float cacheError = 0.05;
+    int cacheSpp = 16;
+    int denoisePasses = 0;
+    int visibilityGrid = 0;
+    float exposure = 0.0;
+    string tonemap = "none";
+    bool dither = true;
+    int bitDepth = 8;
+    string format = "png";
+    int pngLevel = 3;
+    string stream;
+    string tiledPath;
+    int passes = 1;
+    string checkpointPath;
+    float timeBudget = 0.0;
+    bool preview = false;
+    string animationPath;
+    int firstFrame = -1;
+    int lastFrame = -1;
+};
+
+void printUsage(const char* program)
+{
+    cerr << "Usage: " << program << " [options]" << endl
+         << "  --env <file>         Light the scene with a lat-long .hdr or .pfm environment map" << endl
+         << "  --env-scale <s>      Multiply the environment map radiance by s" << endl
+         << "  --scene <name>       default, manylights, occluded, or large" << endl
+         << "  --integrator <name>  path (default), bdpt for bidirectional path tracing, mlt for Metropolis light transport," << endl
+         << "                       or wavefront for the path tracer run in stages over queues of paths" << endl
+         << "  --sort-rays          Wavefront only: sort each batch of rays by direction octant and origin cell" << endl
+         << "  --num-lights <n>     Number of emitters in the manylights scene" << endl
+         << "  --num-spheres <n>    Number of small spheres in the large scene" << endl
+         << "  --accel <name>       bvh (default) or list to intersect every object with every ray" << endl
+         << "  --interleave <n>     Wavefront only: rays the BVH traverses at once, prefetching for each other" << endl
+         << "  --light-sampler <s>  bvh (default) or uniform light selection" << endl
+         << "  --restir <frames>    Preview render: 1 spp frames with reservoir-resampled direct lighting" << endl
+         << "  --guide <n>          Train a path guide for n passes (1, 2, 4, ... spp) before rendering" << endl
+         << "  --cache <depth>      End paths at diffuse vertices from this depth (1 or more) with a radiance cache" << endl
+         << "  --cache-cell <size>  World-space edge length of the radiance cache cells" << endl
+         << "  --cache-error <e>    Largest relative standard error of a cell the cache will return" << endl
+         << "  --cache-spp <n>      Samples per pixel of the pass that fills the radiance cache" << endl
+         << "  --denoise <passes>   Denoise with this many a-trous passes (5 is typical) guided by albedo, normal and depth" << endl
+         << "  --visibility <g>     Path tracer only: rasterize first hits at g x g fixed subpixels instead of tracing camera rays" << endl
+         << "  --exposure <stops>   Scale the image by 2^stops before tonemapping" << endl
+         << "  --tonemap <name>     none (clip, default), reinhard, aces or filmic" << endl
+         << "  --no-dither          Round to the nearest output value instead of blue noise dithering" << endl
+         << "  --bit-depth <bits>   Bits per sample of the output, 8 (default) or 16 (PNG and PPM only), or 32 for linear floats (--stream and --tiled only)" << endl
+         << "  --format <name>      Write image.png (default), image.qoi or image.ppm (uncompressed), or linear image.pfm, image.hdr or image.exr" << endl
+         << "  --png-level <0-9>    Deflate level of PNG output, 0 for none (default 3)" << endl
+         << "  --stream <path>      Write raw frames with a small header to path, or stdout for -, instead of an image file" << endl
+         << "  --tiled <path>       Path tracer only: render tile by tile into a tiled TIFF at path, keeping only tiles in flight in memory" << endl
+         << "  --passes <n>         Path tracer only: render the samples in n passes, writing the image after each (1)" << endl
+         << "  --checkpoint <path>  Path tracer only: save progress to path after every pass, and resume from it if it exists" << endl
+         << "  --time <seconds>     Path tracer only: render until this long after starting, instead of N_S samples per pixel," << endl
+         << "                       putting the samples where the image is noisiest" << endl
+         << "  --preview            Path tracer only: first write the image at 1/16, 1/8 and 1/4 resolution, 1 spp each" << endl
+         << "  --animate <file>     Path tracer only: render the frames of a file of camera and sphere keyframes" << endl
+         << "                       to image.0000.png and on, or to --stream" << endl
+         << "  --frames <a>-<b>     Frames to animate, by default from the first keyframe to the last" << endl;
+}
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--env" && hasValue)
+        {
+            options.envPath = argv[++i];
+        }
+        else if (arg == "--env-scale" && hasValue)
+        {
+            options.envScale = atof(argv[++i]);
+        }
+        else if (arg == "--scene" && hasValue)
+        {
+            options.scene = argv[++i];
+        }
+        else if (arg == "--integrator" && hasValue)
+        {
+            options.integrator = argv[++i];
+        }
+        else if (arg == "--num-lights" && hasValue)
+        {
+            options.numLights = atoi(argv[++i]);
+        }
+        else if (arg == "--sort-rays")
+        {
+            options.sortRays = true;
+        }
+        else if (arg == "--num-spheres" && hasValue)
+        {
+            options.numSpheres = atoi(argv[++i]);
+        }
+        else if (arg == "--accel" && hasValue)
+        {
+            options.accel = argv[++i];
+        }
+        else if (arg == "--interleave" && hasValue)
+        {
+            options.interleave = atoi(argv[++i]);
+        }
+        else if (arg == "--light-sampler" && hasValue)
+        {
+            options.lightSampler = argv[++i];
+        }
+        else if (arg == "--restir" && hasValue)
+        {
+            options.restirFrames = atoi(argv[++i]);
+        }
+        else if (arg == "--guide" && hasValue)
+        {
+            options.guideIterations = atoi(argv[++i]);
+        }
+        else if (arg == "--cache" && hasValue)
+        {
+            options.cacheDepth = atoi(argv[++i]);
+        }
+        else if (arg == "--cache-cell" && hasValue)
+        {
+            options.cacheCellSize = atof(argv[++i]);
+        }
+        else if (arg == "--cache-error" && hasValue)
+        {
+            options.cacheError = atof(argv[++i]);
+        }
+        else if (arg == "--cache-spp" && hasValue)
+        {
+            options.cacheSpp = atoi(argv[++i]);
+        }
+        else if (arg == "--denoise" && hasValue)
+        {
+            options.denoisePasses = atoi(argv[++i]);
+        }
+        else if (arg == "--visibility" && hasValue)
+        {
+            options.visibilityGrid = atoi(argv[++i]);
+        }
+        else if (arg == "--exposure" && hasValue)
+        {
+            options.exposure = atof(argv[++i]);
+        }
+        else if (arg == "--tonemap" && hasValue)
+        {
+            options.tonemap = argv[++i];
+        }
+        else if (arg == "--no-dither")
+        {
+            options.dither = false;
+        }
+        else if (arg == "--bit-depth" && hasValue)
+        {
+            options.bitDepth = atoi(argv[++i]);
+        }
+        else if (arg == "--format" && hasValue)
+        {
+            options.format = argv[++i];
+        }
+        else if (arg == "--png-level" && hasValue)
+        {
+            options.pngLevel = atoi(argv[++i]);
+        }
+        else if (arg == "--stream" && hasValue)
+        {
+            options.stream = argv[++i];
+        }
+        else if (arg == "--tiled" && hasValue)
+        {
+            options.tiledPath = argv[++i];
+        }
+        else if (arg == "--passes" && hasValue)
+        {
+            options.passes = atoi(argv[++i]);
+        }
+        else if (arg == "--checkpoint" && hasValue)
+        {
+            options.checkpointPath = argv[++i];
+        }
+        else if (arg == "--time" && hasValue)
+        {
+            options.timeBudget = atof(argv[++i]);
+        }
+        else if (arg == "--preview")
+        {
+            options.preview = true;
+        }
+        else if (arg == "--animate" && hasValue)
+        {
+            options.animationPath = argv[++i];
+        }
+        else if (arg == "--frames" && hasValue &&
+                 sscanf(argv[i + 1], "%d-%d", &options.firstFrame, &options.lastFrame) == 2 &&
+                 options.firstFrame >= 0 && options.firstFrame <= options.lastFrame)
+        {
+            i++;
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef PSSMLTH
+#define PSSMLTH
+
+#include "Config.h"
+#include "Camera.h"
+#include "PathTracer.h"
+#include "AliasTable.h"
+#include "Film.h"
+#include "Parallel.h"
+#include "Random.h"
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+
+// Paths traced to estimate the image brightness and seed the chains
+#define PSSMLT_BOOTSTRAP 100000
+#define PSSMLT_CHAINS 1024
+// Standard deviation of small-step mutations, and how often a step is a fresh sample instead
+#define PSSMLT_SIGMA 0.01
+#define PSSMLT_LARGE_STEP 0.3
+
+/**
+ *
+ * Primary sample space Metropolis light transport (Kelemen et al. 2002).
+ * The path tracer is left as it is; a PrimarySampleSpace takes over getRand()
+ * and hands it the coordinates of the current state in the unit hypercube,
+ * which Markov chains then mutate, either slightly or by drawing a fresh
+ * state. Chains settle where the image is bright and stay there, so light
+ * that few random paths find gets explored once it has been found.
+ *
+ * Coordinates are mutated lazily when consumed, since a path rarely uses as
+ * many as the previous one, and rejected mutations restore their backups.
+ *
+ */
+
+class PrimarySampleSpace : public RandomSource
+{
+public:
+    PrimarySampleSpace(uint64_t index, float sigma, float largeStepProbability);
+
+    void startIteration();
+    void accept();
+    void reject();
+    virtual double next();
+
+private:
+    struct PrimarySample
+    {
+        double value = 0.0;
+        double backup = 0.0;
+        int64_t lastModification = 0;
+        int64_t backupModification = 0;
+    };
+
+    RNG rng;
+    float sigma;
+    float largeStepProbability;
+    vector<PrimarySample> X;
+    int64_t currentIteration;
+    int64_t lastLargeStepIteration;
+    bool largeStep;
+    int sampleIndex;
+};
+
+// A chain whose index matches a bootstrap sample's replays that sample exactly.
+PrimarySampleSpace::PrimarySampleSpace(uint64_t index, float sigma, float largeStepProbability)
+    : rng(0, index),
+      sigma(sigma),
+      largeStepProbability(largeStepProbability),
+      currentIteration(0),
+      lastLargeStepIteration(0),
+      largeStep(true),
+      sampleIndex(0)
+{}
+
+void PrimarySampleSpace::startIteration()
+{
+    currentIteration++;
+    largeStep = rng.nextDouble() < largeStepProbability;
+    sampleIndex = 0;
+}
+
+void PrimarySampleSpace::accept()
+{
+    if (largeStep)
+    {
+        lastLargeStepIteration = currentIteration;
+    }
+}
+
+void PrimarySampleSpace::reject()
+{
+    for (PrimarySample& Xi : X)
+    {
+        if (Xi.lastModification == currentIteration)
+        {
+            Xi.value = Xi.backup;
+            Xi.lastModification = Xi.backupModification;
+        }
+    }
+    currentIteration--;
+}
+
+double PrimarySampleSpace::next()
+{
+    if (sampleIndex >= int(X.size()))
+    {
+        X.resize(sampleIndex + 1);
+    }
+    PrimarySample& Xi = X[sampleIndex++];
+
+    // Catch up on a large step this coordinate was not used in
+    if (Xi.lastModification < lastLargeStepIteration)
+    {
+        Xi.value = rng.nextDouble();
+        Xi.lastModification = lastLargeStepIteration;
+    }
+
+    Xi.backup = Xi.value;
+    Xi.backupModification = Xi.lastModification;
+
+    if (largeStep)
+    {
+        Xi.value = rng.nextDouble();
+    }
+    else
+    {
+        // The small steps missed while unused add up to one wider Gaussian
+        double normal = sqrt(-2.0 * log(1.0 - rng.nextDouble())) * cos(2.0 * M_PI * rng.nextDouble());
+        Xi.value += normal * sigma * sqrt(double(currentIteration - Xi.lastModification));
+        Xi.value -= floor(Xi.value);
+    }
+    Xi.lastModification = currentIteration;
+
+    return Xi.value;
+}
+
+// Radiance of the camera path sampler's current state describes, and where
+// on the film it starts.
+vec3 primarySampleRadiance(Camera* cam, const Scene* scene, PrimarySampleSpace& sampler, float& u, float& v)
+{
+    pRandomSource = &sampler;
+    u = getRand();
+    v = getRand();
+    vec3 L = getColor(cam->getRay(u, v), *scene, 0, 0.0, vec3());
+    pRandomSource = nullptr;
+
+    return isfinite(luminance(L)) ? L : vec3(0, 0, 0);
+}
+
+// Renders with as many mutations as N_S samples per pixel would trace paths,
+// and returns linear colors in processPixels order.
+vector<vec3> renderPSSMLT(Camera* cam, const Scene* scene)
+{
+    const int numPixels = N_X * N_Y;
+    vector<vec3> colors(numPixels);
+
+    // Bootstrap: the mean path luminance normalizes the image, and chains
+    // start from bootstrap samples picked in proportion to theirs
+    vector<float> weights(PSSMLT_BOOTSTRAP);
+    parallelFor(PSSMLT_BOOTSTRAP, [&](int start, int end)
+    {
+        for (int i = start; i < end; i++)
+        {
+            PrimarySampleSpace sampler(i, PSSMLT_SIGMA, PSSMLT_LARGE_STEP);
+            float u;
+            float v;
+            weights[i] = luminance(primarySampleRadiance(cam, scene, sampler, u, v));
+        }
+    });
+
+    double b = 0.0;
+    for (float w : weights)
+    {
+        b += w;
+    }
+    b /= PSSMLT_BOOTSTRAP;
+    if (b <= 0.0)
+    {
+        return colors;
+    }
+    AliasTable bootstrap(weights);
+
+    Film film(N_X, N_Y);
+    const int64_t totalMutations = int64_t(N_S) * numPixels;
+
+    parallelFor(PSSMLT_CHAINS, [&](int start, int end)
+    {
+        for (int chain = start; chain < end; chain++)
+        {
+            const int64_t mutations = totalMutations * (chain + 1) / PSSMLT_CHAINS - totalMutations * chain / PSSMLT_CHAINS;
+
+            RNG rng(chain, PSSMLT_BOOTSTRAP + chain);
+            PrimarySampleSpace sampler(bootstrap.sample(rng.nextDouble()), PSSMLT_SIGMA, PSSMLT_LARGE_STEP);
+            float uCurrent;
+            float vCurrent;
+            vec3 LCurrent = primarySampleRadiance(cam, scene, sampler, uCurrent, vCurrent);
+
+            for (int64_t m = 0; m < mutations; m++)
+            {
+                sampler.startIteration();
+                float uProposed;
+                float vProposed;
+                vec3 LProposed = primarySampleRadiance(cam, scene, sampler, uProposed, vProposed);
+
+                // Splat both states weighted by their acceptance probability
+                // rather than only the one the chain moves to
+                float fCurrent = luminance(LCurrent);
+                float fProposed = luminance(LProposed);
+                float acceptance = fCurrent > 0.0 ? min(1.0f, fProposed / fCurrent) : 1.0f;
+                if (acceptance > 0.0 && fProposed > 0.0)
+                {
+                    film.splat(uProposed, vProposed, LProposed * (acceptance / fProposed));
+                }
+                if (acceptance < 1.0)
+                {
+                    film.splat(uCurrent, vCurrent, LCurrent * ((1.0 - acceptance) / fCurrent));
+                }
+
+                if (rng.nextDouble() < acceptance)
+                {
+                    uCurrent = uProposed;
+                    vCurrent = vProposed;
+                    LCurrent = LProposed;
+                    sampler.accept();
+                }
+                else
+                {
+                    sampler.reject();
+                }
+            }
+        }
+    });
+
+    // Each splat carries a unit of luminance; b per path scales that back
+    for (int iter = 0; iter < numPixels; iter++)
+    {
+        colors[iter] = film.pixel(iter) * float(b / N_S);
+    }
+    return colors;
+}
+
+#endif
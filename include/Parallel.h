@@ -0,0 +1,229 @@
+#ifndef PARALLELH
+#define PARALLELH
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+/**
+ *
+ * Worker threads started once and then kept waiting for work, for jobs run
+ * over and over, like the frames of an animation, where starting and
+ * joining threads for each would add up. run() hands a job's tasks out one
+ * at a time from a shared counter, so tasks of uneven cost still balance.
+ *
+ */
+
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    int size() const { return int(threads.size()); }
+    // Calls func(task) for every task in [0, count) on the pool's threads,
+    // and blocks until all are done.
+    void run(int count, const function<void(int)>& func);
+
+private:
+    void work();
+
+    vector<thread> threads;
+    mutex lock;
+    condition_variable started;
+    condition_variable finished;
+    const function<void(int)>* pJob;
+    int jobSize;
+    atomic<int> nextTask;
+    int generation; // Counts jobs, so a worker can tell a new one from the last
+    int working; // Workers not yet done with the current job
+    bool stopping;
+};
+
+ThreadPool::ThreadPool() : pJob(nullptr), jobSize(0), nextTask(0), generation(0), working(0), stopping(false)
+{
+    const int NUM_THREADS = max(1, int(thread::hardware_concurrency()));
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        threads.push_back(thread(&ThreadPool::work, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    started.notify_all();
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+}
+
+void ThreadPool::run(int count, const function<void(int)>& func)
+{
+    unique_lock<mutex> guard(lock);
+    pJob = &func;
+    jobSize = count;
+    nextTask = 0;
+    working = size();
+    generation++;
+    started.notify_all();
+    finished.wait(guard, [&]() { return working == 0; });
+    pJob = nullptr;
+}
+
+void ThreadPool::work()
+{
+    int done = 0;
+    while (true)
+    {
+        const function<void(int)>* pFunc;
+        int count;
+        {
+            unique_lock<mutex> guard(lock);
+            started.wait(guard, [&]() { return stopping || generation != done; });
+            if (stopping)
+            {
+                return;
+            }
+            done = generation;
+            pFunc = pJob;
+            count = jobSize;
+        }
+
+        for (int task = nextTask++; task < count; task = nextTask++)
+        {
+            (*pFunc)(task);
+        }
+
+        lock_guard<mutex> guard(lock);
+        if (--working == 0)
+        {
+            finished.notify_one();
+        }
+    }
+}
+
+// Pool that parallelFor() on this thread runs on, if it has one; otherwise
+// parallelFor() starts and joins threads of its own on every call
+thread_local ThreadPool* pThreadPool = nullptr;
+
+// Runs func(start, end) over [0, count) split into one contiguous range per
+// hardware thread, and blocks until every range is done.
+template <typename Func>
+void parallelFor(int count, Func func)
+{
+    if (pThreadPool)
+    {
+        const int numRanges = pThreadPool->size();
+        pThreadPool->run(numRanges, [&](int i)
+        {
+            func(int((long long)i * count / numRanges), int((long long)(i + 1) * count / numRanges));
+        });
+        return;
+    }
+
+    const int NUM_THREADS = max(1, int(thread::hardware_concurrency()));
+    vector<thread> threads(NUM_THREADS);
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        threads[i] = thread(func, int((long long)i * count / NUM_THREADS), int((long long)(i + 1) * count / NUM_THREADS));
+    }
+
+    for (int i = 0; i < NUM_THREADS; i++)
+    {
+        threads[i].join();
+    }
+}
+
+/**
+ *
+ * One thread running jobs in the background in the order they come, for
+ * work like encoding and writing output that should overlap what comes
+ * next. submit() returns as soon as the job is handed over, and only waits
+ * while there is already a job waiting behind the one running.
+ *
+ */
+
+class BackgroundThread
+{
+public:
+    BackgroundThread() : hasPending(false), closing(false) { worker = thread(&BackgroundThread::run, this); }
+    ~BackgroundThread() { finish(); }
+
+    void submit(function<void()> job);
+    // Runs the jobs still waiting and stops the thread.
+    void finish();
+
+private:
+    void run();
+
+    mutex lock;
+    condition_variable changed;
+    function<void()> pending;
+    bool hasPending;
+    bool closing;
+    thread worker;
+};
+
+void BackgroundThread::submit(function<void()> job)
+{
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [&]() { return !hasPending; });
+    pending = move(job);
+    hasPending = true;
+    changed.notify_all();
+}
+
+void BackgroundThread::finish()
+{
+    if (worker.joinable())
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+}
+
+void BackgroundThread::run()
+{
+    while (true)
+    {
+        function<void()> job;
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&]() { return hasPending || closing; });
+            if (!hasPending)
+            {
+                return;
+            }
+            job = move(pending);
+            hasPending = false;
+        }
+        changed.notify_all();
+        job();
+    }
+}
+
+// Lock-free accumulation. Relaxed ordering is enough as long as nothing reads
+// the sum before the threads adding to it have been joined.
+inline void atomicAdd(atomic<float>& a, float value)
+{
+    float old = a.load(memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + value, memory_order_relaxed))
+    {
+    }
+}
+
+#endif
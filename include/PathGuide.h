@@ -0,0 +1,415 @@
+#ifndef PATHGUIDEH
+#define PATHGUIDEH
+
+#include "vec3.h"
+#include "Parallel.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+
+using namespace std;
+
+// Spatial leaves split once they record more than this times sqrt(spp) samples
+#define GUIDE_SPATIAL_THRESHOLD 12000
+// Directional cells holding more than this fraction of a leaf's energy are subdivided
+#define GUIDE_ENERGY_THRESHOLD 0.01
+#define GUIDE_MAX_DEPTH 20
+// Probability of sampling a diffuse bounce from the guide rather than the BSDF
+#define GUIDE_FRACTION 0.5
+
+/**
+ *
+ * Directional distribution of incident radiance as a quadtree over the
+ * cylindrical mapping of the sphere (cos(theta), phi), which preserves area,
+ * so a density over the unit square is 4 pi times the solid angle density.
+ * Every node keeps the energy of its four quadrants.
+ *
+ */
+
+struct QuadNode
+{
+    QuadNode()
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            sums[q] = 0.0;
+            children[q] = 0;
+        }
+    }
+
+    QuadNode(const QuadNode& other) { *this = other; }
+
+    QuadNode& operator=(const QuadNode& other)
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            sums[q] = other.sums[q].load(memory_order_relaxed);
+            children[q] = other.children[q];
+        }
+        return *this;
+    }
+
+    float total() const { return sums[0] + sums[1] + sums[2] + sums[3]; }
+
+    atomic<float> sums[4];
+    int children[4]; // 0 for quadrants that are leaves
+};
+
+// Picks the quadrant of (x, y) and maps the point into it.
+inline int childQuadrant(float& x, float& y)
+{
+    int q = 0;
+    x *= 2.0;
+    y *= 2.0;
+    if (x >= 1.0)
+    {
+        q |= 1;
+        x -= 1.0;
+    }
+    if (y >= 1.0)
+    {
+        q |= 2;
+        y -= 1.0;
+    }
+    return q;
+}
+
+inline void directionToSquare(const vec3& direction, float& x, float& y)
+{
+    vec3 d = vec3::normalize(direction);
+    x = clamp(0.5f * (d.y() + 1.0f), 0.0f, 0.99999994f);
+    y = clamp(float(0.5 + atan2(d.z(), d.x()) / (2.0 * M_PI)), 0.0f, 0.99999994f);
+}
+
+inline vec3 squareToDirection(float x, float y)
+{
+    float cosTheta = 2.0 * x - 1.0;
+    float sinTheta = sqrt(max(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = (y - 0.5) * 2.0 * M_PI;
+    return vec3(sinTheta * cos(phi), cosTheta, sinTheta * sin(phi));
+}
+
+class DTree
+{
+public:
+    DTree() : nodes(1), weight(0.0) {}
+    DTree(const DTree& other) : nodes(other.nodes), weight(other.weight.load()) {}
+
+    DTree& operator=(const DTree& other)
+    {
+        nodes = other.nodes;
+        weight = other.weight.load();
+        return *this;
+    }
+
+    void record(const vec3& direction, float value);
+    float pdf(const vec3& direction) const;
+    vec3 sample() const;
+
+    // Rebuilds this tree's structure from the energies in previous, with all sums cleared.
+    void refineFrom(const DTree& previous);
+
+    vector<QuadNode> nodes;
+    atomic<float> weight; // Number of samples recorded
+};
+
+void DTree::record(const vec3& direction, float value)
+{
+    atomicAdd(weight, 1.0);
+    if (!(value > 0.0) || !isfinite(value))
+    {
+        return;
+    }
+
+    float x;
+    float y;
+    directionToSquare(direction, x, y);
+
+    int index = 0;
+    while (true)
+    {
+        int q = childQuadrant(x, y);
+        atomicAdd(nodes[index].sums[q], value);
+        if (!nodes[index].children[q])
+        {
+            break;
+        }
+        index = nodes[index].children[q];
+    }
+}
+
+float DTree::pdf(const vec3& direction) const
+{
+    if (nodes[0].total() <= 0.0)
+    {
+        return 1.0 / (4.0 * M_PI);
+    }
+
+    float x;
+    float y;
+    directionToSquare(direction, x, y);
+
+    float density = 1.0;
+    int index = 0;
+    while (true)
+    {
+        const QuadNode& node = nodes[index];
+        int q = childQuadrant(x, y);
+        float total = node.total();
+        if (total <= 0.0)
+        {
+            return 0.0;
+        }
+
+        density *= 4.0 * node.sums[q] / total;
+        if (!node.children[q])
+        {
+            break;
+        }
+        index = node.children[q];
+    }
+
+    return density / (4.0 * M_PI);
+}
+
+vec3 DTree::sample() const
+{
+    if (nodes[0].total() <= 0.0)
+    {
+        return vec3::randomUnitVector();
+    }
+
+    float originX = 0.0;
+    float originY = 0.0;
+    float size = 1.0;
+    int index = 0;
+    while (true)
+    {
+        const QuadNode& node = nodes[index];
+        float u = getRand() * node.total();
+
+        int q = 0;
+        while (q < 3 && u >= node.sums[q])
+        {
+            u -= node.sums[q];
+            q++;
+        }
+
+        size *= 0.5;
+        originX += (q & 1) ? size : 0.0;
+        originY += (q & 2) ? size : 0.0;
+        if (!node.children[q])
+        {
+            break;
+        }
+        index = node.children[q];
+    }
+
+    return squareToDirection(originX + getRand() * size, originY + getRand() * size);
+}
+
+void DTree::refineFrom(const DTree& previous)
+{
+    struct Item
+    {
+        int oldIndex;  // -1 when the old tree had a leaf here
+        float energy[4];
+        int newIndex;
+        int depth;
+    };
+
+    nodes.assign(1, QuadNode());
+    weight = 0.0;
+
+    float total = previous.nodes[0].total();
+    if (total <= 0.0)
+    {
+        return;
+    }
+
+    vector<Item> stack;
+    Item root = { 0, {}, 0, 1 };
+    for (int q = 0; q < 4; q++)
+    {
+        root.energy[q] = previous.nodes[0].sums[q];
+    }
+    stack.push_back(root);
+
+    while (!stack.empty())
+    {
+        Item item = stack.back();
+        stack.pop_back();
+
+        for (int q = 0; q < 4; q++)
+        {
+            if (item.energy[q] / total <= GUIDE_ENERGY_THRESHOLD || item.depth >= GUIDE_MAX_DEPTH)
+            {
+                continue;
+            }
+
+            // Subdivide; unseen children share the energy of their parent evenly
+            Item child;
+            child.oldIndex = item.oldIndex >= 0 ? previous.nodes[item.oldIndex].children[q] : 0;
+            child.oldIndex = child.oldIndex > 0 ? child.oldIndex : -1;
+            for (int c = 0; c < 4; c++)
+            {
+                child.energy[c] = child.oldIndex >= 0 ? previous.nodes[child.oldIndex].sums[c].load() : item.energy[q] / 4.0f;
+            }
+            child.newIndex = int(nodes.size());
+            child.depth = item.depth + 1;
+
+            nodes[item.newIndex].children[q] = child.newIndex;
+            nodes.push_back(QuadNode());
+            stack.push_back(child);
+        }
+    }
+}
+
+/**
+ *
+ * Practical path guiding (Mueller et al. 2017): a binary spatial tree over
+ * the scene bounds whose leaves each hold a DTree of incident radiance.
+ * Training runs in iterations; during one, paths record into the building
+ * trees with atomic adds while bounces are guided by the sampling trees from
+ * the previous iteration. refine() then splits busy leaves, promotes the
+ * building trees to sampling trees and starts empty ones on the refined
+ * structure.
+ *
+ */
+
+class PathGuide
+{
+public:
+    PathGuide(const vec3& lo, const vec3& hi) : lo(lo), hi(hi), ready(false), training(false)
+    {
+        nodes.push_back(SpatialNode());
+        leaves.push_back(unique_ptr<Leaf>(new Leaf()));
+    }
+
+    void record(const vec3& p, const vec3& direction, float value) { leafAt(p).building.record(direction, value); }
+    float pdf(const vec3& p, const vec3& direction) const { return leafAt(p).sampling.pdf(direction); }
+    vec3 sample(const vec3& p) const { return leafAt(p).sampling.sample(); }
+
+    void refine(int spp);
+
+    // Fits the spatial bounds to where path vertices actually land, ignoring
+    // the most distant few percent (e.g. far away parts of a ground plane).
+    void fitBounds(vector<vec3>& points);
+
+    struct Leaf
+    {
+        DTree sampling;
+        DTree building;
+    };
+
+    struct SpatialNode
+    {
+        SpatialNode() : axis(0), child(0), leaf(0) {}
+
+        int axis;
+        int child; // First of two consecutive children, 0 for leaves
+        int leaf;
+    };
+
+    vec3 lo;
+    vec3 hi;
+    vector<SpatialNode> nodes;
+    vector<unique_ptr<Leaf>> leaves;
+
+    bool ready;    // Sampling trees hold a trained distribution
+    bool training; // Paths should record into the building trees
+
+private:
+    Leaf& leafAt(const vec3& p) const;
+};
+
+void PathGuide::fitBounds(vector<vec3>& points)
+{
+    if (points.size() < 2)
+    {
+        return;
+    }
+
+    const int n = int(points.size());
+    for (int k = 0; k < 3; k++)
+    {
+        auto less = [k](const vec3& a, const vec3& b) { return a[k] < b[k]; };
+        nth_element(points.begin(), points.begin() + n / 50, points.end(), less);
+        float low = points[n / 50][k];
+        nth_element(points.begin(), points.begin() + (n - 1 - n / 50), points.end(), less);
+        float high = points[n - 1 - n / 50][k];
+
+        float margin = 0.05 * (high - low) + 1e-3;
+        lo[k] = low - margin;
+        hi[k] = high + margin;
+    }
+}
+
+// Points outside the bounds fall into the closest border leaf.
+PathGuide::Leaf& PathGuide::leafAt(const vec3& p) const
+{
+    vec3 nodeLo = lo;
+    vec3 nodeHi = hi;
+    int index = 0;
+    while (nodes[index].child)
+    {
+        int axis = nodes[index].axis;
+        float mid = 0.5 * (nodeLo[axis] + nodeHi[axis]);
+        if (p[axis] < mid)
+        {
+            nodeHi[axis] = mid;
+            index = nodes[index].child;
+        }
+        else
+        {
+            nodeLo[axis] = mid;
+            index = nodes[index].child + 1;
+        }
+    }
+    return *leaves[nodes[index].leaf];
+}
+
+void PathGuide::refine(int spp)
+{
+    // Split leaves that saw enough samples; the halves inherit their
+    // parent's distributions and share its sample count.
+    const float threshold = GUIDE_SPATIAL_THRESHOLD * sqrt(float(spp));
+    for (int index = 0; index < int(nodes.size()); index++)
+    {
+        if (nodes[index].child)
+        {
+            continue;
+        }
+
+        Leaf& leaf = *leaves[nodes[index].leaf];
+        if (leaf.building.weight <= threshold)
+        {
+            continue;
+        }
+
+        leaf.building.weight = leaf.building.weight / 2.0;
+        unique_ptr<Leaf> sibling(new Leaf(leaf));
+
+        SpatialNode first;
+        first.axis = (nodes[index].axis + 1) % 3;
+        first.leaf = nodes[index].leaf;
+        SpatialNode second = first;
+        second.leaf = int(leaves.size());
+        leaves.push_back(move(sibling));
+
+        nodes[index].child = int(nodes.size());
+        nodes.push_back(first);
+        nodes.push_back(second);
+    }
+
+    for (unique_ptr<Leaf>& leaf : leaves)
+    {
+        leaf->sampling = leaf->building;
+        leaf->building.refineFrom(leaf->sampling);
+    }
+    ready = true;
+}
+
+#endif
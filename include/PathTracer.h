@@ -0,0 +1,217 @@
+#ifndef PATHTRACERH
+#define PATHTRACERH
+
+#include "Config.h"
+#include "Scene.h"
+#include <cfloat>
+
+using namespace std;
+
+vec3 SchlickApprox(const vec3 n, const vec3 l, const vec3 F0)
+{
+    // More intuitively, lerp(F0, <white>, pow(1.0 - dot(n, l), 5.0))
+    return F0 + (vec3(1, 1, 1) - F0) * pow(1.0 - max(0.0f, dot(n, l)), 5.0);
+}
+
+// Schlick term of the specular reflection at rec for direction w, zero for
+// materials without one.
+inline vec3 fresnel(const HitRecord& rec, const vec3& w)
+{
+    vec3 F0;
+    return rec.pMat->reflectance(F0) ? SchlickApprox(rec.normal, w, F0) : vec3(0, 0, 0);
+}
+
+// Albedo of the diffuse lobe, whose scatterEval() toward the normal is albedo / pi.
+inline vec3 diffuseAlbedo(const HitRecord& rec)
+{
+    return M_PI * rec.pMat->scatterEval(ray(rec.p, rec.normal), rec, rec.normal);
+}
+
+vec3 getColor(const ray& r, const Scene& scene, int depth, float scatterPdf, const vec3& prevNormal);
+
+// Radiance along a ray that left the scene.
+vec3 missColor(const ray& r, const Scene& scene, float scatterPdf)
+{
+    vec3 color = background(scene, r.direction());
+
+    // Environment light is sampled explicitly as well, so weight diffuse bounces
+    if (scene.pEnv && scatterPdf > 0.0)
+    {
+        color *= powerHeuristic(scatterPdf, scene.pEnv->pdf(r.direction()));
+    }
+    return color;
+}
+
+// Emission at rec, weighted against the light sampling done at the previous
+// vertex. scatterPdf and prevNormal are as passed to getColor().
+vec3 weightedEmission(const Scene& scene, const ray& r, const HitRecord& rec, float scatterPdf, const vec3& prevNormal)
+{
+    vec3 emitted = rec.pMat->emitted(r, rec);
+    if (emitted.squared_length() == 0.0 || scatterPdf <= 0.0)
+    {
+        return emitted;
+    }
+    return powerHeuristic(scatterPdf, lightPdf(scene, rec.pObj, r.origin(), prevNormal, r.direction())) * emitted;
+}
+
+// Diffuse bounce off rec, picked by the material or, once the path guide is
+// trained, by one-sample MIS between the two. attenuation is the BSDF times
+// the cosine over pdf, the density of scattered.
+bool scatterDiffuse(const Scene& scene, const ray& r, const HitRecord& rec, vec3& attenuation, ray& scattered, float& pdf)
+{
+    if (!rec.pMat->scatter(r, rec, attenuation, scattered))
+    {
+        return false;
+    }
+
+    pdf = rec.pMat->scatterPdf(rec, scattered.direction());
+    if (guiding(scene))
+    {
+        if (getRand() < GUIDE_FRACTION)
+        {
+            scattered = ray(rec.p, scene.pGuide->sample(rec.p));
+        }
+        pdf = scatteringPdf(scene, rec, scattered.direction());
+        attenuation = pdf > 0.0 ? rec.pMat->scatterEval(r, rec, scattered.direction()) / pdf : vec3(0, 0, 0);
+    }
+    return true;
+}
+
+// A diffuse bounce that the caller sampled with scatterDiffuse() and traced
+// ahead of shadeHit(), so that the bounces of many paths can be intersected
+// together. rec.pObj is null if the bounce left the scene or was not traced.
+struct TracedBounce
+{
+    bool scatters;
+    vec3 attenuation;
+    ray scattered;
+    float pdf;
+    HitRecord rec;
+};
+
+// Radiance leaving rec back along r. When pDirectLights is given it replaces
+// next-event estimation toward the scene lights, and emission from those
+// lights reached by the diffuse bounce is left out since it is already in there.
+// When pBounce is given, the diffuse bounce continues it instead of a new one.
+vec3 shadeHit(const ray& r, const HitRecord& rec, const Scene& scene, int depth, float scatterPdf, const vec3& prevNormal,
+              const vec3* pDirectLights = nullptr, const TracedBounce* pBounce = nullptr)
+{
+    vec3 color;
+    vec3 attenuation;
+
+    ray scattered;
+    ray reflected;
+
+    color += weightedEmission(scene, r, rec, scatterPdf, prevNormal);
+
+    // Ray trace diffuse lambertian lighting
+    float pdf;
+    bool scatters;
+    if (pBounce)
+    {
+        scatters = pBounce->scatters;
+        attenuation = pBounce->attenuation;
+        scattered = pBounce->scattered;
+        pdf = pBounce->pdf;
+    }
+    else
+    {
+        scatters = scatterDiffuse(scene, r, rec, attenuation, scattered, pdf);
+    }
+    if (scatters)
+    {
+        const bool cacheable = !pDirectLights && scene.pCache && depth >= scene.pCache->depth;
+        vec3 diffuse;
+
+        if (cacheable && scene.pCache->ready && scene.pCache->lookup(rec.p, rec.normal, rec.pObj, diffuse))
+        {
+            // Smooth indirect light comes from the cache; the path ends here
+            color += diffuse;
+        }
+        else if (!pDirectLights)
+        {
+            diffuse += sampleEnvironment(scene, r, rec);
+            diffuse += sampleLights(scene, r, rec);
+
+            if (attenuation.squared_length() > 0.0)
+            {
+                vec3 incident;
+                if (!pBounce)
+                {
+                    incident = getColor(scattered, scene, depth + 1, pdf, rec.normal);
+                }
+                else if (depth + 1 < N_BOUNCES && pBounce->rec.pObj)
+                {
+                    incident = shadeHit(scattered, pBounce->rec, scene, depth + 1, pdf, rec.normal);
+                }
+                else
+                {
+                    incident = missColor(scattered, scene, pdf);
+                }
+                diffuse += attenuation * incident;
+
+                // Train on the reflected contribution, so the guide learns the
+                // product of incident light and the cosine-weighted BSDF
+                if (scene.pGuide && scene.pGuide->training && pdf > 0.0)
+                {
+                    vec3 reflected = rec.pMat->scatterEval(r, rec, scattered.direction()) * incident;
+                    scene.pGuide->record(rec.p, scattered.direction(), luminance(reflected) / pdf);
+                }
+            }
+
+            if (cacheable && scene.pCache->filling)
+            {
+                scene.pCache->record(rec.p, rec.normal, rec.pObj, diffuse);
+            }
+            color += diffuse;
+        }
+        else
+        {
+            color += sampleEnvironment(scene, r, rec);
+            color += *pDirectLights;
+
+            HitRecord bounceRec;
+            if (depth + 1 >= N_BOUNCES || !scene.world->hit(scattered, 0.001, FLT_MAX, bounceRec))
+            {
+                color += attenuation * missColor(scattered, scene, pdf);
+            }
+            else if (bounceRec.pMat->emission().squared_length() == 0.0)
+            {
+                color += attenuation * shadeHit(scattered, bounceRec, scene, depth + 1, pdf, rec.normal);
+            }
+        }
+    }
+
+    // Ray trace reflected specular lighting
+    if (depth < N_BOUNCES - 1 && rec.pMat->reflect(r, rec, attenuation, reflected))
+    {
+        vec3 F = SchlickApprox(vec3::normalize(rec.normal), vec3::normalize(reflected.direction()), attenuation);
+
+        // float NoL = dot(vec3::normalize(rec.normal), vec3::normalize(reflected.direction()));
+        // F /= 4.0 * NoL * NoL;
+        vec3 refLightColor = getColor(reflected, scene, depth + 1, 0.0, rec.normal);
+
+        color *= (vec3(1, 1, 1) - F); // Factor down diffuse component
+        color += F * refLightColor; // Add specular contribution
+    }
+
+    return color;
+}
+
+// scatterPdf is the density with which a diffuse bounce off a surface with
+// normal prevNormal picked r, or 0 for camera and specular rays, which light
+// sampling can never produce.
+vec3 getColor(const ray& r, const Scene& scene, int depth, float scatterPdf, const vec3& prevNormal)
+{
+    HitRecord rec;
+    if (depth < N_BOUNCES && scene.world->hit(r, 0.001, FLT_MAX, rec))
+    {
+        return shadeHit(r, rec, scene, depth, scatterPdf, prevNormal);
+    }
+    else
+    {
+        return missColor(r, scene, scatterPdf);
+    }
+}
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef POSTPROCESSH
+#define POSTPROCESSH
+
+#include "vec3.h"
+#include "Parallel.h"
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// Entries of the linear to sRGB table, and edge length of the blue noise tile
+#define SRGB_LUT_SIZE 16384
+#define BLUE_NOISE_SIZE 64
+
+enum Tonemap
+{
+    TONEMAP_NONE, // Clip to [0, 1]
+    TONEMAP_REINHARD,
+    TONEMAP_ACES,
+    TONEMAP_FILMIC
+};
+
+// Settings of postProcess(). exposure is in stops.
+struct PostSettings
+{
+    float exposure = 0.0;
+    Tonemap tonemap = TONEMAP_NONE;
+    bool dither = true;
+};
+
+// Parses a tonemap name as given on the command line, false if unknown.
+bool parseTonemap(const string& name, Tonemap& tonemap)
+{
+    if (name == "none")
+    {
+        tonemap = TONEMAP_NONE;
+    }
+    else if (name == "reinhard")
+    {
+        tonemap = TONEMAP_REINHARD;
+    }
+    else if (name == "aces")
+    {
+        tonemap = TONEMAP_ACES;
+    }
+    else if (name == "filmic")
+    {
+        tonemap = TONEMAP_FILMIC;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// sRGB encoding of [0, 1] at SRGB_LUT_SIZE evenly spaced linear values.
+// With linear interpolation between them it is within 4e-6 of the curve.
+const vector<float>& srgbTable()
+{
+    static const vector<float> table = []()
+    {
+        vector<float> t(SRGB_LUT_SIZE + 1);
+        for (int k = 0; k <= SRGB_LUT_SIZE; k++)
+        {
+            double x = double(k) / SRGB_LUT_SIZE;
+            t[k] = float(x <= 0.0031308 ? 12.92 * x : 1.055 * pow(x, 1.0 / 2.4) - 0.055);
+        }
+        // Repeat the last entry so interpolating at 1 stays in bounds
+        t.push_back(t.back());
+        return t;
+    }();
+    return table;
+}
+
+// sRGB encoding of a linear value by srgbTable(), clamped to [0, 1]. NaN
+// encodes as 0, since min() and max() would let it through to the index.
+inline float encodeSRGB(float value)
+{
+    const vector<float>& table = srgbTable();
+    const float index = value > 0.0f ? min(value, 1.0f) * SRGB_LUT_SIZE : 0.0f;
+    const int i = int(index);
+    return table[i] + (index - i) * (table[i + 1] - table[i]);
+}
+
+/**
+ *
+ * Tileable blue noise thresholds in [0, 1), built once by Ulichney's
+ * void-and-cluster method. Every value occurs once, and pixels with close
+ * values lie far apart, so the error dithering adds to an image has no
+ * low frequencies for the eye to see as blotches.
+ *
+ */
+
+const vector<float>& blueNoise()
+{
+    static const vector<float> noise = []()
+    {
+        const int size = BLUE_NOISE_SIZE;
+        const int count = size * size;
+        const float sigma = 1.5;
+
+        // Gaussian weight of every toroidal offset
+        vector<float> kernel(count);
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                int dx = min(x, size - x);
+                int dy = min(y, size - y);
+                kernel[y * size + x] = exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+            }
+        }
+
+        vector<char> on(count, 0);
+        vector<float> energy(count, 0.0);
+        auto toggle = [&](int p, bool set)
+        {
+            on[p] = set;
+            const int px = p % size;
+            const int py = p / size;
+            const float sign = set ? 1.0f : -1.0f;
+            for (int y = 0; y < size; y++)
+            {
+                const float* row = &kernel[((y - py + size) % size) * size];
+                for (int x = 0; x < size; x++)
+                {
+                    energy[y * size + x] += sign * row[(x - px + size) % size];
+                }
+            }
+        };
+        // Tightest cluster is the set pixel with the most energy, largest
+        // void the unset one with the least
+        auto extreme = [&](bool set)
+        {
+            int best = -1;
+            for (int p = 0; p < count; p++)
+            {
+                if (on[p] == set && (best < 0 || (set ? energy[p] > energy[best] : energy[p] < energy[best])))
+                {
+                    best = p;
+                }
+            }
+            return best;
+        };
+
+        // A random tenth of the pixels, spread out evenly by moving the
+        // tightest cluster into the largest void until that changes nothing
+        uint32_t state = 12345;
+        const int initial = count / 10;
+        for (int placed = 0; placed < initial;)
+        {
+            state = state * 1664525u + 1013904223u;
+            int p = int((state >> 8) % count);
+            if (!on[p])
+            {
+                toggle(p, true);
+                placed++;
+            }
+        }
+        while (true)
+        {
+            int cluster = extreme(true);
+            toggle(cluster, false);
+            int gap = extreme(false);
+            toggle(gap, true);
+            if (gap == cluster)
+            {
+                break;
+            }
+        }
+        vector<char> initialPattern = on;
+        vector<float> initialEnergy = energy;
+
+        vector<int> rank(count);
+        // Ranks below the initial pattern's size go to its pixels, tightest
+        // clusters last; the rest to voids in the order they are filled
+        for (int r = initial - 1; r >= 0; r--)
+        {
+            int cluster = extreme(true);
+            toggle(cluster, false);
+            rank[cluster] = r;
+        }
+        on = initialPattern;
+        energy = initialEnergy;
+        for (int r = initial; r < count; r++)
+        {
+            int gap = extreme(false);
+            toggle(gap, true);
+            rank[gap] = r;
+        }
+
+        vector<float> thresholds(count);
+        for (int p = 0; p < count; p++)
+        {
+            thresholds[p] = (rank[p] + 0.5f) / count;
+        }
+        return thresholds;
+    }();
+    return noise;
+}
+
+// Tonemaps values in place, each channel on its own so the loops vectorize.
+void tonemap(float* values, int count, Tonemap op)
+{
+    switch (op)
+    {
+    case TONEMAP_REINHARD:
+        for (int k = 0; k < count; k++)
+        {
+            values[k] = values[k] / (1.0f + values[k]);
+        }
+        break;
+    case TONEMAP_ACES:
+        // Narkowicz's fit of the ACES reference rendering transform
+        for (int k = 0; k < count; k++)
+        {
+            float x = values[k];
+            values[k] = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+        }
+        break;
+    case TONEMAP_FILMIC:
+    {
+        // Hable's Uncharted 2 curve, with its white point at 11.2
+        auto curve = [](float x)
+        {
+            return ((x * (0.15f * x + 0.05f) + 0.004f) / (x * (0.15f * x + 0.5f) + 0.06f)) - 0.0666667f;
+        };
+        const float whiteScale = 1.0f / curve(11.2f);
+        for (int k = 0; k < count; k++)
+        {
+            values[k] = curve(2.0f * values[k]) * whiteScale;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ *
+ * Turns rows [rowStart, rowEnd) of linear colors, row by row from the top,
+ * into interleaved integers of up to maxValue with channels per pixel,
+ * ending in an opaque alpha if there are four, in out. Each row goes
+ * through the stages as a whole: exposure and tonemapping over its floats,
+ * sRGB encoding by table, then blue noise dithered rounding. The dither
+ * pattern is aligned to pixel (0, 0) of colors, so pieces of an image
+ * cut at multiples of BLUE_NOISE_SIZE come out as if processed whole.
+ *
+ */
+
+template <typename T>
+void postProcessRows(const vector<vec3>& colors, int width, int channels, int maxValue, const PostSettings& settings,
+                     int rowStart, int rowEnd, T* out)
+{
+    const vector<float>& noise = blueNoise();
+    const float scale = pow(2.0f, settings.exposure);
+
+    vector<float> row(3 * width);
+    float offsets[3 * BLUE_NOISE_SIZE];
+    T chunk[3 * BLUE_NOISE_SIZE];
+    for (int y = rowStart; y < rowEnd; y++)
+    {
+        const vec3* pColors = &colors[size_t(y) * width];
+        for (int x = 0; x < width; x++)
+        {
+            row[3 * x + 0] = pColors[x].x() * scale;
+            row[3 * x + 1] = pColors[x].y() * scale;
+            row[3 * x + 2] = pColors[x].z() * scale;
+        }
+
+        tonemap(row.data(), 3 * width, settings.tonemap);
+
+        for (int k = 0; k < 3 * width; k++)
+        {
+            row[k] = encodeSRGB(row[k]);
+        }
+
+        // One threshold per pixel, so the noise does not tint it. The
+        // noise row repeats every BLUE_NOISE_SIZE pixels.
+        const float* thresholds = &noise[(y % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE];
+        for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+        {
+            const float offset = settings.dither ? thresholds[x] : 0.5f;
+            offsets[3 * x + 0] = offset;
+            offsets[3 * x + 1] = offset;
+            offsets[3 * x + 2] = offset;
+        }
+
+        T* pixels = out + size_t(y) * width * channels;
+        for (int x0 = 0; x0 < width; x0 += BLUE_NOISE_SIZE)
+        {
+            const int n = 3 * (min(width, x0 + BLUE_NOISE_SIZE) - x0);
+            const float* values = &row[3 * x0];
+            // Thresholds are below 1, so 1 still rounds down to maxValue
+            if (channels == 3)
+            {
+                T* dst = pixels + 3 * x0;
+                for (int k = 0; k < n; k++)
+                {
+                    dst[k] = T(values[k] * maxValue + offsets[k]);
+                }
+                continue;
+            }
+            for (int k = 0; k < n; k++)
+            {
+                chunk[k] = T(values[k] * maxValue + offsets[k]);
+            }
+            T* dst = pixels + 4 * x0;
+            for (int x = 0; x < n / 3; x++)
+            {
+                dst[4 * x + 0] = chunk[3 * x + 0];
+                dst[4 * x + 1] = chunk[3 * x + 1];
+                dst[4 * x + 2] = chunk[3 * x + 2];
+                dst[4 * x + 3] = T(maxValue);
+            }
+        }
+    }
+}
+
+// postProcessRows() over the whole image, with rows split across threads.
+template <typename T>
+vector<T> postProcess(const vector<vec3>& colors, int width, int height, int channels, int maxValue,
+                      const PostSettings& settings)
+{
+    vector<T> out(size_t(width) * height * channels);
+    parallelFor(height, [&](int rowStart, int rowEnd)
+    {
+        postProcessRows(colors, width, channels, maxValue, settings, rowStart, rowEnd, out.data());
+    });
+    return out;
+}
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef RADIANCECACHEH
+#define RADIANCECACHEH
+
+#include "vec3.h"
+#include "Parallel.h"
+#include <atomic>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+
+// Number of hash table slots, a power of two
+#define RADIANCE_CACHE_SIZE (1 << 20)
+// Slots probed past the hashed one before a record is dropped
+#define RADIANCE_CACHE_PROBES 8
+// Cells with fewer estimates than this are never trusted
+#define RADIANCE_CACHE_MIN_SAMPLES 8
+
+/**
+ *
+ * World-space cache of diffusely reflected radiance in a hashed grid. A cell
+ * is keyed by its grid coordinates, a coarse quantization of the surface
+ * normal and the object, so that nearby surfaces facing other ways, or made
+ * of other materials, do not share an estimate. Since the diffuse lobes are
+ * Lambertian, what a surface reflects diffusely does not depend on where it
+ * is seen from and one value per cell suffices.
+ *
+ * The cache is filled by a prepass whose paths record their full estimate
+ * at every diffuse vertex deep enough to be looked up later, and is read
+ * only afterwards. A cell answers a lookup once the standard error of its
+ * mean luminance is within maxError of the mean luminance of all records.
+ * Records alternate between two halves: one only estimates that error, the
+ * other only the returned value. Judging a cell by the same samples it
+ * returns would prefer cells whose few samples happened to agree, e.g. all
+ * unoccluded, and bias the image.
+ *
+ */
+
+class RadianceCache
+{
+public:
+    // Allocates the table only if depth is positive, as a cache that is
+    // off is never filled or read.
+    RadianceCache(float cellSize, float maxError, int depth);
+
+    // Adds one estimate of the radiance diffusely reflected at p.
+    void record(const vec3& p, const vec3& n, const void* pObj, const vec3& radiance);
+    // Cached radiance diffusely reflected near p, if that cell is converged.
+    bool lookup(const vec3& p, const vec3& n, const void* pObj, vec3& radiance) const;
+    // Ends the fill pass and opens the cache for lookups.
+    void finish();
+
+    float cellSize;
+    float maxError;
+    int depth; // Path depth from which diffuse vertices use the cache
+    bool filling;
+    bool ready;
+
+private:
+    struct Entry
+    {
+        atomic<uint64_t> key;
+        atomic<int> count;
+        atomic<float> sum[3]; // Even records
+        atomic<float> sumLuminance; // Odd records
+        atomic<float> sumSquares;
+    };
+
+    uint64_t hashKey(const vec3& p, const vec3& n, const void* pObj) const;
+
+    vector<Entry> entries;
+    float meanLuminance;
+};
+
+RadianceCache::RadianceCache(float cellSize, float maxError, int depth)
+    : cellSize(cellSize), maxError(maxError), depth(depth), filling(false), ready(false),
+      entries(depth > 0 ? RADIANCE_CACHE_SIZE : 0),
+      meanLuminance(0.0)
+{
+    for (Entry& entry : entries)
+    {
+        entry.key = 0;
+        entry.count = 0;
+        entry.sum[0] = entry.sum[1] = entry.sum[2] = 0.0;
+        entry.sumLuminance = 0.0;
+        entry.sumSquares = 0.0;
+    }
+}
+
+uint64_t RadianceCache::hashKey(const vec3& p, const vec3& n, const void* pObj) const
+{
+    uint64_t h = 1469598103934665603ull;
+    auto mix = [&h](uint64_t value)
+    {
+        h ^= value;
+        h *= 1099511628211ull;
+        h ^= h >> 29;
+    };
+
+    for (int i = 0; i < 3; i++)
+    {
+        mix(uint64_t(int64_t(floor(p[i] / cellSize))));
+    }
+    // Five levels per normal component
+    vec3 unitNormal = vec3::normalize(n);
+    for (int i = 0; i < 3; i++)
+    {
+        mix(uint64_t(int64_t(lround(unitNormal[i] * 2.0))));
+    }
+    mix(uint64_t(uintptr_t(pObj)));
+
+    return h == 0 ? 1 : h;
+}
+
+void RadianceCache::record(const vec3& p, const vec3& n, const void* pObj, const vec3& radiance)
+{
+    uint64_t key = hashKey(p, n, pObj);
+    for (int probe = 0; probe < RADIANCE_CACHE_PROBES; probe++)
+    {
+        Entry& entry = entries[(key + probe) & (RADIANCE_CACHE_SIZE - 1)];
+
+        // Claim an empty slot, or find the one this cell already has
+        uint64_t current = 0;
+        if (entry.key.compare_exchange_strong(current, key, memory_order_relaxed) || current == key)
+        {
+            if (entry.count.fetch_add(1, memory_order_relaxed) % 2 == 0)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    atomicAdd(entry.sum[c], radiance[c]);
+                }
+            }
+            else
+            {
+                float lum = luminance(radiance);
+                atomicAdd(entry.sumLuminance, lum);
+                atomicAdd(entry.sumSquares, lum * lum);
+            }
+            return;
+        }
+    }
+}
+
+bool RadianceCache::lookup(const vec3& p, const vec3& n, const void* pObj, vec3& radiance) const
+{
+    // Jitter the lookup within a cell, which blurs the grid's blocky edges
+    // into noise at no extra cost
+    vec3 jittered = p + cellSize * vec3(getRand() - 0.5, getRand() - 0.5, getRand() - 0.5);
+
+    uint64_t key = hashKey(jittered, n, pObj);
+    for (int probe = 0; probe < RADIANCE_CACHE_PROBES; probe++)
+    {
+        const Entry& entry = entries[(key + probe) & (RADIANCE_CACHE_SIZE - 1)];
+        uint64_t current = entry.key.load(memory_order_relaxed);
+        if (current == 0)
+        {
+            return false;
+        }
+        if (current != key)
+        {
+            continue;
+        }
+
+        int count = entry.count.load(memory_order_relaxed);
+        if (count < RADIANCE_CACHE_MIN_SAMPLES)
+        {
+            return false;
+        }
+
+        int oddCount = count / 2;
+        float mean = entry.sumLuminance / oddCount;
+        float variance = max(0.0f, entry.sumSquares / oddCount - mean * mean);
+        if (sqrt(variance / oddCount) > maxError * meanLuminance)
+        {
+            return false;
+        }
+
+        radiance = vec3(entry.sum[0], entry.sum[1], entry.sum[2]) / float(count - oddCount);
+        return true;
+    }
+    return false;
+}
+
+void RadianceCache::finish()
+{
+    double sum = 0.0;
+    long long count = 0;
+    for (const Entry& entry : entries)
+    {
+        sum += entry.sumLuminance;
+        count += entry.count / 2;
+    }
+    meanLuminance = count > 0 ? float(sum / count) : 0.0;
+
+    filling = false;
+    ready = true;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef RANDOMH
+#define RANDOMH
+
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ *
+ * PCG32 generator (O'Neill 2014): 64 bits of state plus a stream selector,
+ * so generators seeded alike but on different streams are independent.
+ *
+ */
+
+class RNG
+{
+public:
+    RNG(uint64_t seed = 0, uint64_t stream = 1) { setSeed(seed, stream); }
+
+    void setSeed(uint64_t seed, uint64_t stream = 1)
+    {
+        state = 0;
+        increment = (stream << 1) | 1;
+        nextUInt();
+        state += seed;
+        nextUInt();
+    }
+
+    uint32_t nextUInt()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + increment;
+        uint32_t xorShifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rotation = uint32_t(old >> 59);
+        return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+    }
+
+    // Uniform in [0, 1).
+    double nextDouble()
+    {
+        return nextUInt() * (1.0 / 4294967296.0);
+    }
+
+    uint64_t state;
+    uint64_t increment;
+};
+
+// Anything that can take over getRand() on a thread, e.g. to replay or
+// perturb the random numbers a path consumes.
+class RandomSource
+{
+public:
+    virtual ~RandomSource() {}
+    virtual double next() = 0;
+};
+
+// Every thread gets its own generator on its own stream, so sampling never
+// contends on shared state the way random() does.
+atomic<uint64_t> nextRandomStream(0);
+thread_local RNG threadRNG(0, nextRandomStream++);
+thread_local RandomSource* pRandomSource = nullptr;
+
+double getRand()
+{
+    return pRandomSource ? pRandomSource->next() : threadRNG.nextDouble();
+}
+
+#endif
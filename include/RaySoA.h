@@ -0,0 +1,88 @@
+#ifndef RAYSOAH
+#define RAYSOAH
+
+#include "ray.h"
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// Lanes of a block of rays traced together by hitBatch()
+#define PACKET_SIZE 8
+
+/**
+ *
+ * Up to PACKET_SIZE unrelated rays, each with its own origin, stored one
+ * array per component so that Hitable::hitBatch() can test all lanes of a
+ * block at once. finish() bounds the block with a ball around the origins
+ * and a cone around the directions, which lets a primitive outside them
+ * skip the whole block with one test.
+ *
+ */
+
+struct RaySoA
+{
+    void setRay(int lane, const ray& r);
+    void finish();
+    ray getRay(int lane) const { return ray(vec3(ox[lane], oy[lane], oz[lane]), vec3(dx[lane], dy[lane], dz[lane])); }
+
+    float ox[PACKET_SIZE];
+    float oy[PACKET_SIZE];
+    float oz[PACKET_SIZE];
+    float dx[PACKET_SIZE];
+    float dy[PACKET_SIZE];
+    float dz[PACKET_SIZE];
+    int count = 0;
+
+    // Bounding ball of the origins, cone of the directions, and the
+    // longest direction
+    vec3 origin;
+    float originRadius;
+    vec3 axis;
+    float cosSpread;
+    float sinSpread;
+    float maxLength;
+};
+
+void RaySoA::setRay(int lane, const ray& r)
+{
+    ox[lane] = r.origin().x();
+    oy[lane] = r.origin().y();
+    oz[lane] = r.origin().z();
+    dx[lane] = r.direction().x();
+    dy[lane] = r.direction().y();
+    dz[lane] = r.direction().z();
+    count = max(count, lane + 1);
+}
+
+void RaySoA::finish()
+{
+    vec3 sumOrigins;
+    vec3 sumDirections;
+    maxLength = 0.0;
+    for (int lane = 0; lane < count; lane++)
+    {
+        vec3 d(dx[lane], dy[lane], dz[lane]);
+        float length = d.length();
+        sumOrigins += vec3(ox[lane], oy[lane], oz[lane]);
+        sumDirections += d / length;
+        maxLength = max(maxLength, length);
+    }
+    origin = sumOrigins / float(count);
+    axis = vec3::normalize(sumDirections);
+
+    originRadius = 0.0;
+    cosSpread = 1.0;
+    for (int lane = 0; lane < count; lane++)
+    {
+        vec3 d(dx[lane], dy[lane], dz[lane]);
+        originRadius = max(originRadius, (vec3(ox[lane], oy[lane], oz[lane]) - origin).length());
+        cosSpread = min(cosSpread, dot(axis, d) / d.length());
+    }
+    // Widen a little so rounding cannot cull a primitive a ray grazes
+    originRadius = originRadius * 1.0001f + 1e-6f;
+    cosSpread = max(-1.0f, cosSpread - 1e-5f);
+    sinSpread = sqrt(max(0.0f, 1.0f - cosSpread * cosSpread));
+}
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef RESTIRH
+#define RESTIRH
+
+#include "Config.h"
+#include "Camera.h"
+#include "PathTracer.h"
+#include "Parallel.h"
+#include <vector>
+#include <cfloat>
+
+using namespace std;
+
+// Light samples drawn per pixel and frame before any reuse
+#define RESTIR_CANDIDATES 32
+// Neighbors merged during spatial reuse, and the pixel radius they come from
+#define RESTIR_NEIGHBORS 5
+#define RESTIR_RADIUS 30
+// Cap on the history carried by temporal reuse, relative to a fresh reservoir
+#define RESTIR_MAX_HISTORY 4
+
+/**
+ *
+ * Reservoir-based spatiotemporal importance resampling (Bitterli et al. 2020)
+ * of direct lighting from the scene lights at primary hits. Every frame each
+ * pixel resamples a few dozen light candidates down to one, merges it with
+ * its own reservoir from the previous frame and with those of nearby pixels,
+ * and then shades with a single shadow ray. Neighbors with too different a
+ * normal or depth are rejected, and merged reservoirs are normalized only by
+ * the candidates whose surface could have produced the selected sample. Since
+ * visibility is not part of that test the result is slightly biased near
+ * shadow boundaries, which is fine for previews.
+ *
+ */
+
+// A point on an emitter, stored so it can be re-evaluated from other pixels.
+struct LightSample
+{
+    LightSample() : pLight(nullptr) {}
+
+    const Hitable* pLight;
+    vec3 x;
+    vec3 n;
+    vec3 Le;
+};
+
+struct Reservoir
+{
+    Reservoir() : wSum(0.0), M(0.0), W(0.0) {}
+
+    bool update(const LightSample& sample, float w, float count = 1.0)
+    {
+        wSum += w;
+        M += count;
+        if (w > 0.0 && getRand() * wSum <= w)
+        {
+            y = sample;
+            return true;
+        }
+        return false;
+    }
+
+    LightSample y;
+    float wSum;
+    float M;
+    float W;
+};
+
+struct PrimaryHit
+{
+    ray r;
+    HitRecord rec;
+    bool hit;
+    bool diffuse;
+};
+
+// Unshadowed contribution of sample to the diffuse lobe at hit; the target
+// function resampling is proportional to.
+vec3 unshadowedContribution(const PrimaryHit& hit, const LightSample& sample)
+{
+    vec3 toLight = sample.x - hit.rec.p;
+    float distSquared = toLight.squared_length();
+    if (!sample.pLight || distSquared <= 0.0)
+    {
+        return vec3(0, 0, 0);
+    }
+
+    vec3 wi = toLight / sqrt(distSquared);
+    float cosLight = -dot(wi, sample.n);
+    if (cosLight <= 0.0)
+    {
+        return vec3(0, 0, 0);
+    }
+
+    return hit.rec.pMat->scatterEval(hit.r, hit.rec, wi) * sample.Le * (cosLight / distSquared);
+}
+
+float targetPdf(const PrimaryHit& hit, const LightSample& sample)
+{
+    return luminance(unshadowedContribution(hit, sample));
+}
+
+// Draws a point on a light, with its density with respect to surface area.
+bool sampleLightPoint(const Scene& scene, const HitRecord& rec, LightSample& sample, float& pdfArea)
+{
+    float pmf;
+    const Hitable* pLight = pickLight(scene, rec.p, rec.normal, pmf);
+    if (!pLight)
+    {
+        return false;
+    }
+
+    vec3 direction = pLight->random(rec.p);
+    HitRecord lightRec;
+    if (!pLight->hit(ray(rec.p, direction), 0.001, FLT_MAX, lightRec))
+    {
+        return false;
+    }
+
+    vec3 toLight = lightRec.p - rec.p;
+    float distSquared = toLight.squared_length();
+    float cosLight = fabs(dot(vec3::normalize(toLight), lightRec.normal));
+    pdfArea = pmf * pLight->pdfValue(rec.p, direction) * cosLight / distSquared;
+
+    sample.pLight = pLight;
+    sample.x = lightRec.p;
+    sample.n = lightRec.normal;
+    sample.Le = lightRec.pMat->emission();
+
+    return pdfArea > 0.0;
+}
+
+// Z is the number of candidates that could have produced the selected sample.
+void finalizeReservoir(const PrimaryHit& hit, Reservoir& reservoir, float Z)
+{
+    float p = Z > 0.0 ? targetPdf(hit, reservoir.y) : 0.0;
+    reservoir.W = p > 0.0 ? reservoir.wSum / (Z * p) : 0.0;
+}
+
+// Merges reservoir other, gathered at a different hit, into reservoir and
+// returns the (clamped) candidate count it stands for.
+float mergeReservoir(const PrimaryHit& hit, Reservoir& reservoir, const Reservoir& other, float maxM)
+{
+    float M = min(other.M, maxM);
+    reservoir.update(other.y, targetPdf(hit, other.y) * other.W * M, M);
+    return M;
+}
+
+bool similarSurfaces(const PrimaryHit& a, const PrimaryHit& b)
+{
+    return b.hit && b.diffuse &&
+           dot(a.rec.normal, b.rec.normal) > 0.9 &&
+           fabs(a.rec.t - b.rec.t) < 0.1 * a.rec.t;
+}
+
+// Renders frames passes of one sample per pixel with reservoir reuse and
+// returns the average of all frames as linear colors, in processPixels order.
+vector<vec3> renderReSTIR(Camera* cam, const Scene* scene, int frames)
+{
+    const int numPixels = N_X * N_Y;
+    vector<PrimaryHit> hits(numPixels);
+    vector<PrimaryHit> prevHits(numPixels);
+    vector<Reservoir> reservoirs(numPixels);
+    vector<Reservoir> spatial(numPixels);
+    vector<Reservoir> prevReservoirs(numPixels);
+    vector<float> historyMs(numPixels); // Part of each reservoir's M merged from last frame
+    vector<vec3> accumulated(numPixels);
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        // Primary hits and initial candidates, merged with last frame's reservoir
+        parallelFor(numPixels, [&](int start, int end)
+        {
+            for (int iter = start; iter < end; iter++)
+            {
+                const int i = iter % N_X;
+                const int j = N_Y - iter / N_X - 1;
+
+                PrimaryHit& hit = hits[iter];
+                float u = float(i + getRand()) / float(N_X);
+                float v = float(j + getRand()) / float(N_Y);
+                hit.r = cam->getRay(u, v);
+                hit.hit = scene->world->hit(hit.r, 0.001, FLT_MAX, hit.rec);
+                hit.diffuse = hit.hit && hit.rec.pMat->scatterPdf(hit.rec, hit.rec.normal) > 0.0;
+
+                Reservoir reservoir;
+                historyMs[iter] = 0.0;
+                if (hit.diffuse)
+                {
+                    for (int k = 0; k < RESTIR_CANDIDATES; k++)
+                    {
+                        LightSample sample;
+                        float pdfArea;
+                        if (sampleLightPoint(*scene, hit.rec, sample, pdfArea))
+                        {
+                            reservoir.update(sample, targetPdf(hit, sample) / pdfArea);
+                        }
+                        else
+                        {
+                            reservoir.M += 1.0;
+                        }
+                    }
+                    finalizeReservoir(hit, reservoir, reservoir.M);
+
+                    if (frame > 0 && similarSurfaces(hit, prevHits[iter]))
+                    {
+                        // Only count history that could have produced the selected sample,
+                        // so lights behind the previous surface do not darken the estimate
+                        float currentM = reservoir.M;
+                        float historyM = mergeReservoir(hit, reservoir, prevReservoirs[iter], RESTIR_MAX_HISTORY * currentM);
+                        historyMs[iter] = historyM;
+                        float Z = currentM + (targetPdf(prevHits[iter], reservoir.y) > 0.0 ? historyM : 0.0);
+                        finalizeReservoir(hit, reservoir, Z);
+                    }
+                }
+                reservoirs[iter] = reservoir;
+            }
+        });
+
+        // Spatial reuse from random nearby pixels
+        parallelFor(numPixels, [&](int start, int end)
+        {
+            for (int iter = start; iter < end; iter++)
+            {
+                const PrimaryHit& hit = hits[iter];
+                Reservoir reservoir = reservoirs[iter];
+                if (hit.diffuse)
+                {
+                    const int i = iter % N_X;
+                    const int row = iter / N_X;
+                    int merged[RESTIR_NEIGHBORS];
+                    float mergedM[RESTIR_NEIGHBORS];
+                    int numMerged = 0;
+                    for (int k = 0; k < RESTIR_NEIGHBORS; k++)
+                    {
+                        float radius = RESTIR_RADIUS * sqrt(getRand());
+                        float angle = 2.0 * M_PI * getRand();
+                        int ni = i + int(radius * cos(angle));
+                        int nrow = row + int(radius * sin(angle));
+                        int neighbor = nrow * N_X + ni;
+                        if (ni < 0 || ni >= N_X || nrow < 0 || nrow >= N_Y || neighbor == iter)
+                        {
+                            continue;
+                        }
+                        if (similarSurfaces(hit, hits[neighbor]))
+                        {
+                            merged[numMerged] = neighbor;
+                            mergedM[numMerged] = mergeReservoir(hit, reservoir, reservoirs[neighbor], FLT_MAX);
+                            numMerged++;
+                        }
+                    }
+
+                    // The pixel's own history counts under the same test as in
+                    // the temporal pass, now against the sample chosen here
+                    float Z = reservoirs[iter].M - historyMs[iter];
+                    if (historyMs[iter] > 0.0 && targetPdf(prevHits[iter], reservoir.y) > 0.0)
+                    {
+                        Z += historyMs[iter];
+                    }
+                    for (int k = 0; k < numMerged; k++)
+                    {
+                        if (targetPdf(hits[merged[k]], reservoir.y) > 0.0)
+                        {
+                            Z += mergedM[k];
+                        }
+                    }
+                    finalizeReservoir(hit, reservoir, Z);
+                }
+                spatial[iter] = reservoir;
+            }
+        });
+
+        // Shade with one shadow ray for the chosen sample, then trace the rest of the path
+        parallelFor(numPixels, [&](int start, int end)
+        {
+            for (int iter = start; iter < end; iter++)
+            {
+                const PrimaryHit& hit = hits[iter];
+                const Reservoir& reservoir = spatial[iter];
+                if (!hit.hit)
+                {
+                    accumulated[iter] += missColor(hit.r, *scene, 0.0);
+                    continue;
+                }
+
+                vec3 direct;
+                if (hit.diffuse && reservoir.W > 0.0)
+                {
+                    HitRecord lightRec;
+                    ray shadow(hit.rec.p, reservoir.y.x - hit.rec.p);
+                    if (scene->world->hit(shadow, 0.001, FLT_MAX, lightRec) && lightRec.pObj == reservoir.y.pLight)
+                    {
+                        direct = unshadowedContribution(hit, reservoir.y) * reservoir.W;
+                    }
+                }
+
+                accumulated[iter] += shadeHit(hit.r, hit.rec, *scene, 0, 0.0, vec3(), &direct);
+            }
+        });
+
+        swap(hits, prevHits);
+        swap(spatial, prevReservoirs);
+    }
+
+    for (vec3& color : accumulated)
+    {
+        color /= float(frames);
+    }
+    return accumulated;
+}
+
+#endif
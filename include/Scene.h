@@ -0,0 +1,213 @@
+#ifndef SCENEH
+#define SCENEH
+
+#include "Hitable.h"
+#include "Material.h"
+#include "EnvironmentMap.h"
+#include "LightBVH.h"
+#include "PathGuide.h"
+#include "RadianceCache.h"
+#include <vector>
+#include <cfloat>
+
+using namespace std;
+
+/**
+ *
+ * Everything the integrator needs to know about what it is rendering: the
+ * hitable world, the subset of objects with emissive materials that are
+ * sampled explicitly for direct lighting, and an optional environment map
+ * replacing the default sky gradient. With a LightBVH, lights are picked in
+ * proportion to their estimated contribution instead of uniformly, and a
+ * trained PathGuide steers diffuse bounces toward incident light. A filled
+ * RadianceCache ends paths at their first diffuse vertices past its depth.
+ *
+ */
+
+struct Scene
+{
+    Scene() : world(nullptr), pEnv(nullptr), pLightBVH(nullptr), pGuide(nullptr), pCache(nullptr), sky(true) {}
+
+    Hitable* world;
+    vector<Hitable*> lights;
+    EnvironmentMap* pEnv;
+    LightBVH* pLightBVH;
+    PathGuide* pGuide;
+    RadianceCache* pCache;
+    bool sky;
+};
+
+// Radiance arriving from infinitely far away along direction.
+vec3 background(const Scene& scene, const vec3& direction)
+{
+    if (scene.pEnv)
+    {
+        return scene.pEnv->radiance(direction);
+    }
+    if (!scene.sky)
+    {
+        return vec3(0, 0, 0);
+    }
+
+    // Sky background
+    vec3 unitDirection = vec3::normalize(direction);
+    float t = 0.5 * (unitDirection.y() + 1.0);
+    // t = t * t;
+
+    vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
+    // if (depth != 0) color *= 2.0;
+    // color *= 1.25;
+    return color;
+}
+
+inline float powerHeuristic(float pdfA, float pdfB)
+{
+    float a = pdfA * pdfA;
+    float b = pdfB * pdfB;
+    return a + b > 0.0 ? a / (a + b) : 0.0;
+}
+
+inline bool guiding(const Scene& scene)
+{
+    return scene.pGuide && scene.pGuide->ready;
+}
+
+// Density of a diffuse bounce off rec picking direction: the material's own,
+// or its one-sample mixture with the path guide once that is trained.
+float scatteringPdf(const Scene& scene, const HitRecord& rec, const vec3& direction)
+{
+    float pdf = rec.pMat->scatterPdf(rec, direction);
+    if (guiding(scene))
+    {
+        pdf = GUIDE_FRACTION * scene.pGuide->pdf(rec.p, direction) + (1.0 - GUIDE_FRACTION) * pdf;
+    }
+    return pdf;
+}
+
+// Picks the light to connect point p with normal n to, and its probability.
+const Hitable* pickLight(const Scene& scene, const vec3& p, const vec3& n, float& pmf)
+{
+    if (scene.pLightBVH)
+    {
+        return scene.pLightBVH->sample(p, n, getRand(), pmf);
+    }
+
+    if (scene.lights.empty())
+    {
+        return nullptr;
+    }
+
+    int index = min(int(getRand() * scene.lights.size()), int(scene.lights.size()) - 1);
+    pmf = 1.0 / float(scene.lights.size());
+    return scene.lights[index];
+}
+
+// Density of sampleLights() at point o with normal n choosing direction v toward pLight.
+float lightPdf(const Scene& scene, const Hitable* pLight, const vec3& o, const vec3& n, const vec3& v)
+{
+    if (scene.lights.empty())
+    {
+        return 0.0;
+    }
+
+    float pmf = scene.pLightBVH ? scene.pLightBVH->pmf(pLight, o, n) : 1.0 / float(scene.lights.size());
+    return pmf > 0.0 ? pmf * pLight->pdfValue(o, v) : 0.0;
+}
+
+/**
+ *
+ * Next-event estimation sample: the shadow ray from a diffuse vertex toward
+ * a light or the environment, and what it brings per unit of emitted
+ * radiance if nothing is in the way, already weighted against BSDF sampling
+ * with the power heuristic. pLight is null for the environment, whose
+ * radiance is then included in weight.
+ *
+ */
+
+struct LightConnection
+{
+    ray shadow;
+    const Hitable* pLight;
+    vec3 weight;
+};
+
+// Connects the diffuse vertex rec to one light. False if the sample cannot contribute.
+bool connectToLight(const Scene& scene, const ray& rayIn, const HitRecord& rec, LightConnection& connection)
+{
+    float pmf;
+    const Hitable* pLight = pickLight(scene, rec.p, rec.normal, pmf);
+    if (!pLight)
+    {
+        return false;
+    }
+
+    vec3 direction = pLight->random(rec.p);
+    float pdfLight = pmf * pLight->pdfValue(rec.p, direction);
+    float pdfScatter = scatteringPdf(scene, rec, direction);
+    if (pdfLight <= 0.0 || pdfScatter <= 0.0)
+    {
+        return false;
+    }
+
+    connection.shadow = ray(rec.p, direction);
+    connection.pLight = pLight;
+    connection.weight = rec.pMat->scatterEval(rayIn, rec, direction) * (powerHeuristic(pdfLight, pdfScatter) / pdfLight);
+    return true;
+}
+
+// Connects the diffuse vertex rec to the environment map, if there is one.
+bool connectToEnvironment(const Scene& scene, const ray& rayIn, const HitRecord& rec, LightConnection& connection)
+{
+    if (!scene.pEnv)
+    {
+        return false;
+    }
+
+    float pdfEnv;
+    vec3 direction = scene.pEnv->sample(pdfEnv);
+    float pdfScatter = scatteringPdf(scene, rec, direction);
+    if (pdfEnv <= 0.0 || pdfScatter <= 0.0)
+    {
+        return false;
+    }
+
+    vec3 Le = scene.pEnv->radiance(direction);
+    connection.shadow = ray(rec.p, direction);
+    connection.pLight = nullptr;
+    connection.weight = rec.pMat->scatterEval(rayIn, rec, direction) * Le * (powerHeuristic(pdfEnv, pdfScatter) / pdfEnv);
+    return true;
+}
+
+// Occlusion test: the radiance a connection delivers if it reaches its
+// light, or for the environment, leaves the scene.
+vec3 traceConnection(const Scene& scene, const LightConnection& connection)
+{
+    HitRecord lightRec;
+    bool blocked = scene.world->hit(connection.shadow, 0.001, FLT_MAX, lightRec);
+    if (!connection.pLight)
+    {
+        return blocked ? vec3(0, 0, 0) : connection.weight;
+    }
+    if (!blocked || lightRec.pObj != connection.pLight)
+    {
+        return vec3(0, 0, 0);
+    }
+    return connection.weight * lightRec.pMat->emitted(connection.shadow, lightRec);
+}
+
+// Next-event estimation: connects the diffuse vertex rec to one light,
+// weighted against BSDF sampling with the power heuristic.
+vec3 sampleLights(const Scene& scene, const ray& rayIn, const HitRecord& rec)
+{
+    LightConnection connection;
+    return connectToLight(scene, rayIn, rec, connection) ? traceConnection(scene, connection) : vec3(0, 0, 0);
+}
+
+// Next-event estimation toward the environment map, if there is one.
+vec3 sampleEnvironment(const Scene& scene, const ray& rayIn, const HitRecord& rec)
+{
+    LightConnection connection;
+    return connectToEnvironment(scene, rayIn, rec, connection) ? traceConnection(scene, connection) : vec3(0, 0, 0);
+}
+
+#endif
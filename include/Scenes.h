@@ -0,0 +1,107 @@
+#ifndef SCENESH
+#define SCENESH
+
+#include "Sphere.h"
+#include "Material.h"
+#include <vector>
+
+using namespace std;
+
+// Built-in test scenes. Each fills list with every object to render and
+// lights with the emissive ones among them.
+
+void buildDefaultScene(vector<Hitable*>& list, vector<Hitable*>& lights)
+{
+    list.push_back(new Sphere(vec3(0, 0, -1), 0.5, new Lambertian(vec3(1.0, 0.25, 0.25))));
+    list.push_back(new Sphere(vec3(0, -2500.5, -1), 2500, new Lambertian(vec3(0.8 , 0.8, 0))));
+    // list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new Lambertian(vec3(1.0, 0.7, 0.2))));
+    // list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new Lambertian(vec3(0, 0, 0.8))));
+    // list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new Metal(vec3(0.8, 0.6, 0.2), 0.0)));
+    // list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new Metal(vec3(0.8, 0.8, 0.8), 0.25)));
+    list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.6, 0.2), 0.0, 0)));
+    list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.8, 0.8), 0.0, 0)));
+
+    Sphere* pLight = new Sphere(vec3(0, 1.5, -1.5), 0.25, new Emissive(vec3(10.0, 10.0, 10.0)));
+    list.push_back(pLight);
+    lights.push_back(pLight);
+}
+
+// The default spheres in front of a wall, with no sky and a small light
+// hidden behind them, so nearly all of the visible light has bounced off the
+// wall first. Hard for independent paths, which rarely find the lit patch.
+void buildOccludedScene(vector<Hitable*>& list, vector<Hitable*>& lights)
+{
+    list.push_back(new Sphere(vec3(0, 0, -1), 0.5, new Lambertian(vec3(1.0, 0.25, 0.25))));
+    list.push_back(new Sphere(vec3(0, -2500.5, -1), 2500, new Lambertian(vec3(0.8, 0.8, 0.8))));
+    list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.6, 0.2), 0.0, 0)));
+    list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.8, 0.8), 0.0, 0)));
+    list.push_back(new Sphere(vec3(0, 0, -2504), 2500, new Lambertian(vec3(0.8, 0.8, 0.8))));
+
+    Sphere* pLight = new Sphere(vec3(0, 0.1, -1.9), 0.05, new Emissive(vec3(400.0, 400.0, 400.0)));
+    list.push_back(pLight);
+    lights.push_back(pLight);
+}
+
+// The default scene inside a cloud of small spheres, to test scenes whose
+// geometry does not fit in cache. The spheres share a few materials so that
+// nearly all of the memory is geometry.
+void buildLargeScene(vector<Hitable*>& list, vector<Hitable*>& lights, int numSpheres)
+{
+    buildDefaultScene(list, lights);
+
+    vector<Material*> palette;
+    for (int k = 0; k < 8; k++)
+    {
+        palette.push_back(new Lambertian(vec3(0.2 + 0.7 * getRand(), 0.2 + 0.7 * getRand(), 0.2 + 0.7 * getRand())));
+    }
+    palette.push_back(new CookTorrance(vec3(0.9, 0.9, 0.9), 0.0, 1));
+
+    for (int added = 0; added < numSpheres;)
+    {
+        vec3 center(-20.0 + 40.0 * getRand(), -0.45 + 6.0 * getRand(), -40.0 + 38.5 * getRand());
+
+        // Keep clear of the default spheres and the light above them
+        if ((center - vec3(0, 0, -1)).length() < 0.6 ||
+            (center - vec3(1, 0, -1)).length() < 0.6 ||
+            (center - vec3(-1, 0, -1)).length() < 0.6 ||
+            (center - vec3(0, 1.5, -1.5)).length() < 0.35)
+        {
+            continue;
+        }
+
+        float radius = 0.01 + 0.03 * getRand();
+        list.push_back(new Sphere(center, radius, palette[min(int(getRand() * palette.size()), int(palette.size()) - 1)]));
+        added++;
+    }
+}
+
+// The default spheres under a field of small colored lights and no sky, as a
+// stress test for light selection.
+void buildManyLightsScene(vector<Hitable*>& list, vector<Hitable*>& lights, int numLights)
+{
+    list.push_back(new Sphere(vec3(0, 0, -1), 0.5, new Lambertian(vec3(1.0, 0.25, 0.25))));
+    list.push_back(new Sphere(vec3(0, -2500.5, -1), 2500, new Lambertian(vec3(0.8 , 0.8, 0.8))));
+    list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.6, 0.2), 0.5, 0)));
+    list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.8, 0.8), 0.0, 0)));
+
+    while (int(lights.size()) < numLights)
+    {
+        vec3 center(-6.0 + 12.0 * getRand(), 0.75 + 2.0 * getRand(), -8.0 + 7.5 * getRand());
+
+        // Keep clear of the large spheres
+        if ((center - vec3(0, 0, -1)).length() < 0.6 ||
+            (center - vec3(1, 0, -1)).length() < 0.6 ||
+            (center - vec3(-1, 0, -1)).length() < 0.6)
+        {
+            continue;
+        }
+
+        float radius = 0.005 + 0.02 * getRand();
+        vec3 color(0.2 + 0.8 * getRand(), 0.2 + 0.8 * getRand(), 0.2 + 0.8 * getRand());
+        Sphere* pLight = new Sphere(center, radius, new Emissive(20.0 * color));
+        list.push_back(pLight);
+        lights.push_back(pLight);
+    }
+}
+
+#endif
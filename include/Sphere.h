@@ -3,6 +3,8 @@
 
 #include "Hitable.h"
 #include "Material.h"
+#include "LightBounds.h"
+#include <cfloat>
 
 class Sphere : public Hitable
 {
@@ -10,6 +12,13 @@ public:
     Sphere() : pMat(NULL) {}
     Sphere(vec3 center, float r, Material* pMatIn) : center(center), radius(r), pMat(pMatIn) {}
     virtual bool hit(const ray& r, float tMin, float tMax, HitRecord& rec) const;
+    virtual void hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const;
+    virtual bool boundingBox(vec3& lo, vec3& hi) const;
+    virtual float pdfValue(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const;
+    virtual float area() const;
+    virtual bool randomPoint(HitRecord& rec) const;
+    virtual bool lightBounds(LightBounds& bounds) const;
     vec3 center;
     float radius;
     Material* pMat;
@@ -34,6 +43,7 @@ bool Sphere::hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
             rec.p = r.pointAtParameter(rec.t);
             rec.normal = (rec.p - center) / radius;
             rec.pMat = pMat;
+            rec.pObj = this;
             return true;
         }
 
@@ -44,10 +54,170 @@ bool Sphere::hit(const ray& r, float tMin, float tMax, HitRecord& rec) const
             rec.p = r.pointAtParameter(rec.t);
             rec.normal = (rec.p - center) / radius;
             rec.pMat = pMat;
+            rec.pObj = this;
             return true;
         }
     }
     return false;
 }
 
+void Sphere::hitBatch(const RaySoA* rays, HitSoA* hits, int count, float tMin) const
+{
+    const float radiusSquared = radius * radius;
+    for (int block = 0; block < count; block++)
+    {
+        const RaySoA& batch = rays[block];
+        HitSoA& batchHits = hits[block];
+
+        // Unless the block starts inside, skip it when the sphere, grown by
+        // the spread of the origins, is outside its cone of directions or
+        // farther than every lane's closest hit
+        vec3 toCenter = center - batch.origin;
+        float distance = toCenter.length();
+        float reach = radius + batch.originRadius;
+        if (distance > reach)
+        {
+            float sinRadius = reach / distance;
+            float cosRadius = sqrt(1.0 - sinRadius * sinRadius);
+            float cosCenter = dot(batch.axis, toCenter) / distance;
+            if (batch.cosSpread > 0.0 && cosCenter < batch.cosSpread * cosRadius - batch.sinSpread * sinRadius)
+            {
+                continue;
+            }
+
+            float tFarthest = 0.0;
+            for (int lane = 0; lane < batch.count; lane++)
+            {
+                tFarthest = max(tFarthest, batchHits.t[lane]);
+            }
+            if ((distance - reach) / batch.maxLength >= tFarthest)
+            {
+                continue;
+            }
+        }
+
+        // Same test as hit(), over all lanes of the block at once
+        float tHit[PACKET_SIZE];
+        for (int lane = 0; lane < batch.count; lane++)
+        {
+            float ocx = batch.ox[lane] - center.x();
+            float ocy = batch.oy[lane] - center.y();
+            float ocz = batch.oz[lane] - center.z();
+            float a = batch.dx[lane] * batch.dx[lane] + batch.dy[lane] * batch.dy[lane] + batch.dz[lane] * batch.dz[lane];
+            float b = 2.0f * (ocx * batch.dx[lane] + ocy * batch.dy[lane] + ocz * batch.dz[lane]);
+            float c = ocx * ocx + ocy * ocy + ocz * ocz - radiusSquared;
+            float discriminant = b * b - 4.0f * a * c;
+            float root = sqrt(max(discriminant, 0.0f));
+            float tNear = (-b - root) / (2.0f * a);
+            float tFar = (-b + root) / (2.0f * a);
+            float tMax = batchHits.t[lane];
+
+            float t = tMin < tFar && tFar < tMax ? tFar : tMax;
+            t = tMin < tNear && tNear < tMax ? tNear : t;
+            tHit[lane] = discriminant > 0.0f ? t : tMax;
+        }
+
+        for (int lane = 0; lane < batch.count; lane++)
+        {
+            if (tHit[lane] < batchHits.t[lane])
+            {
+                HitRecord& rec = batchHits.recs[lane];
+                batchHits.t[lane] = tHit[lane];
+                rec.t = tHit[lane];
+                rec.p = batch.getRay(lane).pointAtParameter(rec.t);
+                rec.normal = (rec.p - center) / radius;
+                rec.pMat = pMat;
+                rec.pObj = this;
+            }
+        }
+    }
+}
+
+bool Sphere::boundingBox(vec3& lo, vec3& hi) const
+{
+    vec3 extent(radius, radius, radius);
+    lo = center - extent;
+    hi = center + extent;
+    return true;
+}
+
+// 1 - cos(thetaMax) of the cone subtended by a sphere, given sin^2(thetaMax).
+// Written so it does not round to zero for small, distant spheres.
+inline float coneSolidAngleFactor(float sinSquared)
+{
+    return sinSquared / (1.0 + sqrt(1.0 - sinSquared));
+}
+
+// Directions toward the sphere are sampled uniformly inside the cone it
+// subtends from o, so the density is constant over that solid angle.
+float Sphere::pdfValue(const vec3& o, const vec3& v) const
+{
+    HitRecord rec;
+    if (!hit(ray(o, v), 0.001, FLT_MAX, rec))
+    {
+        return 0.0;
+    }
+
+    float distSquared = (center - o).squared_length();
+    if (distSquared <= radius * radius)
+    {
+        return 1.0 / (4.0 * M_PI);
+    }
+
+    return 1.0 / (2.0 * M_PI * coneSolidAngleFactor(radius * radius / distSquared));
+}
+
+vec3 Sphere::random(const vec3& o) const
+{
+    vec3 direction = center - o;
+    float distSquared = direction.squared_length();
+    if (distSquared <= radius * radius)
+    {
+        return vec3::randomUnitVector();
+    }
+
+    float z = 1.0 - getRand() * coneSolidAngleFactor(radius * radius / distSquared);
+    float phi = 2.0 * M_PI * getRand();
+    float s = sqrt(max(0.0f, 1.0f - z * z));
+
+    vec3 w = direction / sqrt(distSquared);
+    vec3 u;
+    vec3 v;
+    vec3::orthonormalBasis(w, u, v);
+
+    return (s * cos(phi)) * u + (s * sin(phi)) * v + z * w;
+}
+
+float Sphere::area() const
+{
+    return 4.0 * M_PI * radius * radius;
+}
+
+bool Sphere::randomPoint(HitRecord& rec) const
+{
+    rec.normal = vec3::randomUnitVector();
+    rec.p = center + radius * rec.normal;
+    rec.t = 0.0;
+    rec.pMat = pMat;
+    rec.pObj = this;
+    return true;
+}
+
+bool Sphere::lightBounds(LightBounds& bounds) const
+{
+    vec3 extent(radius, radius, radius);
+    bounds.lo = center - extent;
+    bounds.hi = center + extent;
+
+    // Normals point in every direction, each emitting over its hemisphere
+    bounds.axis = vec3(0, 1, 0);
+    bounds.cosThetaO = -1.0;
+    bounds.cosThetaE = 0.0;
+
+    // Lambertian emitter: power = pi * area * radiance
+    bounds.power = M_PI * 4.0 * M_PI * radius * radius * luminance(pMat->emission());
+
+    return bounds.power > 0.0;
+}
+
 #endif
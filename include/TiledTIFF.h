@@ -0,0 +1,233 @@
+#ifndef TILEDTIFFH
+#define TILEDTIFFH
+
+#include "ImageWriter.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <mutex>
+
+using namespace std;
+
+// Edge length of the tiles, which TIFF requires to be a multiple of 16. It
+// matches BLUE_NOISE_SIZE so dithering tile by tile matches the whole image.
+#define TIFF_TILE_SIZE 64
+
+/**
+ *
+ * Tiled, uncompressed RGB TIFF that is written a tile at a time, in any
+ * order and from any thread, so an image far larger than memory can be
+ * saved as it renders. Tiles are appended to the file as they come and
+ * forgotten; only their offsets are kept, for the directory that close()
+ * writes at the end and points the header to. Files that could pass 4 GB
+ * are written as BigTIFF, with 64-bit offsets.
+ *
+ * Samples are 8 or 16-bit unsigned integers, or 32-bit floats.
+ *
+ */
+
+class TiledTIFF
+{
+public:
+    TiledTIFF() : pFile(nullptr) {}
+
+    bool open(const string& path, int width, int height, int bitDepth);
+    // Pixels [x0, x1) x [y0, y1) of the image that tile covers.
+    void tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const;
+    // Appends tile, given as a TIFF_TILE_SIZE square 3-channel Image whose
+    // pixels past the edge of the image are ignored.
+    bool writeTile(int tile, const Image& pixels);
+    bool close();
+
+    int width;
+    int height;
+    int bitDepth;
+    int tilesX;
+    int tilesY;
+
+private:
+    struct Entry
+    {
+        uint16_t tag;
+        uint16_t type;
+        uint64_t count;
+        vector<unsigned char> value;
+    };
+
+    void putOffset(vector<unsigned char>& out, uint64_t value) const;
+
+    FILE* pFile;
+    bool big;
+    uint64_t end;
+    vector<uint64_t> offsets;
+    mutex lock;
+};
+
+bool TiledTIFF::open(const string& path, int width, int height, int bitDepth)
+{
+    this->width = width;
+    this->height = height;
+    this->bitDepth = bitDepth;
+    tilesX = (width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    tilesY = (height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+    offsets.assign(size_t(tilesX) * tilesY, 0);
+
+    const uint64_t tileBytes = uint64_t(TIFF_TILE_SIZE) * TIFF_TILE_SIZE * 3 * bitDepth / 8;
+    big = offsets.size() * tileBytes > 0xF0000000ull;
+
+    pFile = fopen(path.c_str(), "wb");
+    if (!pFile)
+    {
+        return false;
+    }
+    // Little endian, and a directory offset to fill in on close()
+    vector<unsigned char> header = { 'I', 'I' };
+    if (big)
+    {
+        header.insert(header.end(), { 43, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 });
+    }
+    else
+    {
+        header.insert(header.end(), { 42, 0, 0, 0, 0, 0 });
+    }
+    end = header.size();
+    return fwrite(header.data(), 1, header.size(), pFile) == header.size();
+}
+
+void TiledTIFF::tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const
+{
+    x0 = (tile % tilesX) * TIFF_TILE_SIZE;
+    y0 = (tile / tilesX) * TIFF_TILE_SIZE;
+    x1 = min(width, x0 + TIFF_TILE_SIZE);
+    y1 = min(height, y0 + TIFF_TILE_SIZE);
+}
+
+bool TiledTIFF::writeTile(int tile, const Image& pixels)
+{
+    // TIFF samples follow the file's byte order, where Image stores 16-bit
+    // ones most significant byte first
+    vector<unsigned char> swapped;
+    const vector<unsigned char>* pData = &pixels.data;
+    if (bitDepth == 16)
+    {
+        swapped.resize(pixels.data.size());
+        for (size_t k = 0; k < swapped.size(); k += 2)
+        {
+            swapped[k] = pixels.data[k + 1];
+            swapped[k + 1] = pixels.data[k];
+        }
+        pData = &swapped;
+    }
+
+    lock_guard<mutex> guard(lock);
+    offsets[tile] = end;
+    end += pData->size();
+    return fwrite(pData->data(), 1, pData->size(), pFile) == pData->size();
+}
+
+void TiledTIFF::putOffset(vector<unsigned char>& out, uint64_t value) const
+{
+    if (big)
+    {
+        putLittleEndian(out, value);
+    }
+    else
+    {
+        putLittleEndian(out, uint32_t(value));
+    }
+}
+
+bool TiledTIFF::close()
+{
+    const uint16_t SHORT = 3;
+    const uint16_t LONG = 4;
+    const uint16_t LONG8 = 16;
+    const uint16_t offsetType = big ? LONG8 : LONG;
+    const uint64_t tileBytes = uint64_t(TIFF_TILE_SIZE) * TIFF_TILE_SIZE * 3 * bitDepth / 8;
+
+    auto shorts = [](uint16_t value, int count)
+    {
+        vector<unsigned char> out;
+        for (int k = 0; k < count; k++)
+        {
+            putLittleEndian(out, value);
+        }
+        return out;
+    };
+    auto longValue = [](uint32_t value)
+    {
+        vector<unsigned char> out;
+        putLittleEndian(out, value);
+        return out;
+    };
+    vector<unsigned char> tileOffsets;
+    vector<unsigned char> tileByteCounts;
+    for (uint64_t offset : offsets)
+    {
+        putOffset(tileOffsets, offset);
+        putOffset(tileByteCounts, tileBytes);
+    }
+
+    // Entries must be in increasing order of tag
+    vector<Entry> entries = {
+        { 256, LONG, 1, longValue(width) }, // ImageWidth
+        { 257, LONG, 1, longValue(height) }, // ImageLength
+        { 258, SHORT, 3, shorts(uint16_t(bitDepth), 3) }, // BitsPerSample
+        { 259, SHORT, 1, shorts(1, 1) }, // Compression: none
+        { 262, SHORT, 1, shorts(2, 1) }, // PhotometricInterpretation: RGB
+        { 277, SHORT, 1, shorts(3, 1) }, // SamplesPerPixel
+        { 284, SHORT, 1, shorts(1, 1) }, // PlanarConfiguration: interleaved
+        { 322, SHORT, 1, shorts(TIFF_TILE_SIZE, 1) }, // TileWidth
+        { 323, SHORT, 1, shorts(TIFF_TILE_SIZE, 1) }, // TileLength
+        { 324, offsetType, offsets.size(), tileOffsets }, // TileOffsets
+        { 325, offsetType, offsets.size(), tileByteCounts }, // TileByteCounts
+        { 339, SHORT, 3, shorts(bitDepth == 32 ? 3 : 1, 3) } // SampleFormat: float or unsigned
+    };
+
+    // The directory goes at the end, on a word boundary, with values too
+    // large to fit in their entry right after it
+    const uint64_t directory = end + (end & 1);
+    const size_t inlineSize = big ? 8 : 4;
+    const size_t directorySize = big ? 8 + 20 * entries.size() + 8 : 2 + 12 * entries.size() + 4;
+    vector<unsigned char> out(directory - end, 0);
+    vector<unsigned char> values;
+    if (big)
+    {
+        putLittleEndian(out, uint64_t(entries.size()));
+    }
+    else
+    {
+        putLittleEndian(out, uint16_t(entries.size()));
+    }
+    for (const Entry& entry : entries)
+    {
+        putLittleEndian(out, entry.tag);
+        putLittleEndian(out, entry.type);
+        putOffset(out, entry.count);
+        if (entry.value.size() <= inlineSize)
+        {
+            out.insert(out.end(), entry.value.begin(), entry.value.end());
+            out.resize(out.size() + inlineSize - entry.value.size(), 0);
+        }
+        else
+        {
+            putOffset(out, directory + directorySize + values.size());
+            values.insert(values.end(), entry.value.begin(), entry.value.end());
+            values.resize((values.size() + 1) & ~size_t(1), 0);
+        }
+    }
+    putOffset(out, 0); // No further directories
+    out.insert(out.end(), values.begin(), values.end());
+
+    bool written = fwrite(out.data(), 1, out.size(), pFile) == out.size();
+    vector<unsigned char> pointer;
+    putOffset(pointer, directory);
+    written = written && fseeko(pFile, big ? 8 : 4, SEEK_SET) == 0 &&
+              fwrite(pointer.data(), 1, pointer.size(), pFile) == pointer.size();
+    written = fclose(pFile) == 0 && written;
+    pFile = nullptr;
+    return written;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef VISIBILITYBUFFERH
+#define VISIBILITYBUFFERH
+
+#include "Config.h"
+#include "Camera.h"
+#include "Hitable.h"
+#include "Parallel.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+using namespace std;
+
+// Edge length in pixels of the screen tiles primitives are binned into
+#define VIS_TILE_SIZE 16
+
+/**
+ *
+ * First hits of the camera rays through a fixed grid x grid of subpixel
+ * positions in every pixel, found by rasterizing the primitives instead of
+ * tracing the rays. Each primitive is binned into the screen tiles its
+ * projected bounding box overlaps, and then every tile, on its own thread,
+ * tests the rays of its subpixels against just the primitives in its bin,
+ * keeping the nearest like a depth buffer. Primitives without a bounding
+ * box, or reaching behind the camera, cover the whole screen.
+ *
+ * Camera sample s of a pixel goes through subpixel s modulo grid squared,
+ * so the samples of a pixel stratify it instead of jittering. Rendering
+ * then only intersects the one primitive stored for a sample, to fill in
+ * its hit record.
+ *
+ */
+
+class VisibilityBuffer
+{
+public:
+    VisibilityBuffer(int grid) : grid(grid), pObjects(nullptr) {}
+
+    void build(Camera* cam, const vector<Hitable*>& objects);
+
+    // Camera ray of sample s of pixel iter, in processPixels order.
+    ray getRay(Camera* cam, int iter, int s) const;
+    // First hit of that ray, false if it hits nothing.
+    bool firstHit(int iter, int s, const ray& r, HitRecord& rec) const;
+
+    int grid;
+    vector<int> ids; // Index into the objects of the first hit, -1 for none
+    vector<float> depths; // Ray parameter of the first hit
+
+private:
+    // Pixels a primitive may cover, with rows counted from the top
+    struct ScreenBounds
+    {
+        int x0;
+        int x1;
+        int y0;
+        int y1;
+    };
+
+    bool screenBounds(Camera* cam, const Hitable* pObj, ScreenBounds& bounds) const;
+
+    const vector<Hitable*>* pObjects;
+};
+
+ray VisibilityBuffer::getRay(Camera* cam, int iter, int s) const
+{
+    const int i = iter % N_X;
+    const int j = N_Y - iter / N_X - 1;
+    const int k = s % (grid * grid);
+    float u = (i + (k % grid + 0.5f) / grid) / float(N_X);
+    float v = (j + (k / grid + 0.5f) / grid) / float(N_Y);
+    return cam->getRay(u, v);
+}
+
+bool VisibilityBuffer::firstHit(int iter, int s, const ray& r, HitRecord& rec) const
+{
+    const int id = ids[iter * grid * grid + s % (grid * grid)];
+    // The nearest hit of that one primitive is the nearest of all
+    return id >= 0 && (*pObjects)[id]->hit(r, 0.001, FLT_MAX, rec);
+}
+
+bool VisibilityBuffer::screenBounds(Camera* cam, const Hitable* pObj, ScreenBounds& bounds) const
+{
+    vec3 lo;
+    vec3 hi;
+    float uMin = 0.0;
+    float uMax = 1.0;
+    float vMin = 0.0;
+    float vMax = 1.0;
+    if (pObj->boundingBox(lo, hi))
+    {
+        // The box's corners project around everything inside it
+        float uLo = FLT_MAX;
+        float uHi = -FLT_MAX;
+        float vLo = FLT_MAX;
+        float vHi = -FLT_MAX;
+        bool inFront = true;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            vec3 p((corner & 1) ? hi.x() : lo.x(), (corner & 2) ? hi.y() : lo.y(), (corner & 4) ? hi.z() : lo.z());
+            float u;
+            float v;
+            if (!cam->filmCoordinates(p, u, v))
+            {
+                inFront = false;
+                break;
+            }
+            uLo = min(uLo, u);
+            uHi = max(uHi, u);
+            vLo = min(vLo, v);
+            vHi = max(vHi, v);
+        }
+
+        if (inFront)
+        {
+            // Widen a little so rounding cannot drop a subpixel on the edge
+            uMin = max(uMin, uLo - 1e-4f);
+            uMax = min(uMax, uHi + 1e-4f);
+            vMin = max(vMin, vLo - 1e-4f);
+            vMax = min(vMax, vHi + 1e-4f);
+            if (uMin > uMax || vMin > vMax)
+            {
+                return false;
+            }
+        }
+    }
+
+    bounds.x0 = min(N_X - 1, int(uMin * N_X));
+    bounds.x1 = min(N_X - 1, int(uMax * N_X));
+    bounds.y0 = N_Y - 1 - min(N_Y - 1, int(vMax * N_Y));
+    bounds.y1 = N_Y - 1 - min(N_Y - 1, int(vMin * N_Y));
+    return true;
+}
+
+void VisibilityBuffer::build(Camera* cam, const vector<Hitable*>& objects)
+{
+    pObjects = &objects;
+    const int positions = grid * grid;
+    ids.assign(N_X * N_Y * positions, -1);
+    depths.assign(N_X * N_Y * positions, FLT_MAX);
+
+    const int tilesX = (N_X + VIS_TILE_SIZE - 1) / VIS_TILE_SIZE;
+    const int tilesY = (N_Y + VIS_TILE_SIZE - 1) / VIS_TILE_SIZE;
+    vector<vector<int>> bins(tilesX * tilesY);
+    vector<ScreenBounds> objectBounds(objects.size());
+    for (int id = 0; id < int(objects.size()); id++)
+    {
+        ScreenBounds& bounds = objectBounds[id];
+        if (!screenBounds(cam, objects[id], bounds))
+        {
+            continue;
+        }
+        for (int ty = bounds.y0 / VIS_TILE_SIZE; ty <= bounds.y1 / VIS_TILE_SIZE; ty++)
+        {
+            for (int tx = bounds.x0 / VIS_TILE_SIZE; tx <= bounds.x1 / VIS_TILE_SIZE; tx++)
+            {
+                bins[ty * tilesX + tx].push_back(id);
+            }
+        }
+    }
+
+    // Tiles do not share subpixels, so their threads need no locking
+    parallelFor(tilesX * tilesY, [&](int start, int end)
+    {
+        for (int tile = start; tile < end; tile++)
+        {
+            const int tileX = (tile % tilesX) * VIS_TILE_SIZE;
+            const int tileY = (tile / tilesX) * VIS_TILE_SIZE;
+            for (int id : bins[tile])
+            {
+                const ScreenBounds& bounds = objectBounds[id];
+                const int y1 = min(bounds.y1, tileY + VIS_TILE_SIZE - 1);
+                const int x1 = min(bounds.x1, tileX + VIS_TILE_SIZE - 1);
+                for (int y = max(bounds.y0, tileY); y <= y1; y++)
+                {
+                    for (int x = max(bounds.x0, tileX); x <= x1; x++)
+                    {
+                        const int iter = y * N_X + x;
+                        for (int k = 0; k < positions; k++)
+                        {
+                            const int entry = iter * positions + k;
+                            HitRecord rec;
+                            if (objects[id]->hit(getRay(cam, iter, k), 0.001, depths[entry], rec))
+                            {
+                                depths[entry] = rec.t;
+                                ids[entry] = id;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,422 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include "Config.h"
+#include "Camera.h"
+#include "PathTracer.h"
+#include "Parallel.h"
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+
+using namespace std;
+
+// Paths in flight per worker. With their hit records and shadow rays they
+// take about 320 bytes each, so the queues stay within a 1 MB share of L2
+// with room left for the scene.
+#define WAVEFRONT_QUEUE_SIZE 2048
+
+// Spreads the low 10 bits of v out to every third bit.
+inline uint32_t expandBits(uint32_t v)
+{
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/**
+ *
+ * Path states of a wavefront queue, one array per field, indexed by slot.
+ *
+ */
+
+struct PathStates
+{
+    PathStates(int size);
+
+    ray getRay(int slot) const;
+    void setRay(int slot, const ray& r);
+    vec3 getBeta(int slot) const { return vec3(betaR[slot], betaG[slot], betaB[slot]); }
+    void setBeta(int slot, const vec3& beta);
+    vec3 getPrevNormal(int slot) const { return vec3(nx[slot], ny[slot], nz[slot]); }
+    void setPrevNormal(int slot, const vec3& n);
+
+    vector<float> ox, oy, oz;
+    vector<float> dx, dy, dz;
+    vector<float> betaR, betaG, betaB; // Throughput from the camera
+    vector<float> scatterPdf; // As passed to getColor()
+    vector<float> nx, ny, nz; // Normal at the previous vertex
+    vector<int> pixel;
+    vector<int> depth;
+};
+
+PathStates::PathStates(int size)
+    : ox(size), oy(size), oz(size), dx(size), dy(size), dz(size), betaR(size), betaG(size), betaB(size),
+      scatterPdf(size), nx(size), ny(size), nz(size), pixel(size), depth(size)
+{}
+
+ray PathStates::getRay(int slot) const
+{
+    return ray(vec3(ox[slot], oy[slot], oz[slot]), vec3(dx[slot], dy[slot], dz[slot]));
+}
+
+void PathStates::setRay(int slot, const ray& r)
+{
+    ox[slot] = r.origin().x();
+    oy[slot] = r.origin().y();
+    oz[slot] = r.origin().z();
+    dx[slot] = r.direction().x();
+    dy[slot] = r.direction().y();
+    dz[slot] = r.direction().z();
+}
+
+void PathStates::setBeta(int slot, const vec3& beta)
+{
+    betaR[slot] = beta.x();
+    betaG[slot] = beta.y();
+    betaB[slot] = beta.z();
+}
+
+void PathStates::setPrevNormal(int slot, const vec3& n)
+{
+    nx[slot] = n.x();
+    ny[slot] = n.y();
+    nz[slot] = n.z();
+}
+
+/**
+ *
+ * Wavefront path tracer for one worker's range of pixels. Instead of
+ * following each sample down getColor()'s recursion, it keeps a queue of
+ * paths and runs every stage over all of them before the next:
+ *
+ *   generate  refills free slots with camera rays of the next samples
+ *   extend    finds the next hit of every path
+ *   miss      adds the background seen by paths that left the scene
+ *   shade     evaluates the hits in order of material, queueing light
+ *             connections and picking each path's next ray
+ *   connect   traces the queued shadow rays
+ *
+ * getColor() traces both the diffuse and the specular lobe of every hit
+ * and blends them by the Fresnel term, a tree of rays per sample. Here a
+ * path follows one of them, picked in proportion to its throughput and
+ * divided by that probability, which has the same expected value and
+ * keeps a path a single chain of rays. Emission and light connections are
+ * weighted exactly as shadeHit() weights them.
+ *
+ * With sortRays, extend first orders the paths by the octant of their ray's
+ * direction, then by the grid cell it starts in, in Morton order over the
+ * queue's bounds. Rays that head the same way from close together then
+ * traverse the same nodes one after another while those are still in
+ * cache, instead of each bounce ray fetching its own.
+ *
+ */
+
+class WavefrontQueue
+{
+public:
+    WavefrontQueue(Camera* cam, const Scene* scene, int start, int end, vector<vec3>& sums, bool sortRays);
+
+    // Renders N_S samples for every pixel of the range into sums.
+    void run();
+
+private:
+    void generate();
+    void sortActive();
+    void extend();
+    void miss();
+    void shade();
+    void connect();
+
+    Camera* cam;
+    const Scene* scene;
+    vector<vec3>& sums;
+    bool sortRays;
+    int nextPixel;
+    int end;
+    int nextSample;
+
+    PathStates paths;
+    vector<HitRecord> hits;
+    vector<LightConnection> connections;
+    vector<int> connectionPixels;
+
+    vector<int> freeSlots;
+    vector<int> active;
+    vector<int> hitSlots;
+    vector<int> missSlots;
+    vector<pair<uint64_t, int>> sortKeys;
+
+    // The rays extend traces, and the slots they belong to
+    vector<int> traceSlots;
+    vector<ray> traceRays;
+    vector<HitRecord> traceHits;
+};
+
+WavefrontQueue::WavefrontQueue(Camera* cam, const Scene* scene, int start, int end, vector<vec3>& sums, bool sortRays)
+    : cam(cam), scene(scene), sums(sums), sortRays(sortRays), nextPixel(start), end(end), nextSample(0), paths(WAVEFRONT_QUEUE_SIZE),
+      hits(WAVEFRONT_QUEUE_SIZE), traceHits(WAVEFRONT_QUEUE_SIZE)
+{
+    for (int slot = WAVEFRONT_QUEUE_SIZE - 1; slot >= 0; slot--)
+    {
+        freeSlots.push_back(slot);
+    }
+    active.reserve(WAVEFRONT_QUEUE_SIZE);
+    hitSlots.reserve(WAVEFRONT_QUEUE_SIZE);
+    missSlots.reserve(WAVEFRONT_QUEUE_SIZE);
+    connections.reserve(2 * WAVEFRONT_QUEUE_SIZE);
+    connectionPixels.reserve(2 * WAVEFRONT_QUEUE_SIZE);
+    sortKeys.reserve(WAVEFRONT_QUEUE_SIZE);
+    traceSlots.reserve(WAVEFRONT_QUEUE_SIZE);
+    traceRays.reserve(WAVEFRONT_QUEUE_SIZE);
+}
+
+void WavefrontQueue::run()
+{
+    while (true)
+    {
+        generate();
+        if (active.empty())
+        {
+            return;
+        }
+        extend();
+        miss();
+        shade();
+        connect();
+    }
+}
+
+void WavefrontQueue::generate()
+{
+    while (!freeSlots.empty() && nextPixel < end)
+    {
+        const int slot = freeSlots.back();
+        freeSlots.pop_back();
+
+        const int i = nextPixel % N_X;
+        const int j = N_Y - nextPixel / N_X - 1;
+        float u = float(i + getRand()) / float(N_X);
+        float v = float(j + getRand()) / float(N_Y);
+
+        paths.setRay(slot, cam->getRay(u, v));
+        paths.setBeta(slot, vec3(1, 1, 1));
+        paths.scatterPdf[slot] = 0.0;
+        paths.setPrevNormal(slot, vec3());
+        paths.pixel[slot] = nextPixel;
+        paths.depth[slot] = 0;
+        active.push_back(slot);
+
+        if (++nextSample == N_S)
+        {
+            nextSample = 0;
+            nextPixel++;
+        }
+    }
+}
+
+void WavefrontQueue::sortActive()
+{
+    vec3 lo(FLT_MAX, FLT_MAX, FLT_MAX);
+    vec3 hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int slot : active)
+    {
+        lo = vec3(min(lo.x(), paths.ox[slot]), min(lo.y(), paths.oy[slot]), min(lo.z(), paths.oz[slot]));
+        hi = vec3(max(hi.x(), paths.ox[slot]), max(hi.y(), paths.oy[slot]), max(hi.z(), paths.oz[slot]));
+    }
+    vec3 scale = hi - lo;
+    for (int k = 0; k < 3; k++)
+    {
+        scale[k] = scale[k] > 0.0 ? 1023.0 / scale[k] : 0.0;
+    }
+
+    sortKeys.clear();
+    for (int slot : active)
+    {
+        uint32_t x = uint32_t((paths.ox[slot] - lo.x()) * scale.x());
+        uint32_t y = uint32_t((paths.oy[slot] - lo.y()) * scale.y());
+        uint32_t z = uint32_t((paths.oz[slot] - lo.z()) * scale.z());
+        uint32_t octant = (paths.dx[slot] < 0.0 ? 1 : 0) | (paths.dy[slot] < 0.0 ? 2 : 0) | (paths.dz[slot] < 0.0 ? 4 : 0);
+        uint64_t cell = (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+        sortKeys.push_back(make_pair((uint64_t(octant) << 30) | cell, slot));
+    }
+    sort(sortKeys.begin(), sortKeys.end());
+
+    for (int k = 0; k < int(active.size()); k++)
+    {
+        active[k] = sortKeys[k].second;
+    }
+}
+
+void WavefrontQueue::extend()
+{
+    if (sortRays)
+    {
+        sortActive();
+    }
+
+    hitSlots.clear();
+    missSlots.clear();
+    traceSlots.clear();
+    traceRays.clear();
+    for (int slot : active)
+    {
+        // Like getColor(), paths at the bounce limit see the background
+        if (paths.depth[slot] < N_BOUNCES)
+        {
+            traceSlots.push_back(slot);
+            traceRays.push_back(paths.getRay(slot));
+        }
+        else
+        {
+            missSlots.push_back(slot);
+        }
+    }
+    active.clear();
+
+    // All at once, so the world can interleave their traversals
+    scene->world->hitStream(traceRays.data(), int(traceRays.size()), 0.001, FLT_MAX, traceHits.data());
+    for (int k = 0; k < int(traceSlots.size()); k++)
+    {
+        const int slot = traceSlots[k];
+        if (traceHits[k].pObj)
+        {
+            hits[slot] = traceHits[k];
+            hitSlots.push_back(slot);
+        }
+        else
+        {
+            missSlots.push_back(slot);
+        }
+    }
+}
+
+void WavefrontQueue::miss()
+{
+    for (int slot : missSlots)
+    {
+        sums[paths.pixel[slot]] += paths.getBeta(slot) * missColor(paths.getRay(slot), *scene, paths.scatterPdf[slot]);
+        freeSlots.push_back(slot);
+    }
+}
+
+void WavefrontQueue::shade()
+{
+    // Hits on the same material run the same code on the same data
+    sort(hitSlots.begin(), hitSlots.end(), [this](int a, int b)
+    {
+        return hits[a].pMat < hits[b].pMat;
+    });
+
+    connections.clear();
+    connectionPixels.clear();
+    for (int slot : hitSlots)
+    {
+        const HitRecord& rec = hits[slot];
+        const ray r = paths.getRay(slot);
+        const vec3 beta = paths.getBeta(slot);
+        const int depth = paths.depth[slot];
+        const int pixel = paths.pixel[slot];
+
+        // The specular lobe first, since its Fresnel term scales everything else
+        vec3 F;
+        vec3 attenuation;
+        ray reflected;
+        bool specular = depth < N_BOUNCES - 1 && rec.pMat->reflect(r, rec, attenuation, reflected);
+        if (specular)
+        {
+            F = SchlickApprox(vec3::normalize(rec.normal), vec3::normalize(reflected.direction()), attenuation);
+        }
+        const vec3 diffuseBeta = beta * (vec3(1, 1, 1) - F);
+
+        sums[pixel] += diffuseBeta * weightedEmission(*scene, r, rec, paths.scatterPdf[slot], paths.getPrevNormal(slot));
+
+        ray scattered;
+        float pdf;
+        vec3 bounceBeta;
+        if (scatterDiffuse(*scene, r, rec, attenuation, scattered, pdf))
+        {
+            vec3 cached;
+            if (scene->pCache && scene->pCache->ready && depth >= scene->pCache->depth &&
+                scene->pCache->lookup(rec.p, rec.normal, rec.pObj, cached))
+            {
+                sums[pixel] += diffuseBeta * cached;
+            }
+            else
+            {
+                LightConnection connection;
+                if (connectToEnvironment(*scene, r, rec, connection))
+                {
+                    connection.weight *= diffuseBeta;
+                    connections.push_back(connection);
+                    connectionPixels.push_back(pixel);
+                }
+                if (connectToLight(*scene, r, rec, connection))
+                {
+                    connection.weight *= diffuseBeta;
+                    connections.push_back(connection);
+                    connectionPixels.push_back(pixel);
+                }
+                bounceBeta = diffuseBeta * attenuation;
+            }
+        }
+
+        // Continue along one lobe, chosen by how much each carries
+        float diffuseWeight = luminance(bounceBeta);
+        float specularWeight = specular ? luminance(beta * F) : 0.0;
+        if (!(diffuseWeight + specularWeight > 0.0))
+        {
+            freeSlots.push_back(slot);
+            continue;
+        }
+
+        float pSpecular = specularWeight / (diffuseWeight + specularWeight);
+        if (getRand() < pSpecular)
+        {
+            paths.setRay(slot, reflected);
+            paths.setBeta(slot, beta * F / pSpecular);
+            paths.scatterPdf[slot] = 0.0;
+        }
+        else
+        {
+            paths.setRay(slot, scattered);
+            paths.setBeta(slot, bounceBeta / (1.0 - pSpecular));
+            paths.scatterPdf[slot] = pdf;
+        }
+        paths.setPrevNormal(slot, rec.normal);
+        paths.depth[slot] = depth + 1;
+        active.push_back(slot);
+    }
+}
+
+void WavefrontQueue::connect()
+{
+    for (int k = 0; k < int(connections.size()); k++)
+    {
+        sums[connectionPixels[k]] += traceConnection(*scene, connections[k]);
+    }
+}
+
+// Renders N_S samples per pixel with one wavefront queue per thread, and
+// returns linear colors in processPixels order.
+vector<vec3> renderWavefront(Camera* cam, const Scene* scene, bool sortRays)
+{
+    vector<vec3> colors(N_X * N_Y);
+    parallelFor(N_X * N_Y, [&](int start, int end)
+    {
+        WavefrontQueue queue(cam, scene, start, end, colors, sortRays);
+        queue.run();
+    });
+
+    for (vec3& color : colors)
+    {
+        color /= float(N_S);
+    }
+    return colors;
+}
+
+#endif
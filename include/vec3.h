@@ -3,15 +3,12 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <algorithm>
 #include <iostream>
+#include "Random.h"
 
 using namespace std;
 
-double getRand()
-{
-    return double(random()) / double(RAND_MAX);
-}
-
 class vec3
 {
 public:
@@ -19,6 +16,8 @@ public:
     static inline vec3 randomInUnitSphere();
     static inline vec3 reflect(const vec3& v, const vec3& n);
     static inline vec3 randomInUnitHemisphere(const vec3& n);
+    static inline vec3 randomUnitVector();
+    static inline void orthonormalBasis(const vec3& n, vec3& t, vec3& b);
 
     vec3()
     {
@@ -130,7 +129,7 @@ inline vec3 cross(const vec3& a, const vec3& b)
 {
     return vec3(
         a.e[1] * b.e[2] - a.e[2] * b.e[1],
-        a.e[0] * b.e[2] - a.e[2] * b.e[0],
+        a.e[2] * b.e[0] - a.e[0] * b.e[2],
         a.e[0] * b.e[1] - a.e[1] * b.e[0]
     );
 }
@@ -246,6 +245,32 @@ inline vec3 vec3::randomInUnitHemisphere(const vec3& n)
     return p;
 }
 
+inline vec3 vec3::randomUnitVector()
+{
+    // Uniformly distributed on the surface of the unit sphere
+    float z = 1.0 - 2.0 * getRand();
+    float phi = 2.0 * M_PI * getRand();
+    float r = sqrt(max(0.0f, 1.0f - z * z));
+
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline void vec3::orthonormalBasis(const vec3& n, vec3& t, vec3& b)
+{
+    // Builds a tangent frame around unit vector n (Duff et al. 2017)
+    float sign = copysign(1.0f, n.z());
+    float a = -1.0f / (sign + n.z());
+    float c = n.x() * n.y() * a;
+
+    t = vec3(1.0f + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+    b = vec3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+inline float luminance(const vec3& c)
+{
+    return 0.2126 * c.r() + 0.7152 * c.g() + 0.0722 * c.b();
+}
+
 inline vec3 lerp(const vec3& a, const vec3& b, float t)
 {
     t = clamp(t, 0.0f, 1.0f);
@@ -3,166 +3,1204 @@
 #include <algorithm>
 #include <cfloat>
 #include <cstdlib>
+#include <cstdint>
 #include <thread>
 #include <cmath>
 #include <chrono>
+#include <numeric>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+// ImageWriter.h includes it again, for the declarations only
+#undef STB_IMAGE_WRITE_IMPLEMENTATION
 
+#include "Config.h"
 #include "vec3.h"
 #include "ray.h"
 #include "Sphere.h"
 #include "HitableList.h"
+#include "BVH.h"
+#include "VisibilityBuffer.h"
 #include "Camera.h"
 #include "Material.h"
+#include "Scene.h"
+#include "Options.h"
+#include "Scenes.h"
+#include "PathTracer.h"
+#include "ReSTIR.h"
+#include "BDPT.h"
+#include "PSSMLT.h"
+#include "Wavefront.h"
+#include "Denoiser.h"
+#include "Framebuffer.h"
+#include "PostProcess.h"
+#include "ImageWriter.h"
+#include "FrameStream.h"
+#include "TiledTIFF.h"
+#include "Checkpoint.h"
+#include "Animation.h"
+#include "Parallel.h"
 
 using namespace std;
 
-// Constants that define properties of this ray tracer.
-#define N_X 1280
-#define N_Y 720
-#define N_CHANNELS 4
-#define N_S 1024
-#define N_BOUNCES 50
+// Samples of an output frame: linear colors encoded for display at 8 or 16
+// bits, or kept as floats at 32.
+Image encodeFrame(const vector<vec3>& colors, int bitDepth, const PostSettings& post)
+{
+    if (bitDepth == 32)
+    {
+        return makeFloatImage(colors, N_X, N_Y);
+    }
+
+    Image image;
+    if (bitDepth == 16)
+    {
+        image = makeImage(postProcess<uint16_t>(colors, N_X, N_Y, N_CHANNELS, 65535, post), N_X, N_Y, N_CHANNELS);
+    }
+    else
+    {
+        image = makeImage(postProcess<unsigned char>(colors, N_X, N_Y, N_CHANNELS, 255, post), N_X, N_Y, N_CHANNELS);
+    }
+    dropOpaqueAlpha(image);
+    return image;
+}
+
+// Writes linear colors to path as an image file of format: as they are for
+// the float formats, else encoded at bitDepth bits.
+bool writeImage(const string& path, const vector<vec3>& colors, ImageFormat format, int bitDepth, int pngLevel,
+                const PostSettings& post)
+{
+    if (isFloatFormat(format))
+    {
+        // Keep the linear radiance as it is, for compositing
+        if (format == IMAGE_PFM)
+        {
+            return writePFM(path, colors, N_X, N_Y);
+        }
+        if (format == IMAGE_HDR)
+        {
+            return writeHDR(path, colors, N_X, N_Y);
+        }
+        return writeEXR(path, colors, N_X, N_Y);
+    }
 
-vec3 SchlickApprox(const vec3 n, const vec3 l, const vec3 F0)
+    Image image = encodeFrame(colors, bitDepth, post);
+    if (format == IMAGE_QOI)
+    {
+        return writeQOI(path, image);
+    }
+    if (format == IMAGE_PPM)
+    {
+        return writePPM(path, image);
+    }
+    return writePNG(path, image, pngLevel);
+}
+
+// Writes the image so far to the output file, aside first and then renamed
+// into place, so that it is never seen half written.
+void writePreview(const vector<vec3>& colors, ImageFormat format, int bitDepth, int pngLevel, const PostSettings& post)
 {
-    // More intuitively, lerp(F0, <white>, pow(1.0 - dot(n, l), 5.0))
-    return F0 + (vec3(1, 1, 1) - F0) * pow(1.0 - max(0.0f, dot(n, l)), 5.0);
+    const string path = string("image.") + imageExtension(format);
+    const string temporary = path + ".tmp";
+    if (!writeImage(temporary, colors, format, bitDepth, pngLevel, post) || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        cerr << "Could not write preview " << path << endl;
+    }
 }
 
-vec3 getColor(const ray& r, Hitable* world, int depth)
+// Renders spp samples of each of pixels [x0, x1) x [y0, y1) into local,
+// which has the top left pixel at its corner. A pixel's camera rays are
+// intersected all at once, then the diffuse bounces off what they hit, and
+// only then is each sample shaded. Also gathers the denoiser's AOVs from
+// the same camera rays when given pAOVs, and takes the first hits from pVis
+// instead of tracing camera rays when given that.
+void renderTile(int x0,
+                int y0,
+                int x1,
+                int y1,
+                Camera* cam,
+                const Scene* scene,
+                FramebufferTile& local,
+                AOVBuffers* pAOVs,
+                const VisibilityBuffer* pVis,
+                int spp)
 {
-    HitRecord rec;
-    if (depth < N_BOUNCES && world->hit(r, 0.001, FLT_MAX, rec))
+    const int numBlocks = (spp + PACKET_SIZE - 1) / PACKET_SIZE;
+    vector<RaySoA> cameraRays(numBlocks);
+    vector<HitSoA> cameraHits(numBlocks);
+    vector<RaySoA> bounceRays(numBlocks);
+    vector<HitSoA> bounceHits(numBlocks);
+    vector<TracedBounce> bounces(spp);
+
+    const int tileWidth = x1 - x0;
+    for (int k = 0; k < tileWidth * (y1 - y0); k++)
     {
-        vec3 color;
-        vec3 attenuation;
+        const int x = x0 + k % tileWidth;
+        const int y = y0 + k / tileWidth;
+        const int iter = y * N_X + x;
+        const int i = x;
+        const int j = N_Y - y - 1;
 
-        ray scattered;
-        ray reflected;
+        vec3 col;
 
-        // Ray trace diffuse lambertian lighting
-        if (rec.pMat->scatter(r, rec, attenuation, scattered))
+        cameraHits.assign(numBlocks, HitSoA());
+        if (pVis)
+        {
+            for (int s = 0; s < spp; s++)
+            {
+                const int block = s / PACKET_SIZE;
+                const int lane = s % PACKET_SIZE;
+                const ray r = pVis->getRay(cam, iter, s);
+                cameraRays[block].setRay(lane, r);
+                if (N_BOUNCES > 0 && pVis->firstHit(iter, s, r, cameraHits[block].recs[lane]))
+                {
+                    cameraHits[block].t[lane] = cameraHits[block].recs[lane].t;
+                }
+                else
+                {
+                    cameraHits[block].recs[lane].pObj = nullptr;
+                }
+            }
+        }
+        else
+        {
+            for (int s = 0; s < spp; s++)
+            {
+                float u = float(i + getRand()) / float(N_X);
+                float v = float(j + getRand()) / float(N_Y);
+                cameraRays[s / PACKET_SIZE].setRay(s % PACKET_SIZE, cam->getRay(u, v));
+            }
+            for (RaySoA& block : cameraRays)
+            {
+                block.finish();
+            }
+            if (N_BOUNCES > 0)
+            {
+                scene->world->hitBatch(cameraRays.data(), cameraHits.data(), numBlocks, 0.001);
+            }
+        }
+
+        bounceHits.assign(numBlocks, HitSoA());
+        for (int s = 0; s < spp; s++)
+        {
+            const int block = s / PACKET_SIZE;
+            const int lane = s % PACKET_SIZE;
+            const ray r = cameraRays[block].getRay(lane);
+            const HitRecord& rec = cameraHits[block].recs[lane];
+            TracedBounce& bounce = bounces[s];
+
+            bounce.scatters = rec.pObj && scatterDiffuse(*scene, r, rec, bounce.attenuation, bounce.scattered, bounce.pdf);
+            // Lanes without a bounce to trace search up to zero distance
+            bounceRays[block].setRay(lane, bounce.scatters ? bounce.scattered : r);
+            if (!bounce.scatters)
+            {
+                bounceHits[block].t[lane] = 0.0;
+            }
+        }
+        for (RaySoA& block : bounceRays)
         {
-            color += attenuation * getColor(scattered, world, depth + 1);
+            block.finish();
+        }
+        if (N_BOUNCES > 1)
+        {
+            scene->world->hitBatch(bounceRays.data(), bounceHits.data(), numBlocks, 0.001);
         }
 
-        // Ray trace reflected specular lighting
-        if (depth < N_BOUNCES - 1 && rec.pMat->reflect(r, rec, attenuation, reflected))
+        for (int s = 0; s < spp; s++)
         {
-            vec3 F = SchlickApprox(vec3::normalize(rec.normal), vec3::normalize(reflected.direction()), attenuation);
+            const int block = s / PACKET_SIZE;
+            const int lane = s % PACKET_SIZE;
+            const ray r = cameraRays[block].getRay(lane);
+            const HitRecord* pRec = cameraHits[block].recs[lane].pObj ? &cameraHits[block].recs[lane] : nullptr;
+            bounces[s].rec = bounceHits[block].recs[lane];
 
-            // float NoL = dot(vec3::normalize(rec.normal), vec3::normalize(reflected.direction()));
-            // F /= 4.0 * NoL * NoL;
-            vec3 refLightColor = getColor(reflected, world, depth + 1);
+            vec3 L = pRec ? shadeHit(r, *pRec, *scene, 0, 0.0, vec3(), nullptr, &bounces[s]) : missColor(r, *scene, 0.0);
+            col += L;
 
-            color *= (vec3(1, 1, 1) - F); // Factor down diffuse component
-            color += F * refLightColor; // Add specular contribution
+            if (pAOVs)
+            {
+                pAOVs->addFirstHit(iter, r, pRec);
+                pAOVs->addRadiance(iter, L);
+            }
         }
 
-        return color;
-    }
-    else
-    {
-        // Sky background
-        vec3 unitDirection = vec3::normalize(r.direction());
-        float t = 0.5 * (unitDirection.y() + 1.0);
-        // t = t * t;
+        if (pAOVs)
+        {
+            pAOVs->resolve(iter, spp);
+        }
 
-        vec3 color = (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
-        // if (depth != 0) color *= 2.0;
-        // color *= 1.25;
-        return color;
+        local.add(x - x0, y - y0, col, spp);
     }
 }
 
 // For multi-threading needs ... create a function with
-// things passed in to work on.
-void processPixels(int start,
-                   int end,
+// things passed in to work on: tiles [startTile, endTile) of pFilm, each
+// rendered into a local tile and committed when done.
+void processPixels(int startTile,
+                   int endTile,
                    Camera* cam,
-                   Hitable* world,
-                   vector<unsigned char>* pixels)
+                   const Scene* scene,
+                   Framebuffer* pFilm,
+                   AOVBuffers* pAOVs,
+                   const VisibilityBuffer* pVis)
+{
+    FramebufferTile local;
+    for (int tile = startTile; tile < endTile; tile++)
+    {
+        int x0, y0, x1, y1;
+        pFilm->tileBounds(tile, x0, y0, x1, y1);
+        local.clear();
+        renderTile(x0, y0, x1, y1, cam, scene, local, pAOVs, pVis, N_S);
+        pFilm->commit(tile, local);
+    }
+}
+
+/**
+ *
+ * Preview levels for a fast first image: one sample in every block of 16,
+ * then 8, then 4 pixels square, each of a pixel picked at random in its
+ * block, with the image written after every level with each block the
+ * average of the samples in it so far. The samples go to pFilm as samples
+ * of the pixels they were taken for, so the full render adds to them
+ * rather than starting over.
+ *
+ */
+
+void renderPreviewLevels(Camera* cam, const Scene* scene, Framebuffer* pFilm, ImageFormat format, int bitDepth,
+                         int pngLevel, const PostSettings& post, chrono::steady_clock::time_point start)
 {
-    for (int iter = start; iter < end; iter++)
+    for (int block = 16; block >= 4; block /= 2)
     {
-        const int i = iter % N_X;
-        const int j = N_Y - iter / N_X - 1;
+        const int blocksX = (N_X + block - 1) / block;
+        const int blocksY = (N_Y + block - 1) / block;
+        // Rows of blocks on different threads can share a framebuffer tile,
+        // but never a pixel
+        parallelFor(blocksY, [&](int startRow, int endRow)
+        {
+            FramebufferTile local;
+            for (int by = startRow; by < endRow; by++)
+            {
+                for (int bx = 0; bx < blocksX; bx++)
+                {
+                    const int x = bx * block + int(getRand() * min(block, N_X - bx * block));
+                    const int y = by * block + int(getRand() * min(block, N_Y - by * block));
+                    local.clear();
+                    renderTile(x, y, x + 1, y + 1, cam, scene, local, nullptr, nullptr, 1);
+                    pFilm->add(x, y, local.average(0, 0), 1.0f);
+                }
+            }
+        });
 
-        vec3 col;
+        vector<vec3> colors(N_X * N_Y);
+        for (int y0 = 0; y0 < N_Y; y0 += block)
+        {
+            for (int x0 = 0; x0 < N_X; x0 += block)
+            {
+                const int x1 = min(N_X, x0 + block);
+                const int y1 = min(N_Y, y0 + block);
+                vec3 sum;
+                float weight = 0.0;
+                for (int y = y0; y < y1; y++)
+                {
+                    for (int x = x0; x < x1; x++)
+                    {
+                        const float* pixel = pFilm->pixel(x, y);
+                        sum += vec3(pixel[0], pixel[1], pixel[2]);
+                        weight += pixel[3];
+                    }
+                }
+                for (int y = y0; y < y1; y++)
+                {
+                    fill(&colors[y * N_X + x0], &colors[y * N_X + x1], sum / weight);
+                }
+            }
+        }
+        writePreview(colors, format, bitDepth, pngLevel, post);
+        cout << "Preview at 1/" << block << " resolution after "
+             << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s" << endl;
+    }
+}
 
-        for (int s = 0; s < N_S; s++)
+// Adds pass number pass of a progressive render, spp samples per pixel, to
+// pFilm. Every tile reseeds the generator of the thread rendering it from
+// the pass and tile, so a pass renders the same samples however the tiles
+// are shared out, and a render resumed from a checkpoint comes out the same.
+void renderPass(Camera* cam, const Scene* scene, Framebuffer* pFilm, int pass, int spp)
+{
+    parallelFor(pFilm->numTiles(), [&](int startTile, int endTile)
+    {
+        FramebufferTile local;
+        for (int tile = startTile; tile < endTile; tile++)
         {
-            float u = float(i + getRand()) / float(N_X);
-            float v = float(j + getRand()) / float(N_Y);
-            ray r = cam->getRay(u, v);
-            col += getColor(r, world, 0);
+            int x0, y0, x1, y1;
+            pFilm->tileBounds(tile, x0, y0, x1, y1);
+            local.clear();
+            threadRNG.setSeed(uint64_t(pass), uint64_t(tile));
+            renderTile(x0, y0, x1, y1, cam, scene, local, nullptr, nullptr, spp);
+            pFilm->commit(tile, local);
         }
+    });
+}
 
-        col /= float(N_S);
+// Renders N_S samples per pixel into pFilm over passes passes, the ones
+// before the last calling preview with the image so far. With a checkpoint
+// path, carries on from the checkpoint there if there is one, and saves one
+// after every pass. False if the checkpoint there is not one of this render.
+template <typename Preview>
+bool renderProgressive(Camera* cam,
+                       const Scene* scene,
+                       Framebuffer* pFilm,
+                       int passes,
+                       const string& checkpointPath,
+                       uint64_t settings,
+                       Preview preview)
+{
+    int passesDone = 0;
+    if (!checkpointPath.empty())
+    {
+        CheckpointStatus status = readCheckpoint(checkpointPath, settings, passes, *pFilm, passesDone);
+        if (status == CHECKPOINT_INVALID)
+        {
+            cerr << checkpointPath << " is damaged or of another render; remove it to start over" << endl;
+            return false;
+        }
+        if (status == CHECKPOINT_LOADED)
+        {
+            cout << "Resuming after pass " << passesDone << " of " << passes << endl;
+        }
+    }
 
-        int ir = int(255.99 * (float)sqrt(clamp(col[0], 0.0f, 1.0f)));
-        int ig = int(255.99 * (float)sqrt(clamp(col[1], 0.0f, 1.0f)));
-        int ib = int(255.99 * (float)sqrt(clamp(col[2], 0.0f, 1.0f)));
+    for (int pass = passesDone; pass < passes; pass++)
+    {
+        // Passes split N_S as evenly as they can
+        const int spp = N_S * (pass + 1) / passes - N_S * pass / passes;
+        renderPass(cam, scene, pFilm, pass, spp);
+        cout << "Pass " << pass + 1 << " of " << passes << " done" << endl;
 
-        (*pixels)[iter * N_CHANNELS + 0] = (unsigned char)ir;
-        (*pixels)[iter * N_CHANNELS + 1] = (unsigned char)ig;
-        (*pixels)[iter * N_CHANNELS + 2] = (unsigned char)ib;
-        if (N_CHANNELS == 4)
+        // A checkpoint that cannot be written only loses the progress since
+        // the last one, so rendering goes on
+        if (!checkpointPath.empty() && !writeCheckpoint(checkpointPath, settings, passes, pass + 1, *pFilm))
+        {
+            cerr << "Could not write checkpoint " << checkpointPath << endl;
+        }
+        if (pass + 1 < passes)
         {
-            (*pixels)[iter * N_CHANNELS + 3] = 0xFF;
+            preview(pFilm->resolve());
         }
     }
+    return true;
 }
 
-int main()
+/**
+ *
+ * Renders with the path tracer until deadline, spending the time where the
+ * image is noisiest. A first sample per pixel is always taken, so no pixel
+ * stays black, and a quarter of the time left goes to more samples
+ * everywhere. The rest goes to tiles in rounds, each planning half the
+ * time left from what samples of every tile have taken so far.
+ *
+ * A tile's noise is measured by also adding every other batch of its
+ * samples to a second framebuffer: the difference between the mean of
+ * those and of the rest gives the variance of a sample, in the values
+ * post will display. A round then gives every tile the samples it needs
+ * to bring its error down to a common level, the lowest one the round can
+ * afford, so the image converges evenly. Tiles take their samples noisiest
+ * first, and stop between batches of N_S samples once the deadline passes.
+ *
+ */
+
+vector<vec3> renderToDeadline(Camera* cam,
+                              const Scene* scene,
+                              chrono::steady_clock::time_point deadline,
+                              const PostSettings& post)
 {
+    Framebuffer film(N_X, N_Y);
+    Framebuffer half(N_X, N_Y);
+    const int numTiles = film.numTiles();
+    vector<int> pixels(numTiles);
+    vector<int> spp(numTiles, 0);
+    vector<int> batches(numTiles, 0);
+    vector<double> seconds(numTiles, 0.0);
+    for (int tile = 0; tile < numTiles; tile++)
+    {
+        int x0, y0, x1, y1;
+        film.tileBounds(tile, x0, y0, x1, y1);
+        pixels[tile] = (x1 - x0) * (y1 - y0);
+    }
+    ThreadPool pool;
+    const int NUM_THREADS = pool.size();
+
+    // Adds alloc[tile] samples per pixel to each tile, in the given order,
+    // or fewer if stopAtDeadline and the deadline passes first
+    auto renderRound = [&](const vector<int>& alloc, const vector<int>& order, bool stopAtDeadline)
+    {
+        pool.run(numTiles, [&](int k)
+        {
+            const int tile = order[k];
+            if (alloc[tile] == 0 || (stopAtDeadline && chrono::steady_clock::now() >= deadline))
+            {
+                return;
+            }
+            FramebufferTile local;
+            int x0, y0, x1, y1;
+            film.tileBounds(tile, x0, y0, x1, y1);
+            local.clear();
+            threadRNG.setSeed(uint64_t(batches[tile]), uint64_t(tile));
+            auto tileStart = chrono::steady_clock::now();
+            // At most N_S samples at a time, so this needs no more memory
+            // than a whole render, stopping between them at the deadline
+            int done = 0;
+            while (done < alloc[tile] && !(done > 0 && stopAtDeadline && chrono::steady_clock::now() >= deadline))
+            {
+                const int samples = min(N_S, alloc[tile] - done);
+                renderTile(x0, y0, x1, y1, cam, scene, local, nullptr, nullptr, samples);
+                done += samples;
+            }
+            seconds[tile] += chrono::duration<double>(chrono::steady_clock::now() - tileStart).count();
+            spp[tile] += done;
+            film.commit(tile, local);
+            if (batches[tile]++ % 2 == 1)
+            {
+                half.commit(tile, local);
+            }
+        });
+    };
+
+    // A first sample everywhere, then as many more as fit in a quarter of
+    // the time left, so every tile has a noise estimate worth trusting
+    vector<int> order(numTiles);
+    for (int tile = 0; tile < numTiles; tile++)
+    {
+        order[tile] = tile;
+    }
+    renderRound(vector<int>(numTiles, 1), order, false);
+    const double firstSeconds = accumulate(seconds.begin(), seconds.end(), 0.0);
+    const double firstLeft = chrono::duration<double>(deadline - chrono::steady_clock::now()).count();
+    const int uniformSpp = int(min(max(1.0, 0.25 * firstLeft * NUM_THREADS / max(firstSeconds, 1e-6)), 1e6));
+    renderRound(vector<int>(numTiles, uniformSpp), order, true);
+
+    // A channel's value as it will be displayed, so that noise the tonemap
+    // hides or that clips away does not draw samples
+    const float scale = pow(2.0f, post.exposure);
+    auto display = [&](float value)
+    {
+        value *= scale;
+        tonemap(&value, 1, post.tonemap);
+        return encodeSRGB(value);
+    };
+
+    // Variance of one sample of each tile as displayed, averaged over its
+    // pixels
+    vector<double> variance(numTiles, 0.0);
+    auto measureVariance = [&]()
+    {
+        double total = 0.0;
+        for (int tile = 0; tile < numTiles; tile++)
+        {
+            const float* all = film.tiles[tile].rgba;
+            const float* some = half.tiles[tile].rgba;
+            double sum = 0.0;
+            for (int p = 0; p < FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE; p++)
+            {
+                const float wAll = all[4 * p + 3];
+                const float wSome = some[4 * p + 3];
+                const float wRest = wAll - wSome;
+                if (wSome <= 0.0 || wRest <= 0.0)
+                {
+                    continue;
+                }
+                for (int c = 0; c < 3; c++)
+                {
+                    const double d = display(some[4 * p + c] / wSome) - display((all[4 * p + c] - some[4 * p + c]) / wRest);
+                    sum += d * d / (1.0 / wSome + 1.0 / wRest) / 3.0;
+                }
+            }
+            variance[tile] = sum / pixels[tile];
+            total += sum;
+        }
+        // A floor, so a tile whose noise its few samples underestimated
+        // still gets some
+        const double floor = 0.1 * total / (N_X * N_Y);
+        for (double& v : variance)
+        {
+            v = max(v, floor);
+        }
+    };
+
+    while (true)
+    {
+        const double left = chrono::duration<double>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0.0)
+        {
+            break;
+        }
+        measureVariance();
+
+        // Thread seconds a sample per pixel of each tile takes
+        vector<double> cost(numTiles);
+        for (int tile = 0; tile < numTiles; tile++)
+        {
+            cost[tile] = seconds[tile] / max(spp[tile], 1);
+        }
+        // Samples per pixel every tile needs for its error to be 1 / sqrt(k)
+        // is variance * k less what it has; find the k whose samples take
+        // half the time left
+        const double budget = 0.5 * left * NUM_THREADS;
+        auto roundCost = [&](double k)
+        {
+            double total = 0.0;
+            for (int tile = 0; tile < numTiles; tile++)
+            {
+                total += cost[tile] * max(0.0, variance[tile] * k - spp[tile]);
+            }
+            return total;
+        };
+        double lo = 0.0;
+        double hi = 1.0;
+        for (int k = 0; k < 200 && roundCost(hi) < budget; k++)
+        {
+            hi *= 2.0;
+        }
+        for (int k = 0; k < 60; k++)
+        {
+            const double mid = 0.5 * (lo + hi);
+            (roundCost(mid) < budget ? lo : hi) = mid;
+        }
+
+        vector<int> alloc(numTiles);
+        bool any = false;
+        for (int tile = 0; tile < numTiles; tile++)
+        {
+            alloc[tile] = int(min(max(0.0, variance[tile] * lo - spp[tile] + 0.5), 1e8));
+            any = any || alloc[tile] > 0;
+        }
+        if (!any)
+        {
+            // Not even a sample more fits before the deadline
+            break;
+        }
+        sort(order.begin(), order.end(), [&](int a, int b) { return variance[a] / spp[a] > variance[b] / spp[b]; });
+        renderRound(alloc, order, true);
+    }
+
+    // Report what the deadline bought
+    measureVariance();
+
+    double totalSpp = 0.0;
+    double squaredError = 0.0;
+    for (int tile = 0; tile < numTiles; tile++)
+    {
+        totalSpp += double(spp[tile]) * pixels[tile];
+        squaredError += variance[tile] / spp[tile] * pixels[tile];
+    }
+    cout << "Rendered " << totalSpp / (N_X * N_Y) << " samples per pixel on average, "
+         << *min_element(spp.begin(), spp.end()) << " to " << *max_element(spp.begin(), spp.end()) << endl;
+    // Noise is only measured in tiles that got a second batch
+    if (*min_element(batches.begin(), batches.end()) >= 2)
+    {
+        cout << "Estimated RMS error of displayed values: " << sqrt(squaredError / (N_X * N_Y)) << endl;
+    }
+
+    return film.resolve();
+}
+
+/**
+ *
+ * Renders frames first to last of animation with the path tracer, each
+ * with the camera and objects where the keyframes put them, the BVH refit
+ * around the objects that moved and the light hierarchy rebuilt if a light
+ * did. A pool of threads started once renders every frame, each tile
+ * straight into the framebuffer and then resolved into the frame's colors,
+ * while a thread of its own encodes and writes the frame before, on a
+ * second pool, to image files numbered by frame or to stream. Color buffers
+ * are handed back once written, so frames after the first few allocate
+ * nothing and start no threads.
+ *
+ */
+
+bool renderAnimation(Camera* cam,
+                     Scene* scene,
+                     BVH* pBVH,
+                     LightBVH* pLightBVH,
+                     const Animation& animation,
+                     int firstFrame,
+                     int lastFrame,
+                     FrameStream* pStream,
+                     ImageFormat format,
+                     const Options& options,
+                     const PostSettings& post)
+{
+    bool lightMoves = false;
+    for (const ObjectTrack& track : animation.tracks)
+    {
+        lightMoves = lightMoves || find(scene->lights.begin(), scene->lights.end(), track.pSphere) != scene->lights.end();
+    }
+
+    ThreadPool pool;
+    // The output thread encodes on a pool of its own, as the render pool is
+    // busy with the next frame meanwhile
+    ThreadPool outputPool;
+    BackgroundThread output;
+    Framebuffer film(N_X, N_Y);
+    atomic<bool> failed(false);
+    mutex spareLock;
+    vector<vector<vec3>> spare;
+
+    double renderSeconds = 0.0;
+    auto start = chrono::steady_clock::now();
+    for (int frame = firstFrame; frame <= lastFrame; frame++)
+    {
+        animation.placeObjects(frame);
+        if (!animation.tracks.empty())
+        {
+            if (scene->world == pBVH)
+            {
+                pBVH->refit();
+            }
+            if (lightMoves && scene->pLightBVH)
+            {
+                pLightBVH->build(scene->lights);
+            }
+        }
+        animation.placeCamera(frame, float(N_X) / float(N_Y), *cam);
+
+        vector<vec3> colors;
+        {
+            lock_guard<mutex> guard(spareLock);
+            if (!spare.empty())
+            {
+                colors = move(spare.back());
+                spare.pop_back();
+            }
+        }
+        colors.resize(N_X * N_Y);
+
+        auto renderStart = chrono::steady_clock::now();
+        pool.run(film.numTiles(), [&](int tile)
+        {
+            int x0, y0, x1, y1;
+            film.tileBounds(tile, x0, y0, x1, y1);
+            // Seeded by frame and tile, so a frame comes out the same
+            // whichever range it is rendered in
+            threadRNG.setSeed(uint64_t(frame), uint64_t(tile));
+            film.tiles[tile].clear();
+            renderTile(x0, y0, x1, y1, cam, scene, film.tiles[tile], nullptr, nullptr, N_S);
+            film.resolveTile(tile, colors);
+        });
+        renderSeconds += chrono::duration<double>(chrono::steady_clock::now() - renderStart).count();
+
+        output.submit([&, frame, colors = move(colors)]() mutable
+        {
+            pThreadPool = &outputPool;
+            bool written;
+            if (pStream)
+            {
+                pStream->submit(encodeFrame(colors, options.bitDepth, post));
+                written = true;
+            }
+            else
+            {
+                char number[16];
+                snprintf(number, sizeof(number), "%04d", frame);
+                const string path = string("image.") + number + "." + imageExtension(format);
+                written = writeImage(path, colors, format, options.bitDepth, options.pngLevel, post);
+                if (!written)
+                {
+                    cerr << "Could not write " << path << endl;
+                }
+            }
+            failed = failed || !written;
+
+            lock_guard<mutex> guard(spareLock);
+            spare.push_back(move(colors));
+        });
+        cout << "Frame " << frame << " rendered" << endl;
+    }
+    output.finish();
+
+    const int frames = lastFrame - firstFrame + 1;
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Rendered " << frames << " frames in " << seconds << "s, " << (seconds - renderSeconds) / frames
+         << "s per frame outside of tracing" << endl;
+    return !failed;
+}
+
+// Renders the image straight into a tiled TIFF at path, without ever
+// holding all of it: each thread takes the next TIFF tile, renders it in
+// framebuffer tiles, encodes it and writes it out before taking another.
+bool renderTiled(Camera* cam, const Scene* scene, const string& path, int bitDepth, const PostSettings& post)
+{
+    TiledTIFF tiff;
+    if (!tiff.open(path, N_X, N_Y, bitDepth))
+    {
+        return false;
+    }
+
+    atomic<bool> failed(false);
+    ThreadPool pool;
+    pool.run(tiff.tilesX * tiff.tilesY, [&](int tile)
+    {
+        const int size = TIFF_TILE_SIZE;
+        FramebufferTile local;
+        // Pixels past the edge of the image stay black
+        vector<vec3> colors(size * size);
+        int x0, y0, x1, y1;
+        tiff.tileBounds(tile, x0, y0, x1, y1);
+        for (int sy = y0; sy < y1; sy += FRAMEBUFFER_TILE_SIZE)
+        {
+            for (int sx = x0; sx < x1; sx += FRAMEBUFFER_TILE_SIZE)
+            {
+                const int ex = min(x1, sx + FRAMEBUFFER_TILE_SIZE);
+                const int ey = min(y1, sy + FRAMEBUFFER_TILE_SIZE);
+                local.clear();
+                renderTile(sx, sy, ex, ey, cam, scene, local, nullptr, nullptr, N_S);
+                for (int y = sy; y < ey; y++)
+                {
+                    for (int x = sx; x < ex; x++)
+                    {
+                        colors[(y - y0) * size + (x - x0)] = local.average(x - sx, y - sy);
+                    }
+                }
+            }
+        }
+
+        Image image;
+        if (bitDepth == 32)
+        {
+            image = makeFloatImage(colors, size, size);
+        }
+        else if (bitDepth == 16)
+        {
+            vector<uint16_t> samples(size * size * 3);
+            postProcessRows(colors, size, 3, 65535, post, 0, size, samples.data());
+            image = makeImage(samples, size, size, 3);
+        }
+        else
+        {
+            vector<unsigned char> samples(size * size * 3);
+            postProcessRows(colors, size, 3, 255, post, 0, size, samples.data());
+            image = makeImage(samples, size, size, 3);
+        }
+        if (!tiff.writeTile(tile, image))
+        {
+            failed = true;
+        }
+    });
+    return tiff.close() && !failed;
+}
+
+// Renders passes of doubling sample counts whose paths only train the path
+// guide, refining it after each pass.
+void trainPathGuide(Camera* cam, const Scene* scene, int iterations)
+{
+    // Fit the guide to the vertices of a coarse grid of diffuse paths first
+    vector<vec3> points;
+    for (int j = 0; j < 64; j++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            ray r = cam->getRay((i + getRand()) / 64.0, (j + getRand()) / 64.0);
+            HitRecord rec;
+            vec3 attenuation;
+            for (int depth = 0; depth < N_BOUNCES && scene->world->hit(r, 0.001, FLT_MAX, rec); depth++)
+            {
+                points.push_back(rec.p);
+                if (!rec.pMat->scatter(r, rec, attenuation, r))
+                {
+                    break;
+                }
+            }
+        }
+    }
+    scene->pGuide->fitBounds(points);
+
+    scene->pGuide->training = true;
+    for (int k = 0; k < iterations; k++)
+    {
+        const int spp = 1 << k;
+        parallelFor(N_X * N_Y, [&](int start, int end)
+        {
+            for (int iter = start; iter < end; iter++)
+            {
+                const int i = iter % N_X;
+                const int j = N_Y - iter / N_X - 1;
+
+                for (int s = 0; s < spp; s++)
+                {
+                    float u = float(i + getRand()) / float(N_X);
+                    float v = float(j + getRand()) / float(N_Y);
+                    getColor(cam->getRay(u, v), *scene, 0, 0.0, vec3());
+                }
+            }
+        });
+        scene->pGuide->refine(spp);
+    }
+    scene->pGuide->training = false;
+}
+
+// Fills the radiance cache with the diffuse vertices of spp paths per pixel.
+void fillRadianceCache(Camera* cam, const Scene* scene, int spp)
+{
+    scene->pCache->filling = true;
+    parallelFor(N_X * N_Y, [&](int start, int end)
+    {
+        for (int iter = start; iter < end; iter++)
+        {
+            const int i = iter % N_X;
+            const int j = N_Y - iter / N_X - 1;
+
+            for (int s = 0; s < spp; s++)
+            {
+                float u = float(i + getRand()) / float(N_X);
+                float v = float(j + getRand()) / float(N_Y);
+                getColor(cam->getRay(u, v), *scene, 0, 0.0, vec3());
+            }
+        }
+    });
+    scene->pCache->finish();
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options))
+    {
+        return 1;
+    }
+
+    if (options.scene != "default" && options.scene != "manylights" && options.scene != "occluded" &&
+        options.scene != "large")
+    {
+        cerr << "Unknown scene " << options.scene << endl;
+        return 1;
+    }
+    if (options.lightSampler != "bvh" && options.lightSampler != "uniform")
+    {
+        cerr << "Unknown light sampler " << options.lightSampler << endl;
+        return 1;
+    }
+    if (options.integrator != "path" && options.integrator != "bdpt" && options.integrator != "mlt" &&
+        options.integrator != "wavefront")
+    {
+        cerr << "Unknown integrator " << options.integrator << endl;
+        return 1;
+    }
+    if (options.accel != "bvh" && options.accel != "list")
+    {
+        cerr << "Unknown acceleration structure " << options.accel << endl;
+        return 1;
+    }
+
+    // Check the output settings now rather than after rendering
+    Tonemap tonemap;
+    if (!parseTonemap(options.tonemap, tonemap))
+    {
+        cerr << "Unknown tonemap " << options.tonemap << endl;
+        return 1;
+    }
+    ImageFormat format = IMAGE_PNG;
+    const bool streaming = !options.stream.empty();
+    const bool tiled = !options.tiledPath.empty();
+    if (tiled && (options.integrator != "path" || options.restirFrames > 0 || options.denoisePasses > 0 ||
+                  options.visibilityGrid > 0 || streaming))
+    {
+        cerr << "--tiled only works with the plain path tracer, without --denoise, --visibility or --stream" << endl;
+        return 1;
+    }
+    const bool progressive = options.passes > 1 || !options.checkpointPath.empty();
+    if (progressive && (options.integrator != "path" || options.restirFrames > 0 || options.denoisePasses > 0 ||
+                        options.visibilityGrid > 0 || options.guideIterations > 0 || options.cacheDepth > 0 ||
+                        streaming || tiled))
+    {
+        cerr << "--passes and --checkpoint only work with the plain path tracer, without --denoise, --visibility, "
+             << "--guide, --cache, --stream or --tiled" << endl;
+        return 1;
+    }
+    const bool deadline = options.timeBudget > 0.0;
+    if (deadline && (options.integrator != "path" || options.restirFrames > 0 || options.visibilityGrid > 0 ||
+                     progressive || tiled))
+    {
+        cerr << "--time only works with the plain path tracer, without --visibility, --passes, --checkpoint or --tiled"
+             << endl;
+        return 1;
+    }
+    const bool animating = !options.animationPath.empty();
+    if (animating && (options.integrator != "path" || options.restirFrames > 0 || options.denoisePasses > 0 ||
+                      options.visibilityGrid > 0 || options.guideIterations > 0 || options.cacheDepth > 0 ||
+                      progressive || deadline || options.preview || tiled))
+    {
+        cerr << "--animate only works with the plain path tracer, without --denoise, --visibility, --guide, --cache, "
+             << "--passes, --checkpoint, --time, --preview or --tiled" << endl;
+        return 1;
+    }
+    Animation animation;
+    string animationError;
+    if (animating && !animation.load(options.animationPath, animationError))
+    {
+        cerr << animationError << endl;
+        return 1;
+    }
+    if (options.preview && (options.integrator != "path" || options.restirFrames > 0 || progressive || deadline ||
+                            streaming || tiled))
+    {
+        cerr << "--preview only works with the plain path tracer, without --passes, --checkpoint, --time, --stream or "
+             << "--tiled" << endl;
+        return 1;
+    }
+    // Streams and tiled TIFFs take raw samples of any of the bit depths
+    const bool rawSamples = streaming || tiled;
+    if (rawSamples ? (options.bitDepth != 8 && options.bitDepth != 16 && options.bitDepth != 32)
+                   : (!parseImageFormat(options.format, format) ||
+                      (!isFloatFormat(format) && options.bitDepth != 8 && options.bitDepth != 16) ||
+                      (format == IMAGE_QOI && options.bitDepth == 16)))
+    {
+        cerr << "Cannot write " << options.bitDepth << "-bit " << (rawSamples ? "raw samples" : options.format) << endl;
+        return 1;
+    }
+    if (options.stream == "-")
+    {
+        // stdout carries the frames, so messages go to stderr
+        cout.rdbuf(cerr.rdbuf());
+    }
+
     auto start = chrono::steady_clock::now();
 
     cout << "Ray tracing image ..." << endl;
 
     vector<Hitable*> list;
-    list.push_back(new Sphere(vec3(0, 0, -1), 0.5, new Lambertian(vec3(1.0, 0.25, 0.25))));
-    list.push_back(new Sphere(vec3(0, -2500.5, -1), 2500, new Lambertian(vec3(0.8 , 0.8, 0))));
-    // list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new Lambertian(vec3(1.0, 0.7, 0.2))));
-    // list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new Lambertian(vec3(0, 0, 0.8))));
-    // list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new Metal(vec3(0.8, 0.6, 0.2), 0.0)));
-    // list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new Metal(vec3(0.8, 0.8, 0.8), 0.25)));
-    list.push_back(new Sphere(vec3(1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.6, 0.2), 0.0, 0)));
-    list.push_back(new Sphere(vec3(-1, 0, -1), 0.5, new CookTorrance(vec3(0.8, 0.8, 0.8), 0.0, 0)));
+    Scene scene;
+    if (options.scene == "manylights")
+    {
+        buildManyLightsScene(list, scene.lights, options.numLights);
+        scene.sky = false;
+    }
+    else if (options.scene == "occluded")
+    {
+        buildOccludedScene(list, scene.lights);
+        scene.sky = false;
+    }
+    else if (options.scene == "large")
+    {
+        buildLargeScene(list, scene.lights, options.numSpheres);
+    }
+    else
+    {
+        buildDefaultScene(list, scene.lights);
+    }
+
+    if (animating && !animation.bind(list, animationError))
+    {
+        cerr << animationError << endl;
+        return 1;
+    }
 
     HitableList world(list);
+    scene.world = &world;
+
+    BVH bvh;
+    if (options.accel == "bvh")
+    {
+        bvh.build(world.list);
+        bvh.interleave = options.interleave;
+        scene.world = &bvh;
+    }
+
+    LightBVH lightBVH;
+    if (options.lightSampler == "bvh")
+    {
+        lightBVH.build(scene.lights);
+        scene.pLightBVH = &lightBVH;
+    }
+
+    EnvironmentMap env;
+    if (!options.envPath.empty())
+    {
+        if (!env.load(options.envPath))
+        {
+            cerr << "Could not load environment map " << options.envPath << endl;
+            return 1;
+        }
+        env.scale = options.envScale;
+        scene.pEnv = &env;
+    }
+
     Camera cam(65, 16.0 / 9.0);
-    vector<unsigned char> pixels(N_X * N_Y * N_CHANNELS, 0);
 
-    // Create and kick off threads for subsections of pixels.
-    const int NUM_THREADS = int(thread::hardware_concurrency());
-    vector<thread> threads(NUM_THREADS);
-    for (int i = 0; i < NUM_THREADS; i++)
+    vec3 sceneLo;
+    vec3 sceneHi;
+    world.boundingBox(sceneLo, sceneHi);
+    PathGuide guide(sceneLo, sceneHi);
+    if (options.guideIterations > 0)
     {
-        threads[i] = thread(
-            processPixels,
-            (i * N_X * N_Y) / (int)NUM_THREADS,
-            ((i + 1) * (N_X * N_Y)) / (int)NUM_THREADS,
-            &cam,
-            (Hitable*)&world,
-            &pixels
-        );
+        scene.pGuide = &guide;
+        trainPathGuide(&cam, &scene, options.guideIterations);
     }
 
-    // Block until all threads are complete.
-    for (int i = 0; i < NUM_THREADS; i++)
+    RadianceCache cache(options.cacheCellSize, options.cacheError, options.cacheDepth);
+    if (options.cacheDepth > 0)
+    {
+        scene.pCache = &cache;
+        fillRadianceCache(&cam, &scene, options.cacheSpp);
+    }
+
+    PostSettings post;
+    post.exposure = options.exposure;
+    post.dither = options.dither;
+    post.tonemap = tonemap;
+
+    // Nothing the size of the image is allocated unless it is needed, so
+    // tiled renders can be larger than memory
+    vector<vec3> colors;
+    AOVBuffers aovs(options.denoisePasses > 0 ? N_X * N_Y : 0);
+    bool tilesWritten = false;
+    bool framesWritten = false;
+    bool haveAOVs = false;
+
+    if (tiled)
     {
-        threads[i].join();
+        tilesWritten = renderTiled(&cam, &scene, options.tiledPath, options.bitDepth, post);
     }
+    else if (animating)
+    {
+        const int firstFrame = options.firstFrame >= 0 ? options.firstFrame : animation.firstFrame;
+        const int lastFrame = options.lastFrame >= 0 ? options.lastFrame : animation.lastFrame;
+        if (streaming)
+        {
+            FrameStream stream(options.stream);
+            framesWritten = renderAnimation(&cam, &scene, &bvh, &lightBVH, animation, firstFrame, lastFrame, &stream,
+                                            format, options, post);
+            framesWritten = stream.finish() && framesWritten;
+        }
+        else
+        {
+            framesWritten = renderAnimation(&cam, &scene, &bvh, &lightBVH, animation, firstFrame, lastFrame, nullptr,
+                                            format, options, post);
+        }
+    }
+    else if (options.restirFrames > 0)
+    {
+        // Reservoir resampled direct lighting, averaged over a few frames
+        colors = renderReSTIR(&cam, &scene, options.restirFrames);
+    }
+    else if (options.integrator == "bdpt")
+    {
+        colors = renderBDPT(&cam, &scene);
+    }
+    else if (options.integrator == "mlt")
+    {
+        colors = renderPSSMLT(&cam, &scene);
+    }
+    else if (options.integrator == "wavefront")
+    {
+        colors = renderWavefront(&cam, &scene, options.sortRays);
+    }
+    else if (deadline)
+    {
+        // The budget counts from the start, setting up the scene included
+        colors = renderToDeadline(&cam, &scene, start + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                            chrono::duration<double>(options.timeBudget)), post);
+    }
+    else if (progressive)
+    {
+        // Everything the samples depend on, so that a checkpoint is only
+        // resumed by the render that wrote it
+        const string settings = to_string(N_X) + " " + to_string(N_Y) + " " + to_string(N_S) + " " +
+                                to_string(N_BOUNCES) + " " + options.scene + " " + to_string(options.numLights) + " " +
+                                to_string(options.numSpheres) + " " + options.accel + " " + options.lightSampler + " " +
+                                options.envPath + " " + to_string(options.envScale);
+        const int passes = min(max(options.passes, 1), N_S);
 
-    // Write to PNG file
-    int x = N_X;
-    int y = N_Y;
-    int n = N_CHANNELS;
-    stbi_write_png("image.png", x, y, n, pixels.data(), 0);
+        Framebuffer film(N_X, N_Y);
+        auto preview = [&](const vector<vec3>& image)
+        {
+            writePreview(image, format, options.bitDepth, options.pngLevel, post);
+        };
+        if (!renderProgressive(&cam, &scene, &film, passes, options.checkpointPath, hashSettings(settings), preview))
+        {
+            return 1;
+        }
+        colors = film.resolve();
+    }
+    else
+    {
+        AOVBuffers* pAOVs = options.denoisePasses > 0 ? &aovs : nullptr;
+        haveAOVs = pAOVs != nullptr;
+
+        VisibilityBuffer visibility(options.visibilityGrid);
+        if (options.visibilityGrid > 0)
+        {
+            visibility.build(&cam, world.list);
+        }
+
+        Framebuffer film(N_X, N_Y);
+        if (options.preview)
+        {
+            renderPreviewLevels(&cam, &scene, &film, format, options.bitDepth, options.pngLevel, post, start);
+        }
+
+        // Create and kick off threads for subsections of tiles.
+        const int NUM_THREADS = int(thread::hardware_concurrency());
+        vector<thread> threads(NUM_THREADS);
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            threads[i] = thread(
+                processPixels,
+                (i * film.numTiles()) / (int)NUM_THREADS,
+                ((i + 1) * film.numTiles()) / (int)NUM_THREADS,
+                &cam,
+                &scene,
+                &film,
+                pAOVs,
+                options.visibilityGrid > 0 ? &visibility : nullptr
+            );
+        }
+
+        // Block until all threads are complete.
+        for (int i = 0; i < NUM_THREADS; i++)
+        {
+            threads[i].join();
+        }
+        colors = film.resolve();
+    }
+
+    if (options.denoisePasses > 0)
+    {
+        if (!haveAOVs)
+        {
+            renderAOVs(&cam, &scene, aovs, min(N_S, 16));
+        }
+        colors = denoise(colors, aovs, N_X, N_Y, options.denoisePasses);
+    }
+
+    string path;
+    bool written;
+    if (tiled)
+    {
+        path = options.tiledPath;
+        written = tilesWritten;
+    }
+    else if (animating)
+    {
+        path = streaming ? options.stream : string("image.NNNN.") + imageExtension(format);
+        written = framesWritten;
+    }
+    else if (streaming)
+    {
+        path = options.stream;
+        FrameStream stream(path);
+        stream.submit(encodeFrame(colors, options.bitDepth, post));
+        written = stream.finish();
+    }
+    else
+    {
+        path = string("image.") + imageExtension(format);
+        written = writeImage(path, colors, format, options.bitDepth, options.pngLevel, post);
+    }
+    if (!written)
+    {
+        cerr << "Could not write " << path << endl;
+        return 1;
+    }
 
     cout << "Done!" << endl;
 